@@ -0,0 +1,228 @@
+////////////////////////////////////////////////////////////
+//
+// Benchmark driver for the ENet Squirrel binding
+//
+// Runs enetbench.nut in a fresh VM with the binding registered
+// and writes one JSON object per line for every result the script
+// reports, so runs can be diffed or loaded by other tools.
+//
+// Usage: enetbench [--quick] [--system-malloc] [--output file] [script]
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+// Headers
+////////////////////////////////////////////////////////////
+#include <sqrat.h>
+#include <sqstdaux.h>
+#include <sqstdblob.h>
+#include <sqstdio.h>
+#include <sqstdmath.h>
+#include <sqstdstring.h>
+#include <enet/enetsqrat.hpp>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifndef ENETBENCH_SCRIPT
+#define ENETBENCH_SCRIPT "enetbench.nut"
+#endif
+
+
+////////////////////////////////////////////////////////////
+static std::FILE* output = stdout;
+static std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+
+////////////////////////////////////////////////////////////
+static void print_function(HSQUIRRELVM v, const SQChar* format, ...)
+{
+    (void) v;
+    va_list args;
+    va_start(args, format);
+    std::vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+
+////////////////////////////////////////////////////////////
+static void write_json_string(const SQChar* text)
+{
+    std::fputc('"', output);
+    for (const SQChar* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            std::fprintf(output, "\\%c", (char) *c);
+        } else if ((unsigned) *c < 0x20) {
+            std::fprintf(output, "\\u%04x", (unsigned) *c);
+        } else {
+            std::fputc((char) *c, output);
+        }
+    }
+    std::fputc('"', output);
+}
+
+
+////////////////////////////////////////////////////////////
+// Seconds since the driver started
+////////////////////////////////////////////////////////////
+static SQInteger bench_clock(HSQUIRRELVM v)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    sq_pushfloat(v, (SQFloat) elapsed.count());
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Runs a full garbage collection and returns how many objects it freed
+////////////////////////////////////////////////////////////
+static SQInteger bench_gc(HSQUIRRELVM v)
+{
+    sq_pushinteger(v, sq_collectgarbage(v));
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Resident set size in bytes, or 0 where it can't be read
+////////////////////////////////////////////////////////////
+static SQInteger bench_rss(HSQUIRRELVM v)
+{
+    long long bytes = 0;
+#ifndef _WIN32
+    std::FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        long long size, resident;
+        if (std::fscanf(statm, "%lld %lld", &size, &resident) == 2) {
+            bytes = resident * sysconf(_SC_PAGESIZE);
+        }
+        std::fclose(statm);
+    }
+#endif
+    sq_pushinteger(v, (SQInteger) bytes);
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Writes a table of numbers, strings and bools as one JSON line
+////////////////////////////////////////////////////////////
+static SQInteger bench_emit(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) != 2 || sq_gettype(v, 2) != OT_TABLE) {
+        return sq_throwerror(v, _SC("bench_emit expects a table"));
+    }
+    bool first = true;
+    std::fputc('{', output);
+    sq_pushnull(v);
+    while (SQ_SUCCEEDED(sq_next(v, 2))) {
+        const SQChar* key;
+        if (SQ_SUCCEEDED(sq_getstring(v, -2, &key))) {
+            if (!first) std::fputc(',', output);
+            first = false;
+            write_json_string(key);
+            std::fputc(':', output);
+            SQInteger integer;
+            SQFloat number;
+            SQBool boolean;
+            const SQChar* text;
+            switch (sq_gettype(v, -1)) {
+            case OT_INTEGER :
+                sq_getinteger(v, -1, &integer);
+                std::fprintf(output, "%lld", (long long) integer);
+                break;
+            case OT_FLOAT :
+                sq_getfloat(v, -1, &number);
+                std::fprintf(output, "%.9g", (double) number);
+                break;
+            case OT_BOOL :
+                sq_getbool(v, -1, &boolean);
+                std::fputs(boolean ? "true" : "false", output);
+                break;
+            case OT_STRING :
+                sq_getstring(v, -1, &text);
+                write_json_string(text);
+                break;
+            default :
+                std::fputs("null", output);
+                break;
+            }
+        }
+        sq_pop(v, 2);
+    }
+    sq_pop(v, 1);
+    std::fputs("}\n", output);
+    std::fflush(output);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+    const char* script = ENETBENCH_SCRIPT;
+    bool quick = false;
+    bool systemMalloc = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (std::strcmp(argv[i], "--system-malloc") == 0) {
+            systemMalloc = true;
+        } else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = std::fopen(argv[++i], "w");
+            if (output == NULL) {
+                std::fprintf(stderr, "Can't open %s\n", argv[i]);
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            std::fprintf(stderr, "Usage: %s [--quick] [--system-malloc] [--output file] [script]\n", argv[0]);
+            return 1;
+        } else {
+            script = argv[i];
+        }
+    }
+
+    if ((systemMalloc ? enet_initialize() : InitializeEnetLib()) != 0) {
+        std::fprintf(stderr, "Failed to initialize ENet\n");
+        return 1;
+    }
+
+    HSQUIRRELVM v = sq_open(1024);
+    sq_setprintfunc(v, print_function, print_function);
+    sq_pushroottable(v);
+    sqstd_register_bloblib(v);
+    sqstd_register_iolib(v);
+    sqstd_register_mathlib(v);
+    sqstd_register_stringlib(v);
+    sqstd_seterrorhandlers(v);
+    sq_pop(v, 1);
+    Sqrat::DefaultVM::Set(v);
+
+    Sqrat::Table enetNamespace(v);
+    Sqrat::RootTable(v).Bind(_SC("enet"), enetNamespace);
+    RegisterEnetLib(v, enetNamespace);
+
+    Sqrat::RootTable root(v);
+    root.SquirrelFunc(_SC("bench_clock"), &bench_clock);
+    root.SquirrelFunc(_SC("bench_emit"), &bench_emit);
+    root.SquirrelFunc(_SC("bench_gc"), &bench_gc);
+    root.SquirrelFunc(_SC("bench_rss"), &bench_rss);
+    root.SetValue(_SC("bench_quick"), quick);
+    root.SetValue(_SC("bench_allocator"), systemMalloc ? _SC("system") : _SC("pool"));
+
+    sq_pushroottable(v);
+    bool ok = SQ_SUCCEEDED(sqstd_dofile(v, script, SQFalse, SQTrue));
+    sq_pop(v, 1);
+
+    root.Release();
+    enetNamespace.Release();
+    sq_close(v);
+    enet_deinitialize();
+    if (output != stdout) std::fclose(output);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+////////////////////////////////////////////////////////////
+//
+// Benchmarks for the binding's hot paths, run by enetbench
+//
+// Every result is reported through bench_emit as one JSON line
+// named by its "bench" field. Hosts talk over loopback sockets
+// made by enet.loopback_create, so runs don't need free ports.
+//
+////////////////////////////////////////////////////////////
+
+local SCALE = bench_quick ? 0.1 : 1.0;
+local PAYLOAD_SIZES = [16, 64, 256, 1024, 4096];
+local PEER_COUNTS = [1, 16, 256, 1024];
+local TIMEOUT = 30.0;
+
+
+////////////////////////////////////////////////////////////
+// A string of the given length
+////////////////////////////////////////////////////////////
+function payload(size)
+{
+    local text = "";
+    while (text.len() < size) text += "0123456789abcdef";
+    return text.slice(0, size);
+}
+
+
+////////////////////////////////////////////////////////////
+// Scales an iteration count for --quick runs, never below 1
+////////////////////////////////////////////////////////////
+function scaled(count)
+{
+    local n = (count * SCALE).tointeger();
+    return n > 0 ? n : 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// A loopback server with the given number of clients connected to it
+////////////////////////////////////////////////////////////
+function connect_pair(peers, channels = 1)
+{
+    local server = enet.loopback_create(peers, channels);
+    local client = enet.host_create(null, peers, channels);
+    local address = server.address();
+    for (local i = 0; i < peers; i++) {
+        client.connect(address, channels);
+    }
+    local serverPeers = [];
+    local clientPeers = [];
+    local deadline = bench_clock() + TIMEOUT;
+    while (serverPeers.len() < peers || clientPeers.len() < peers) {
+        if (bench_clock() > deadline) throw "connecting " + peers + " peers timed out";
+        local event;
+        while ((event = server.service(1)) != null) {
+            if (event.type == ENET_EVENT_TYPE_CONNECT) serverPeers.append(event.peer);
+        }
+        while ((event = client.service(0)) != null) {
+            if (event.type == ENET_EVENT_TYPE_CONNECT) clientPeers.append(event.peer);
+        }
+    }
+    return { server = server, client = client, serverPeers = serverPeers, clientPeers = clientPeers };
+}
+
+
+////////////////////////////////////////////////////////////
+function close_pair(pair)
+{
+    foreach (peer in pair.clientPeers) peer.disconnect_now();
+    pair.client.destroy();
+    pair.server.destroy();
+}
+
+
+////////////////////////////////////////////////////////////
+// Keeps both ends moving until the server has received count packets, using one of its drain styles
+////////////////////////////////////////////////////////////
+function drain(pair, count, style)
+{
+    local received = 0;
+    local deadline = bench_clock() + TIMEOUT;
+    local batch = [];
+    while (received < count) {
+        if (bench_clock() > deadline) throw "draining " + count + " packets timed out";
+        local event;
+        if (style == "service") {
+            while ((event = pair.server.service(0)) != null) {
+                if (event.type == ENET_EVENT_TYPE_RECEIVE) received++;
+            }
+        } else if (style == "check_events") {
+            // One service reads the socket, check_events hands out the rest of what it queued
+            event = pair.server.service(0);
+            while (event != null) {
+                if (event.type == ENET_EVENT_TYPE_RECEIVE) received++;
+                event = pair.server.check_events();
+            }
+        } else {
+            foreach (event in pair.server.service_batch(0, 0, batch)) {
+                if (event.type == ENET_EVENT_TYPE_RECEIVE) received++;
+            }
+        }
+        pair.client.service(0);
+    }
+    return received;
+}
+
+
+////////////////////////////////////////////////////////////
+// Events per second handed to scripts by service, check_events and service_batch
+////////////////////////////////////////////////////////////
+function bench_receive()
+{
+    local count = scaled(200000);
+    local burst = 500;
+    foreach (style in ["service", "check_events", "service_batch"]) {
+        foreach (size in [16, 256, 1024]) {
+            local pair = connect_pair(1);
+            local data = payload(size);
+            local peer = pair.clientPeers[0];
+            local start = bench_clock();
+            for (local sent = 0; sent < count; sent += burst) {
+                for (local i = 0; i < burst; i++) peer.send(data, 0, ENET_PACKET_FLAG_RELIABLE);
+                pair.client.flush();
+                drain(pair, burst, style);
+            }
+            local elapsed = bench_clock() - start;
+            bench_emit({ bench = "receive", style = style, payload = size, packets = count, seconds = elapsed, events_per_sec = count / elapsed });
+            close_pair(pair);
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Packets per second queued by Peer.send and Host.broadcast
+////////////////////////////////////////////////////////////
+function bench_send()
+{
+    foreach (peers in PEER_COUNTS) {
+        local pair = connect_pair(peers);
+        foreach (size in PAYLOAD_SIZES) {
+            local data = payload(size);
+            local rounds = scaled(200000) / peers;
+            if (rounds < 10) rounds = 10;
+
+            local start = bench_clock();
+            for (local r = 0; r < rounds; r++) {
+                foreach (peer in pair.serverPeers) peer.send(data, 0, ENET_PACKET_FLAG_UNSEQUENCED);
+                if (r % 16 == 15) pair.server.flush();
+            }
+            pair.server.flush();
+            local elapsed = bench_clock() - start;
+            local packets = rounds * peers;
+            bench_emit({ bench = "send", peers = peers, payload = size, packets = packets, seconds = elapsed, packets_per_sec = packets / elapsed, bytes_per_sec = packets * size / elapsed });
+            while (pair.client.service(0) != null) {}
+
+            start = bench_clock();
+            for (local r = 0; r < rounds; r++) {
+                pair.server.broadcast(data, 0, ENET_PACKET_FLAG_UNSEQUENCED);
+                if (r % 16 == 15) pair.server.flush();
+            }
+            pair.server.flush();
+            elapsed = bench_clock() - start;
+            bench_emit({ bench = "broadcast", peers = peers, payload = size, calls = rounds, seconds = elapsed, calls_per_sec = rounds / elapsed, packets_per_sec = packets / elapsed });
+            while (pair.client.service(0) != null) {}
+        }
+        close_pair(pair);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Cost of Peer.index at large peer counts
+////////////////////////////////////////////////////////////
+function bench_index()
+{
+    foreach (peers in [16, 256, 1024, 4000]) {
+        local pair = connect_pair(peers);
+        local calls = scaled(2000000);
+        local rounds = calls / peers;
+        if (rounds < 1) rounds = 1;
+        local sum = 0;
+        local start = bench_clock();
+        for (local r = 0; r < rounds; r++) {
+            foreach (peer in pair.serverPeers) sum += peer.index();
+        }
+        local elapsed = bench_clock() - start;
+        calls = rounds * peers;
+        bench_emit({ bench = "peer_index", peers = peers, calls = calls, seconds = elapsed, ns_per_call = elapsed * 1e9 / calls });
+        close_pair(pair);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Objects collected and memory grown per million received packets, by receive mode
+////////////////////////////////////////////////////////////
+function bench_pressure()
+{
+    local count = scaled(1000000);
+    local burst = 1000;
+    local modes = { string = ENET_RECEIVE_STRING, packet = ENET_RECEIVE_PACKET };
+    foreach (name, mode in modes) {
+        // Identical payloads hit strings already interned; distinct ones grow the string table
+        foreach (distinct in [false, true]) {
+            local pair = connect_pair(1);
+            pair.server.receive_mode(mode);
+            local peer = pair.clientPeers[0];
+            local data = payload(48);
+            bench_gc();
+            local rss = bench_rss();
+            local collected = 0;
+            local start = bench_clock();
+            for (local sent = 0; sent < count; sent += burst) {
+                for (local i = 0; i < burst; i++) {
+                    peer.send(distinct ? data + (sent + i) : data, 0, ENET_PACKET_FLAG_RELIABLE);
+                }
+                pair.client.flush();
+                drain(pair, burst, "service_batch");
+                if (sent % 100000 == 0) collected += bench_gc();
+            }
+            local elapsed = bench_clock() - start;
+            collected += bench_gc();
+            local perMillion = 1000000.0 / count;
+            bench_emit({ bench = "receive_pressure", mode = name, distinct_payloads = distinct, packets = count, seconds = elapsed,
+                         gc_objects_per_million = collected * perMillion, rss_growth_per_million = (bench_rss() - rss) * perMillion });
+            close_pair(pair);
+        }
+    }
+}
+
+
+bench_emit({ bench = "meta", allocator = bench_allocator, quick = bench_quick, version = _version_ });
+bench_receive();
+bench_send();
+bench_index();
+bench_pressure();
@@ -0,0 +1,33 @@
+////////////////////////////////////////////////////////////
+//
+// Stand-in for the engine header the binding is normally built against,
+// providing only what enetsqrat.cpp uses so the benchmarks build on their own.
+//
+////////////////////////////////////////////////////////////
+
+#ifndef WIZZARDSREALMS_HPP
+#define WIZZARDSREALMS_HPP
+
+////////////////////////////////////////////////////////////
+// Headers
+////////////////////////////////////////////////////////////
+#include <sqrat.h>
+#include <cstdio>
+
+
+namespace wr
+{
+
+////////////////////////////////////////////////////////////
+// Prints a message on behalf of the given VM
+////////////////////////////////////////////////////////////
+inline void Print(HSQUIRRELVM v, const char* message)
+{
+    (void) v;
+    std::fputs(message, stderr);
+}
+
+} // namespace wr
+
+
+#endif // WIZZARDSREALMS_HPP
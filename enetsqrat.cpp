@@ -26,117 +26,7112 @@
 ////////////////////////////////////////////////////////////
 #include <wizzardsrealms.hpp>
 #include <enet/enetsqrat.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+
+////////////////////////////////////////////////////////////
+// How received payloads are handed to scripts
+////////////////////////////////////////////////////////////
+enum EnetReceiveMode
+{
+    ENET_RECEIVE_STRING,  // Payloads are copied into script strings
+    ENET_RECEIVE_PACKET,  // Payloads are wrapped in an enet.Packet without copying
+    ENET_RECEIVE_DECODED  // Payloads are decoded from the native serializer format
+};
+
+
+////////////////////////////////////////////////////////////
+// Fixed-size lock-free queue for exactly one producer thread and one consumer thread
+////////////////////////////////////////////////////////////
+template <typename T>
+class EnetSpscQueue
+{
+public:
+    explicit EnetSpscQueue(std::size_t capacity) : mask(1), head(0), tail(0)
+    {
+        while (mask < capacity) mask <<= 1;
+        items.resize(mask);
+        mask -= 1;
+    }
+
+    bool push(const T& item)
+    {
+        std::size_t back = tail.load(std::memory_order_relaxed);
+        if (back - head.load(std::memory_order_acquire) > mask) return false;
+        items[back & mask] = item;
+        tail.store(back + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::size_t front = head.load(std::memory_order_relaxed);
+        if (front == tail.load(std::memory_order_acquire)) return false;
+        item = items[front & mask];
+        head.store(front + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> items;
+    std::size_t mask;
+    char padding0[64];
+    std::atomic<std::size_t> head; // Only written by the consumer
+    char padding1[64];
+    std::atomic<std::size_t> tail; // Only written by the producer
+};
+
+
+////////////////////////////////////////////////////////////
+// Event types raised by the binding itself, numbered well clear of ENetEventType
+////////////////////////////////////////////////////////////
+enum EnetBindingEventType
+{
+    ENET_EVENT_TYPE_SHARD_MESSAGE = 100, // A script on another shard called Host.post
+    ENET_EVENT_TYPE_WRITABLE = 101,      // A peer refused by send drained below its low-water mark
+    ENET_EVENT_TYPE_CONNECT_READY = 102, // Host.connect_async resolved its address and started connecting
+    ENET_EVENT_TYPE_CONNECT_FAILED = 103, // Host.connect_async could not resolve its address or get a peer
+    ENET_EVENT_TYPE_REPLAY_DONE = 104,    // Host.replay reached the end of its log
+    ENET_EVENT_TYPE_STREAM_PROGRESS = 105, // An incoming stream passed another step of its size
+    ENET_EVENT_TYPE_STREAM_COMPLETE = 106, // An incoming stream arrived whole
+    ENET_EVENT_TYPE_STREAM_FAILED = 107,  // An incoming stream was refused, or abandoned by its sender
+    ENET_EVENT_TYPE_STREAM_SENT = 108,    // The last chunk of an outgoing stream was queued
+    ENET_EVENT_TYPE_STREAM_CANCELLED = 109 // An outgoing stream was refused by the peer or couldn't be read
+};
+
+
+////////////////////////////////////////////////////////////
+// Disconnect data sent to, and reported for, a peer cut off by Host.flood_limit
+////////////////////////////////////////////////////////////
+static const enet_uint32 ENET_DISCONNECT_FLOOD = 0x464C4F44;
+
+
+////////////////////////////////////////////////////////////
+// Event as queued for and delivered to scripts; ENetEvent with room for binding events
+////////////////////////////////////////////////////////////
+struct EnetScriptEvent
+{
+    EnetScriptEvent() : type(ENET_EVENT_TYPE_NONE), peer(NULL), channelID(0), data(0), packet(NULL), offset(0), length(0), shared(false), replayed(false) {}
+
+    int type;
+    ENetPeer* peer;
+    enet_uint8 channelID;
+    enet_uint32 data;
+    ENetPacket* packet;
+    std::size_t offset;  // Start of the message within the packet
+    std::size_t length;  // Length of the message, the whole packet unless it was coalesced
+    bool shared;         // One of several messages split from a packet, each holding a reference
+    bool replayed;       // Fed by Host.replay; the binding keeps no peer state or traffic stats for it
+};
+
+
+////////////////////////////////////////////////////////////
+static EnetScriptEvent script_event(const ENetEvent& event)
+{
+    EnetScriptEvent result;
+    result.type = event.type;
+    result.peer = event.peer;
+    result.channelID = event.channelID;
+    result.data = event.data;
+    result.packet = event.type == ENET_EVENT_TYPE_RECEIVE ? event.packet : NULL;
+    result.length = result.packet != NULL ? result.packet->dataLength : 0;
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////
+// Packet handed from the VM thread to the network thread; each one owns a packet reference
+////////////////////////////////////////////////////////////
+struct EnetSendCommand
+{
+    ENetPeer* peer;    // NULL to broadcast to every peer of the host
+    enet_uint8 channelID;
+    ENetPacket* packet;
+};
+
+
+////////////////////////////////////////////////////////////
+// Message passed from one shard's VM thread to another shard's network thread;
+// each one owns a packet reference
+////////////////////////////////////////////////////////////
+enum EnetShardMessageType
+{
+    SHARD_FORWARD,   // Send to one peer of the target shard
+    SHARD_BROADCAST, // Send to every peer of the target shard
+    SHARD_POST       // Deliver to the target shard's scripts as an event
+};
+
+struct EnetShardMessage
+{
+    int type;
+    std::size_t from;
+    SQInteger peerID; // Stable ID of the SHARD_FORWARD target
+    enet_uint8 channelID;
+    ENetPacket* packet;
+};
+
+
+////////////////////////////////////////////////////////////
+// Hosts sharing one address, each serviced by its own network thread and VM
+////////////////////////////////////////////////////////////
+struct EnetShardGroup
+{
+    std::vector<ENetHost*> hosts;
+    std::vector<EnetSpscQueue<EnetShardMessage>*> mailboxes; // mailboxes[from * count + to], NULL when from == to
+};
+
+
+////////////////////////////////////////////////////////////
+// Network thread servicing a host on behalf of the VM thread
+//
+// The thread owns the socket and all ENet protocol work. Events
+// travel to the VM through one queue and outgoing packets come
+// back through another; rarer calls such as connect or
+// disconnect take the lock, which the thread holds only while
+// it is inside ENet.
+//
+////////////////////////////////////////////////////////////
+struct EnetHostThread
+{
+    EnetHostThread(ENetHost* host, std::size_t capacity, enet_uint32 interval) : host(host), shards(NULL), shardIndex(0), events(capacity), sends(capacity), interval(interval), running(true), failed(false) {}
+
+    ENetHost* host;
+    EnetShardGroup* shards;            // Set when the host is one shard of a group
+    std::size_t shardIndex;
+    std::thread thread;
+    std::mutex lock;                   // Held around every ENet call on this host
+    std::mutex waitLock;
+    std::condition_variable ready;     // Signalled when events arrive while the VM is waiting
+    EnetSpscQueue<EnetScriptEvent> events; // Network thread to VM thread
+    EnetSpscQueue<EnetSendCommand> sends; // VM thread to network thread, drained under lock
+    std::deque<EnetScriptEvent> overflow; // Events the network thread could not queue yet
+    enet_uint32 interval;              // Longest time the thread sleeps on the socket
+    std::atomic<bool> running;
+    std::atomic<bool> failed;          // Servicing failed and the VM has not been told yet
+};
+
+
+////////////////////////////////////////////////////////////
+// Script handle to an ENetPacket that shares its reference count
+////////////////////////////////////////////////////////////
+class EnetPacketBuffer
+{
+public:
+    EnetPacketBuffer() : packet(NULL), position(0), capacity(0)
+    {
+        create(0, ENET_PACKET_FLAG_RELIABLE);
+    }
+
+    explicit EnetPacketBuffer(std::size_t reserve) : packet(NULL), position(0), capacity(0)
+    {
+        create(reserve, ENET_PACKET_FLAG_RELIABLE);
+    }
+
+    EnetPacketBuffer(std::size_t reserve, enet_uint32 flags) : packet(NULL), position(0), capacity(0)
+    {
+        create(reserve, flags);
+    }
+
+    explicit EnetPacketBuffer(ENetPacket* source) : packet(source), position(0), capacity(source ? source->dataLength : 0)
+    {
+        if (packet) ++packet->referenceCount;
+    }
+
+    EnetPacketBuffer(const EnetPacketBuffer& other) : packet(other.packet), position(other.position), capacity(other.capacity)
+    {
+        if (packet) ++packet->referenceCount;
+    }
+
+    ~EnetPacketBuffer()
+    {
+        release();
+    }
+
+    EnetPacketBuffer& operator=(const EnetPacketBuffer& other)
+    {
+        if (other.packet) ++other.packet->referenceCount;
+        release();
+        packet = other.packet;
+        position = other.position;
+        capacity = other.capacity;
+        return *this;
+    }
+
+    std::size_t size() const
+    {
+        return packet ? packet->dataLength : 0;
+    }
+
+    // Extends the written part by size bytes and returns where they start, or NULL if out of memory
+    enet_uint8* append(std::size_t size)
+    {
+        std::size_t length = packet->dataLength;
+        if (size > capacity - length) {
+            std::size_t grown = capacity * 2;
+            if (grown < length + size) grown = length + size;
+            if (grown < 64) grown = 64;
+            // enet_packet_resize copies dataLength bytes, which is exactly the written part
+            if (enet_packet_resize(packet, grown) != 0) {
+                return NULL;
+            }
+            capacity = grown;
+        }
+        packet->dataLength = length + size;
+        return packet->data + length;
+    }
+
+    // Gives up this handle's reference without freeing, leaving the packet for ENet to own
+    ENetPacket* detach()
+    {
+        ENetPacket* detached = packet;
+        if (detached) --detached->referenceCount;
+        packet = NULL;
+        return detached;
+    }
+
+    ENetPacket* packet;
+    std::size_t position;
+    std::size_t capacity;
+
+private:
+    void create(std::size_t reserve, enet_uint32 flags)
+    {
+        // Allocate the full reserve up front and only expose what has been written
+        packet = enet_packet_create(NULL, reserve, flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED));
+        if (packet) {
+            ++packet->referenceCount;
+            packet->dataLength = 0;
+            capacity = reserve;
+        }
+    }
+
+    void release()
+    {
+        // ENet holds its own references while the packet is queued, so whoever drops the last one frees it
+        if (packet && --packet->referenceCount == 0) {
+            enet_packet_destroy(packet);
+        }
+        packet = NULL;
+    }
+};
+
+
+////////////////////////////////////////////////////////////
+// Bytes and packets counted by the binding as they pass to and from scripts
+////////////////////////////////////////////////////////////
+struct EnetTrafficStats
+{
+    EnetTrafficStats() : sentBytes(0), sentPackets(0), receivedBytes(0), receivedPackets(0) {}
+
+    unsigned long long sentBytes;
+    unsigned long long sentPackets;
+    unsigned long long receivedBytes;
+    unsigned long long receivedPackets;
+};
+
+
+////////////////////////////////////////////////////////////
+// Microsecond timings in power-of-two buckets; bucket i counts samples below 2^i us
+////////////////////////////////////////////////////////////
+static const std::size_t STATS_HISTOGRAM_BUCKETS = 24;
+
+struct EnetHistogram
+{
+    EnetHistogram() : count(0), sum(0)
+    {
+        std::memset(buckets, 0, sizeof(buckets));
+    }
+
+    unsigned long long buckets[STATS_HISTOGRAM_BUCKETS]; // The last bucket also takes everything slower
+    unsigned long long count;
+    unsigned long long sum;
+};
+
+
+////////////////////////////////////////////////////////////
+// Counters kept by the LZ compressor while a host uses it
+////////////////////////////////////////////////////////////
+struct EnetCompressionStats
+{
+    EnetCompressionStats() : packets(0), skipped(0), rawBytes(0), compressedBytes(0), compressTime(0), decompressedPackets(0), decompressedBytes(0), decompressTime(0), failures(0) {}
+
+    unsigned long long packets;             // Datagrams sent compressed
+    unsigned long long skipped;             // Datagrams sent raw because compression did not shrink them
+    unsigned long long rawBytes;            // Size of the compressed datagrams before compression
+    unsigned long long compressedBytes;
+    unsigned long long compressTime;        // Nanoseconds spent compressing, skipped datagrams included
+    unsigned long long decompressedPackets;
+    unsigned long long decompressedBytes;
+    unsigned long long decompressTime;      // Nanoseconds spent decompressing
+    unsigned long long failures;            // Received datagrams that failed to decompress
+};
+
+
+////////////////////////////////////////////////////////////
+// A Host.connect_async call waiting on, or finished with, the resolver thread
+////////////////////////////////////////////////////////////
+struct EnetResolveRequest
+{
+    enet_uint32 id;           // Returned by connect_async and carried by its events
+    std::string name;
+    ENetAddress address;      // Port filled in up front, host once resolved
+    std::size_t channelCount;
+    enet_uint32 data;         // Passed on to enet_host_connect
+    bool resolved;
+};
+
+
+////////////////////////////////////////////////////////////
+// Worker that resolves host names for one host; shared with the thread so the host can go first
+////////////////////////////////////////////////////////////
+struct EnetResolver
+{
+    EnetResolver() : stopping(false) {}
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<EnetResolveRequest> pending;
+    std::deque<EnetResolveRequest> done;  // Collected by the VM thread on its next service
+    bool stopping;
+};
+
+
+////////////////////////////////////////////////////////////
+// Counters for Host.snapshot_channel traffic
+////////////////////////////////////////////////////////////
+struct EnetSnapshotStats
+{
+    EnetSnapshotStats() : keyframes(0), deltas(0), rawBytes(0), sentBytes(0), undecodable(0), lateAcks(0) {}
+
+    unsigned long long keyframes;    // Snapshots sent whole because the peer had no usable baseline
+    unsigned long long deltas;
+    unsigned long long rawBytes;     // Size of the snapshots submitted by scripts
+    unsigned long long sentBytes;    // Size of the keyframes and deltas actually sent
+    unsigned long long undecodable;  // Received deltas whose baseline was gone
+    unsigned long long lateAcks;     // Acks for snapshots already dropped from the history, so the next one went whole
+};
+
+static const std::size_t SNAPSHOT_HISTORY = 16;      // Default snapshots kept per peer and direction while acks are in flight
+static const std::size_t SNAPSHOT_MAX_HISTORY = 1024; // Most Host.snapshot_channel lets a host keep
+
+
+////////////////////////////////////////////////////////////
+// Receive limits set by Host.rate_limit for one channel, applied to each peer separately
+////////////////////////////////////////////////////////////
+struct EnetRateLimit
+{
+    EnetRateLimit() : packetRate(0), packetBurst(0), byteRate(0), byteBurst(0), drop(true) {}
+
+    double packetRate;   // Packets per second, 0 for no packet limit
+    double packetBurst;
+    double byteRate;     // Bytes per second, 0 for no byte limit
+    double byteBurst;    // Must cover the largest packet the channel should ever accept
+    bool drop;           // Over-limit packets are dropped rather than only counted
+};
+
+
+////////////////////////////////////////////////////////////
+// Tokens a peer has left on one channel
+////////////////////////////////////////////////////////////
+struct EnetTokenBucket
+{
+    EnetTokenBucket() : packets(0), bytes(0), started(false) {}
+
+    double packets;
+    double bytes;
+    std::chrono::steady_clock::time_point refilled;
+    bool started;        // Buckets start full the first time the peer sends on the channel
+};
+
+
+////////////////////////////////////////////////////////////
+// How the outgoing scheduler treats one channel, set by Host.channel_priority and Host.supersede
+////////////////////////////////////////////////////////////
+struct EnetChannelSchedule
+{
+    EnetChannelSchedule() : priority(0), weight(1), supersede(false) {}
+
+    int priority;        // Lower goes first; a level is only served once every more urgent one is empty
+    unsigned weight;     // Share of the budget among channels of the same priority
+    bool supersede;      // A new unreliable packet replaces those still waiting on the channel
+};
+
+
+////////////////////////////////////////////////////////////
+// Packets a peer has waiting in the scheduler on one channel
+////////////////////////////////////////////////////////////
+struct EnetScheduledChannel
+{
+    EnetScheduledChannel() : deficit(0) {}
+
+    std::deque<EnetPacketBuffer> packets;
+    long long deficit;   // Bytes the channel may still send this round, carried over while it has packets
+};
+
+
+////////////////////////////////////////////////////////////
+// A snapshot kept as a baseline; the bytes are shared when one snapshot went to several peers
+////////////////////////////////////////////////////////////
+struct EnetSnapshot
+{
+    EnetSnapshot() : sequence(0) {}
+
+    enet_uint32 sequence;  // 0 for none
+    std::shared_ptr<const std::vector<enet_uint8> > bytes;
+};
+
+
+////////////////////////////////////////////////////////////
+// Traffic log written by Host.capture and read back by Host.replay
+//
+// A 16 byte header ("ENETCAP" and a zero byte, then the format
+// version and the capturing host's peer count as u32) is followed
+// by records of kind u8, channel u8, peer slot u16, flags u32,
+// microseconds since the capture started u64, payload length u32
+// and the payload. Everything is little-endian.
+//
+////////////////////////////////////////////////////////////
+static const char CAPTURE_MAGIC[8] = { 'E', 'N', 'E', 'T', 'C', 'A', 'P', '\0' };
+static const enet_uint32 CAPTURE_VERSION = 1;
+static const std::size_t CAPTURE_FILE_HEADER = 16;
+static const std::size_t CAPTURE_RECORD_HEADER = 20;
+static const std::size_t CAPTURE_CHUNK = 1 << 22;  // The log grows at least this much at a time
+static const enet_uint16 CAPTURE_NO_PEER = 0xFFFF; // Slot recorded for broadcasts
+
+
+////////////////////////////////////////////////////////////
+enum EnetCaptureKind
+{
+    CAPTURE_CONNECT = 1,   // Flags hold the event's data
+    CAPTURE_DISCONNECT,
+    CAPTURE_RECEIVE,       // Flags hold the packet's flags
+    CAPTURE_SEND,
+    CAPTURE_BROADCAST
+};
+
+
+////////////////////////////////////////////////////////////
+// Appends records to a capture log, through a growing memory map where the platform has one
+////////////////////////////////////////////////////////////
+class EnetCaptureWriter
+{
+public:
+    EnetCaptureWriter() : used(0), failed(false),
+#ifdef _WIN32
+        file(NULL)
+#else
+        fd(-1), map(NULL), mapped(0)
+#endif
+    {
+    }
+
+    ~EnetCaptureWriter()
+    {
+        close();
+    }
+
+    bool open(const std::string& path)
+    {
+#ifdef _WIN32
+        file = std::fopen(path.c_str(), "wb");
+        if (file == NULL) return false;
+#else
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+#endif
+        start = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // Returns false once the log can't take any more, after which it ignores further records
+    bool append(const enet_uint8* header, std::size_t headerLength, const enet_uint8* payload, std::size_t payloadLength)
+    {
+        if (failed) return false;
+#ifdef _WIN32
+        if (std::fwrite(header, 1, headerLength, file) != headerLength || (payloadLength > 0 && std::fwrite(payload, 1, payloadLength, file) != payloadLength)) {
+            failed = true;
+            return false;
+        }
+#else
+        if (used + headerLength + payloadLength > mapped && !grow(used + headerLength + payloadLength)) {
+            failed = true;
+            return false;
+        }
+        std::memcpy(map + used, header, headerLength);
+        if (payloadLength > 0) std::memcpy(map + used + headerLength, payload, payloadLength);
+#endif
+        used += headerLength + payloadLength;
+        return true;
+    }
+
+    // Returns the size of the finished log
+    std::size_t close()
+    {
+#ifdef _WIN32
+        if (file != NULL) {
+            std::fclose(file);
+            file = NULL;
+        }
+#else
+        if (map != NULL) {
+            munmap(map, mapped);
+            map = NULL;
+            mapped = 0;
+        }
+        if (fd >= 0) {
+            // Drop the unused tail left by the last grow
+            if (ftruncate(fd, used) != 0) failed = true;
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+        return used;
+    }
+
+    std::chrono::steady_clock::time_point start;
+
+private:
+    EnetCaptureWriter(const EnetCaptureWriter&);
+    EnetCaptureWriter& operator=(const EnetCaptureWriter&);
+
+#ifndef _WIN32
+    bool grow(std::size_t needed)
+    {
+        std::size_t size = mapped > 0 ? mapped * 2 : CAPTURE_CHUNK;
+        while (size < needed) size *= 2;
+#ifdef __linux__
+        // Reserve the blocks now so a full disk fails here instead of faulting on a write through the map
+        if (posix_fallocate(fd, 0, size) != 0) return false;
+#else
+        if (ftruncate(fd, size) != 0) return false;
+#endif
+        void* next = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (next == MAP_FAILED) return false;
+        if (map != NULL) munmap(map, mapped);
+        map = static_cast<enet_uint8*>(next);
+        mapped = size;
+        return true;
+    }
+#endif
+
+    std::size_t used;
+    bool failed;
+#ifdef _WIN32
+    std::FILE* file;
+#else
+    int fd;
+    enet_uint8* map;
+    std::size_t mapped;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////
+// A capture log being fed back into a host by Host.replay
+////////////////////////////////////////////////////////////
+class EnetReplay
+{
+public:
+    EnetReplay() : bytes(NULL), size(0), position(CAPTURE_FILE_HEADER), speed(1), replayed(0)
+#ifndef _WIN32
+        , map(NULL)
+#endif
+    {
+    }
+
+    ~EnetReplay()
+    {
+#ifndef _WIN32
+        if (map != NULL) munmap(map, size);
+#endif
+    }
+
+    // Returns NULL on success or why the log can't be replayed
+    const SQChar* open(const std::string& path)
+    {
+#ifdef _WIN32
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (file == NULL) return _SC("Failed to open capture log");
+        enet_uint8 chunk[65536];
+        std::size_t read;
+        while ((read = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            contents.insert(contents.end(), chunk, chunk + read);
+        }
+        std::fclose(file);
+        bytes = contents.empty() ? NULL : &contents[0];
+        size = contents.size();
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return _SC("Failed to open capture log");
+        off_t length = lseek(fd, 0, SEEK_END);
+        if (length >= (off_t) CAPTURE_FILE_HEADER) {
+            void* mapping = mmap(NULL, (std::size_t) length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                map = mapping;
+                bytes = static_cast<const enet_uint8*>(mapping);
+                size = (std::size_t) length;
+            }
+        }
+        ::close(fd);
+#endif
+        if (size < CAPTURE_FILE_HEADER || std::memcmp(bytes, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+            return _SC("Not a capture log");
+        }
+        if (bytes[8] != CAPTURE_VERSION || bytes[9] != 0 || bytes[10] != 0 || bytes[11] != 0) {
+            return _SC("Unsupported capture log version");
+        }
+        return NULL;
+    }
+
+    const enet_uint8* bytes;
+    std::size_t size;
+    std::size_t position;   // Next record
+    double speed;           // Multiple of the recorded pace, 0 for as fast as possible
+    std::chrono::steady_clock::time_point start;
+    unsigned long long replayed;
+
+private:
+    EnetReplay(const EnetReplay&);
+    EnetReplay& operator=(const EnetReplay&);
+
+#ifdef _WIN32
+    std::vector<enet_uint8> contents;
+#else
+    void* map;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////
+// A received datagram held back by Host.impair until its delivery time
+////////////////////////////////////////////////////////////
+struct EnetDelayedDatagram
+{
+    ENetAddress from;
+    std::vector<enet_uint8> bytes;
+};
+
+
+////////////////////////////////////////////////////////////
+// Simulated link conditions applied to a host's incoming datagrams
+////////////////////////////////////////////////////////////
+struct EnetImpairment
+{
+    EnetImpairment() : active(false), latency(0), jitter(0), loss(0), bandwidth(0), token(0), port(0), dropped(0), delayed(0) {}
+
+    bool active;
+    std::chrono::steady_clock::duration latency;
+    std::chrono::steady_clock::duration jitter;      // Latency varies by up to this much either way
+    double loss;                                     // Chance of dropping each datagram
+    enet_uint32 bandwidth;                           // Bytes per second, 0 for no limit
+    std::mt19937_64 random;                          // Seeded by Host.impair; repeats its rolls, not which datagrams they land on
+    unsigned long long token;                        // Marks datagrams the host sends itself to deliver held ones
+    enet_uint16 port;                                // The host's own port, looked up once it has one
+    std::chrono::steady_clock::time_point linkFree;  // When the simulated link finishes its last datagram
+    std::multimap<std::chrono::steady_clock::time_point, EnetDelayedDatagram> held; // By delivery time
+    unsigned long long dropped;
+    unsigned long long delayed;
+};
+
+
+////////////////////////////////////////////////////////////
+// Streams sent on Host.stream_channel
+//
+// Every message is a kind byte and the sending end's stream id
+// as a varint. A begin follows that with the stream's total size
+// as a varint and its first bytes, and each chunk after it with
+// the next bytes; the channel is reliable and ordered, so chunks
+// need no offsets. An abort comes from a sender giving up on a
+// stream, a refusal from a receiver that won't take one.
+//
+////////////////////////////////////////////////////////////
+enum EnetStreamKind
+{
+    STREAM_BEGIN = 1,
+    STREAM_CHUNK,
+    STREAM_ABORT,
+    STREAM_REFUSE
+};
+
+static const std::size_t STREAM_WINDOW = 256 * 1024;          // Default outgoing bytes per peer before chunks wait
+static const std::size_t STREAM_MAX_SIZE = 64 * 1024 * 1024;  // Default largest incoming stream
+static const std::size_t STREAM_MAX_INCOMING = 16;            // Incoming streams a peer may have at once
+static const std::size_t STREAM_CHUNK_OVERHEAD = 64;          // Room left in the peer's MTU so ENet never fragments a chunk
+static const std::size_t STREAM_PROGRESS_STEP = 64 * 1024;    // Fewest bytes between progress events
+static const std::size_t STREAM_PROGRESS_EVENTS = 100;        // Most progress events for one stream
+static const std::size_t STREAM_BUDGET = 256 * 1024 * 1024;   // Default bytes a host reserves for all its incoming streams
+static const enet_uint32 STREAM_TIMEOUT = 30000;              // Default milliseconds an incoming stream may go without a chunk
+
+
+////////////////////////////////////////////////////////////
+// Counters for Host.stream_channel traffic
+////////////////////////////////////////////////////////////
+struct EnetStreamStats
+{
+    EnetStreamStats() : sentBytes(0), receivedBytes(0), sent(0), completed(0), failed(0), timedOut(0) {}
+
+    unsigned long long sentBytes;      // Stream bytes queued, not counting chunk headers
+    unsigned long long receivedBytes;
+    unsigned long long sent;           // Outgoing streams whose last chunk was queued
+    unsigned long long completed;      // Incoming streams that arrived whole
+    unsigned long long failed;         // Incoming streams refused or abandoned
+    unsigned long long timedOut;       // Incoming streams failed for going quiet, also counted in failed
+};
+
+
+////////////////////////////////////////////////////////////
+// A buffer or file being sent by Peer.send_stream or Peer.send_file, a chunk at a time
+////////////////////////////////////////////////////////////
+class EnetOutgoingStream
+{
+public:
+    explicit EnetOutgoingStream(enet_uint32 id) : id(id), total(0), sent(0), started(false), buffer(NULL)
+#ifdef _WIN32
+        , file(NULL)
+#else
+        , map(NULL)
+#endif
+    {
+    }
+
+    ~EnetOutgoingStream()
+    {
+        if (buffer != NULL && --buffer->referenceCount == 0) enet_packet_destroy(buffer);
+#ifdef _WIN32
+        if (file != NULL) std::fclose(file);
+#else
+        if (map != NULL) munmap(map, total);
+#endif
+    }
+
+    // Sends the contents of a packet, holding a reference to it until the stream ends
+    void open(ENetPacket* packet)
+    {
+        buffer = packet;
+        ++buffer->referenceCount;
+        total = packet->dataLength;
+    }
+
+    // Sends a file, mapped where the platform allows; returns false if it can't be opened
+    bool open(const std::string& path)
+    {
+#ifdef _WIN32
+        file = std::fopen(path.c_str(), "rb");
+        if (file == NULL || std::fseek(file, 0, SEEK_END) != 0) return false;
+        long length = std::ftell(file);
+        if (length < 0 || std::fseek(file, 0, SEEK_SET) != 0) return false;
+        total = (std::size_t) length;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        off_t length = lseek(fd, 0, SEEK_END);
+        if (length > 0) {
+            void* mapping = mmap(NULL, (std::size_t) length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                map = mapping;
+                total = (std::size_t) length;
+#ifdef POSIX_MADV_SEQUENTIAL
+                posix_madvise(map, total, POSIX_MADV_SEQUENTIAL);
+#endif
+            }
+        }
+        ::close(fd);
+        if (length < 0 || (length > 0 && map == NULL)) return false;
+#endif
+        return true;
+    }
+
+    // Copies the next length bytes to out and moves past them, returning false if the source can't supply them
+    bool read(enet_uint8* out, std::size_t length)
+    {
+        if (length == 0) return true;
+        if (buffer != NULL) {
+            // Scripts can still resize their enet.Packet, so look at it afresh every time
+            if (buffer->dataLength < sent + length) return false;
+            std::memcpy(out, buffer->data + sent, length);
+        } else {
+#ifdef _WIN32
+            if (std::fread(out, 1, length, file) != length) return false;
+#else
+            std::memcpy(out, static_cast<const enet_uint8*>(map) + sent, length);
+#endif
+        }
+        sent += length;
+        return true;
+    }
+
+    enet_uint32 id;
+    std::size_t total;
+    std::size_t sent;
+    bool started;           // The first chunk, which carries the total, has gone out
+
+private:
+    EnetOutgoingStream(const EnetOutgoingStream&);
+    EnetOutgoingStream& operator=(const EnetOutgoingStream&);
+
+    ENetPacket* buffer;
+#ifdef _WIN32
+    std::FILE* file;
+#else
+    void* map;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////
+// A stream being reassembled into a preallocated packet, or into a file when the host has a stream directory
+////////////////////////////////////////////////////////////
+class EnetIncomingStream
+{
+public:
+    EnetIncomingStream(enet_uint32 id, std::size_t total) : id(id), total(total), received(0), nextProgress(0), buffer(NULL),
+#ifdef _WIN32
+        file(NULL)
+#else
+        fd(-1), map(NULL)
+#endif
+    {
+    }
+
+    ~EnetIncomingStream()
+    {
+        if (buffer != NULL) enet_packet_destroy(buffer);
+        if (close()) std::remove(partial.c_str());
+    }
+
+    // Returns false if the buffer can't be allocated
+    bool open()
+    {
+        buffer = enet_packet_create(NULL, total, ENET_PACKET_FLAG_RELIABLE);
+        return buffer != NULL;
+    }
+
+    // Preallocates the file as path plus ".part", returning false if that fails
+    bool open(const std::string& path)
+    {
+        this->path = path;
+        partial = path + ".part";
+#ifdef _WIN32
+        file = std::fopen(partial.c_str(), "wb");
+        return file != NULL;
+#else
+        fd = ::open(partial.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        if (total == 0) return true;
+#ifdef __linux__
+        // Reserve the blocks now so a full disk refuses the stream instead of faulting on a write through the map
+        if (posix_fallocate(fd, 0, total) != 0) return false;
+#else
+        if (ftruncate(fd, total) != 0) return false;
+#endif
+        void* mapping = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) return false;
+        map = static_cast<enet_uint8*>(mapping);
+        return true;
+#endif
+    }
+
+    // Appends the next part of the stream, returning false if it runs past the total or can't be written
+    bool write(const enet_uint8* bytes, std::size_t length)
+    {
+        if (length > total - received) return false;
+        if (length == 0) return true;
+        if (buffer != NULL) {
+            std::memcpy(buffer->data + received, bytes, length);
+        } else {
+#ifdef _WIN32
+            if (std::fwrite(bytes, 1, length, file) != length) return false;
+#else
+            std::memcpy(map + received, bytes, length);
+#endif
+        }
+        received += length;
+        return true;
+    }
+
+    // Hands over the finished packet, or renames the finished file to its path; returns NULL for a file
+    ENetPacket* finish(bool& ok)
+    {
+        ENetPacket* packet = buffer;
+        buffer = NULL;
+        ok = true;
+        if (close()) {
+            ok = std::rename(partial.c_str(), path.c_str()) == 0;
+            if (!ok) std::remove(partial.c_str());
+        }
+        return packet;
+    }
+
+    enet_uint32 id;
+    std::size_t total;
+    std::size_t received;
+    std::size_t nextProgress; // Received bytes at which the next progress event is due
+    std::string path;         // Where a file stream ends up, empty for one held in memory
+    std::chrono::steady_clock::time_point lastChunk; // When the begin or the latest chunk arrived
+
+private:
+    EnetIncomingStream(const EnetIncomingStream&);
+    EnetIncomingStream& operator=(const EnetIncomingStream&);
+
+    // Unmaps and closes the file, returning true if there was one
+    bool close()
+    {
+#ifdef _WIN32
+        if (file == NULL) return false;
+        std::fclose(file);
+        file = NULL;
+#else
+        if (fd < 0) return false;
+        if (map != NULL) munmap(map, total);
+        map = NULL;
+        ::close(fd);
+        fd = -1;
+#endif
+        return true;
+    }
+
+    ENetPacket* buffer;
+    std::string partial;
+#ifdef _WIN32
+    std::FILE* file;
+#else
+    int fd;
+    enet_uint8* map;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////
+// Script time and cost charged to one kind of event by Host.profile
+////////////////////////////////////////////////////////////
+struct EnetProfileEntry
+{
+    EnetProfileEntry() : count(0), timed(0), nanoseconds(0), maxNanoseconds(0), bytes(0), allocations(0), allocatedBytes(0) {}
+
+    unsigned long long count;
+    unsigned long long timed;           // Events charged with time; ones taken by polling are left out unless the script calls profile_done
+    unsigned long long nanoseconds;     // Time in the script after the events were handed over
+    unsigned long long maxNanoseconds;  // Longest single charge
+    unsigned long long bytes;           // Payload bytes of the events
+    unsigned long long allocations;     // Reported through CountEnetScriptAllocation
+    unsigned long long allocatedBytes;
+};
+
+
+////////////////////////////////////////////////////////////
+// Handler profile kept by Host.profile, by event type, channel and first payload byte
+////////////////////////////////////////////////////////////
+struct EnetProfiler
+{
+    EnetProfiler() : active(true), allocations(0), allocatedBytes(0) {}
+
+    bool active;                                                   // Cleared by Host.profile(false), which keeps the results
+    std::unordered_map<unsigned long long, EnetProfileEntry> entries;
+    std::vector<unsigned long long> pending;                       // Events handed to the script and not yet charged
+    std::chrono::steady_clock::time_point handedOut;               // When the last of them was handed over
+    unsigned long long allocations;                                // Reported while the pending events are in the script
+    unsigned long long allocatedBytes;
+};
+
+
+////////////////////////////////////////////////////////////
+// Profiler whose events are in the script on this thread, the one CountEnetScriptAllocation charges
+////////////////////////////////////////////////////////////
+static thread_local EnetProfiler* profileCounting = NULL;
+
+
+struct EnetHostData;
+
+
+////////////////////////////////////////////////////////////
+// Binding state kept alongside every peer slot, reachable through ENetPeer::data
+////////////////////////////////////////////////////////////
+struct EnetPeerData
+{
+    EnetPeerData() : host(NULL), generation(0), releasePending(false), x(0), y(0), radius(0), positioned(false), cell(0), highWater(0), lowWater(0), blocked(false), staged(false), coalesceMalformed(0), snapshotSequence(0), rateDropped(0), floodDrops(0), flooded(false), nextStreamId(0), streaming(false), queuedBytes(0), ringBytes(0), scheduledBytes(0), scheduledPackets(0), scheduleCursor(0), scheduleResume(false), scheduled(false), disconnectPending(false), disconnectData(0)
+    {
+        sq_resetobject(&instance);
+        sq_resetobject(&userdata);
+    }
+
+    EnetHostData* host;
+    std::atomic<unsigned long long> generation; // Bumped whenever the connection in this slot goes away
+    HSQOBJECT instance;  // Cached enet.Peer instance, null until first pushed
+    HSQOBJECT userdata;  // Value attached by scripts with set_userdata
+    bool releasePending; // The peer went away and its objects are released on the next service
+    SQFloat x, y;        // Position set by scripts with set_position
+    SQFloat radius;      // Interest radius around the position
+    bool positioned;     // The peer is in its host's interest grid
+    unsigned long long cell; // Grid cell holding the peer while positioned
+    EnetTrafficStats traffic;
+    std::size_t highWater; // Outgoing bytes above which send refuses packets, 0 for no limit
+    std::size_t lowWater;  // Outgoing bytes below which a refused peer raises a writable event
+    bool blocked;          // send refused a packet and no writable event has been raised since
+    std::vector<EnetPacketBuffer> stages; // Coalesced messages waiting for the next flush, by channel
+    bool staged;           // Some stage holds messages
+    unsigned long long coalesceMalformed;       // Received packets that weren't valid coalesced framing, dropped
+    enet_uint32 snapshotSequence;               // Last snapshot sent to the peer
+    EnetSnapshot snapshotBase;                  // Newest snapshot the peer acknowledged, deltas are made against it
+    std::deque<EnetSnapshot> snapshotsSent;     // Sent and not yet acknowledged, oldest first
+    std::deque<EnetSnapshot> snapshotsReceived; // Rebuilt from the peer, kept as baselines for its deltas
+    std::vector<EnetTokenBucket> buckets;       // By channel, made on the first packet checked against a limit
+    unsigned long long rateDropped;             // Packets over the host's rate limits, dropped or not
+    std::chrono::steady_clock::time_point floodWindow; // Start of the second drops are being counted in
+    std::size_t floodDrops;
+    bool flooded;                               // Disconnected by Host.flood_limit; anything still queued from it is dropped
+    enet_uint32 nextStreamId;
+    std::deque<std::shared_ptr<EnetOutgoingStream> > streamsOut;  // Taken in turn, a chunk each
+    std::vector<std::shared_ptr<EnetIncomingStream> > streamsIn;
+    std::map<enet_uint32, std::string> streamFiles;              // Finished file streams waiting for their complete event
+    bool streaming;                             // Listed in the host's streaming peers
+    std::size_t queuedBytes;                    // In ENet's outgoing lists as of the last service, plus what was sent since; host lock
+    std::atomic<std::size_t> ringBytes;         // Waiting in the network thread's send ring
+    std::vector<EnetScheduledChannel> queues;   // By channel, made when the scheduler first holds a packet for the peer
+    std::size_t scheduledBytes;                 // Bytes waiting in the queues
+    std::size_t scheduledPackets;
+    std::size_t scheduleCursor;                 // Channel whose turn is next, so a budget cut short doesn't favour low channels
+    bool scheduleResume;                        // The budget ran out partway through the cursor channel's turn
+    EnetTokenBucket budget;                     // Bytes the peer may still be sent, refilled at the host's send budget
+    bool scheduled;                             // Listed in the host's scheduled peers
+    bool disconnectPending;                     // Peer.disconnect_later waits for the scheduler to release everything first
+    enet_uint32 disconnectData;
+};
+
+
+////////////////////////////////////////////////////////////
+// Binding state kept alongside every host made by host_create
+////////////////////////////////////////////////////////////
+struct EnetHostData
+{
+    EnetHostData(HSQUIRRELVM vm, ENetHost* host) : vm(vm), host(host), receiveMode(ENET_RECEIVE_STRING), peers(host->peerCount), thread(NULL), cellSize(64), maxRadius(0), channels(host->channelLimit), coalesceLimit(0), coalesceMalformed(0), scratch((ENetPacket*) NULL), running(false), dispatching(0), ticks(0), tickOverruns(0), ticksSkipped(0), onReceive(host->channelLimit), nextResolveId(0), capture(NULL), replay(NULL), snapshotChannel(-1), snapshotHistory(SNAPSHOT_HISTORY), floodLimit(0), rateDropped(0), floodDisconnects(0), streamChannel(-1), streamWindow(STREAM_WINDOW), streamMaxSize(STREAM_MAX_SIZE), streamBudget(STREAM_BUDGET), streamReserved(0), streamTimeout(std::chrono::milliseconds(STREAM_TIMEOUT)), incomingStreams(0), schedule(host->channelLimit), sendBudget(0), sendBurst(0), scheduledBytes(0), scheduledPackets(0), superseded(0), broadcastBytes(0), ringBroadcastBytes(0), profiler(NULL)
+    {
+        sq_resetobject(&onConnect);
+        sq_resetobject(&onDisconnect);
+        sq_resetobject(&onEvent);
+        for (std::size_t i = 0; i < onReceive.size(); i++) {
+            sq_resetobject(&onReceive[i]);
+        }
+        for (std::size_t i = 0; i < host->peerCount; i++) {
+            peers[i].host = this;
+            host->peers[i].data = &peers[i];
+        }
+    }
+
+    ~EnetHostData()
+    {
+        for (std::size_t i = 0; i < presetKeys.size(); i++) {
+            sq_release(vm, &presetKeys[i]);
+        }
+        for (std::size_t i = 0; i < peers.size(); i++) {
+            sq_release(vm, &peers[i].instance);
+            sq_release(vm, &peers[i].userdata);
+        }
+        sq_release(vm, &onConnect);
+        sq_release(vm, &onDisconnect);
+        sq_release(vm, &onEvent);
+        for (std::size_t i = 0; i < onReceive.size(); i++) {
+            sq_release(vm, &onReceive[i]);
+        }
+        if (resolver) {
+            // The detached worker finishes any lookup in progress, sees this and exits
+            std::lock_guard<std::mutex> guard(resolver->lock);
+            resolver->stopping = true;
+            resolver->wake.notify_one();
+        }
+        delete capture;
+        delete replay;
+        if (profileCounting == profiler) profileCounting = NULL;
+        delete profiler;
+    }
+
+    HSQUIRRELVM vm;
+    ENetHost* host;
+    int receiveMode;
+    std::vector<HSQOBJECT> presetKeys;                  // Serializer keys shared by both ends
+    std::map<const SQChar*, std::size_t> presetIndex;   // Interned key string to its preset index
+    std::vector<EnetPeerData> peers;                    // One per slot in host->peers, never resized
+    std::vector<EnetPeerData*> pendingRelease;          // Peers whose objects go on the next service
+    EnetHostThread* thread;                             // Set while a network thread services the host
+    std::deque<EnetScriptEvent> backlog;                // Events to hand out before asking ENet again
+    SQFloat cellSize;                                   // Side of an interest grid cell
+    SQFloat maxRadius;                                  // Largest interest radius set since the grid was built
+    std::unordered_map<unsigned long long, std::vector<EnetPeerData*> > cells; // Positioned peers by grid cell
+    std::vector<EnetTrafficStats> channels;             // Traffic of all peers, by channel
+    EnetHistogram serviceTime;                          // Time spent in service and service_batch
+    EnetHistogram dispatchTime;                         // Time spent turning events into script values
+    std::vector<EnetPeerData*> blocked;                 // Peers waiting for a writable event
+    EnetCompressionStats compression;                   // Updated by the LZ compressor from whichever thread services
+    std::size_t coalesceLimit;                          // Largest coalesced packet, 0 when coalescing is off
+    unsigned long long coalesceMalformed;
+    std::vector<EnetPeerData*> staged;                  // Peers with messages waiting for the next flush
+    EnetPacketBuffer scratch;                           // Reused to serialize tables bound for a stage
+    bool running;                                       // Host.run is driving the host
+    unsigned dispatching;                               // Host.dispatch calls in progress, nested ones included
+    EnetHistogram tickTime;                             // Time spent in Host.run tick functions and the flush after them
+    unsigned long long ticks;
+    unsigned long long tickOverruns;                    // Ticks that finished after the next one was due
+    unsigned long long ticksSkipped;                    // Ticks dropped to catch up after an overrun
+    HSQOBJECT onConnect;                                // Handlers called by Host.dispatch, null when unset
+    HSQOBJECT onDisconnect;
+    HSQOBJECT onEvent;                                  // Takes event tables no other handler wanted
+    std::vector<HSQOBJECT> onReceive;                   // By channel
+    std::shared_ptr<EnetResolver> resolver;             // Started by the first connect_async that misses the cache
+    enet_uint32 nextResolveId;
+    EnetImpairment impairment;                          // Set by Host.impair, touched only by whichever thread services
+    EnetCaptureWriter* capture;                         // Set while Host.capture is logging traffic
+    EnetReplay* replay;                                 // Set while Host.replay is feeding a log into the backlog
+    int snapshotChannel;                                // Channel carrying snapshots and their acks, -1 when off
+    std::size_t snapshotHistory;                        // Snapshots kept per peer and direction
+    EnetSnapshotStats snapshots;
+    std::vector<EnetRateLimit> rateLimits;              // By channel, empty until Host.rate_limit is first called
+    std::size_t floodLimit;                             // Dropped packets per second that get a peer disconnected, 0 for never
+    unsigned long long rateDropped;
+    unsigned long long floodDisconnects;
+    int streamChannel;                                  // Channel carrying streams, -1 when off
+    std::size_t streamWindow;                           // Outgoing bytes a peer may have before more chunks wait
+    std::size_t streamMaxSize;                          // Largest incoming stream accepted
+    std::size_t streamBudget;                           // Most bytes all incoming streams may reserve together
+    std::size_t streamReserved;                         // Declared sizes of the incoming streams in progress
+    std::chrono::steady_clock::duration streamTimeout;  // How long an incoming stream may go without a chunk
+    std::chrono::steady_clock::time_point streamCheck;  // When quiet incoming streams are next looked for
+    std::size_t incomingStreams;
+    std::string streamDirectory;                        // Where incoming streams are written, empty to keep them in memory
+    std::vector<EnetPeerData*> streaming;               // Peers with outgoing streams
+    EnetStreamStats streams;
+    std::vector<EnetChannelSchedule> schedule;          // By channel
+    double sendBudget;                                  // Bytes per second each peer may be sent, 0 when the scheduler is off
+    double sendBurst;                                   // Most budget a peer can save up while idle
+    std::vector<EnetPeerData*> scheduled;               // Peers with packets waiting in the scheduler
+    std::size_t scheduledBytes;
+    std::size_t scheduledPackets;
+    unsigned long long superseded;                      // Waiting unreliable packets replaced by newer ones
+    std::size_t broadcastBytes;                         // Broadcast to every peer since the last service, host lock
+    std::atomic<std::size_t> ringBroadcastBytes;        // Broadcasts waiting in the network thread's send ring
+    EnetProfiler* profiler;                             // Set once Host.profile has been turned on
+};
+
+
+////////////////////////////////////////////////////////////
+static EnetHostData* get_host_data(ENetHost* host)
+{
+    // Every peer slot points back at the host state, so no registry lookup is needed
+    if (host->peerCount == 0 || host->peers[0].data == NULL) return NULL;
+    return static_cast<EnetPeerData*>(host->peers[0].data)->host;
+}
+
+
+////////////////////////////////////////////////////////////
+static void attach_host_data(HSQUIRRELVM v, ENetHost* host)
+{
+    // Owned through the ENetPeer::data back pointers until Host.destroy deletes it
+    new EnetHostData(v, host);
+}
+
+
+////////////////////////////////////////////////////////////
+// Pushes the enet.Peer instance for a peer, creating and caching it the first time
+////////////////////////////////////////////////////////////
+static void push_peer(HSQUIRRELVM v, ENetPeer* peer)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    if (data == NULL) {
+        Sqrat::PushVar(v, peer);
+        return;
+    }
+    if (sq_isnull(data->instance)) {
+        Sqrat::PushVar(v, peer);
+        sq_getstackobj(v, -1, &data->instance);
+        sq_addref(v, &data->instance);
+        return;
+    }
+    sq_pushobject(v, data->instance);
+}
+
+
+////////////////////////////////////////////////////////////
+// Stable peer IDs pack the slot into the low 16 bits and the slot generation above it
+//
+// The result is kept positive. With 64-bit script integers the
+// generation has 47 bits and never repeats in practice; with
+// 32-bit ones it has 15, so a slot's IDs repeat after 32768
+// connections.
+//
+////////////////////////////////////////////////////////////
+static SQInteger peer_id(ENetPeer* peer, const EnetPeerData* data)
+{
+#ifdef _SQ64
+    unsigned long long generation = data->generation.load() & 0x7FFFFFFFFFFFULL;
+#else
+    unsigned long long generation = data->generation.load() & 0x7FFF;
+#endif
+    return (SQInteger) ((generation << 16) | (enet_uint32) (peer - peer->host->peers));
+}
+
+
+////////////////////////////////////////////////////////////
+static void record_time(EnetHistogram& histogram, std::chrono::steady_clock::time_point start)
+{
+    unsigned long long us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::size_t bucket = 0;
+    while (bucket < STATS_HISTOGRAM_BUCKETS - 1 && (us >> bucket) != 0) {
+        bucket++;
+    }
+    ++histogram.buckets[bucket];
+    ++histogram.count;
+    histogram.sum += us;
+}
+
+
+////////////////////////////////////////////////////////////
+// Counts a packet queued for the given number of peers of a host
+////////////////////////////////////////////////////////////
+static void count_sent(EnetHostData* data, ENetPeer* peer, enet_uint8 channel_id, const ENetPacket* packet, std::size_t peers)
+{
+    if (data == NULL) return;
+    if (channel_id < data->channels.size()) {
+        data->channels[channel_id].sentBytes += packet->dataLength * peers;
+        data->channels[channel_id].sentPackets += peers;
+    }
+    if (peer != NULL) {
+        EnetPeerData* peerData = static_cast<EnetPeerData*>(peer->data);
+        peerData->traffic.sentBytes += packet->dataLength;
+        ++peerData->traffic.sentPackets;
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static void count_received(EnetHostData* data, ENetPeer* peer, enet_uint8 channel_id, std::size_t length)
+{
+    if (data == NULL) return;
+    if (channel_id < data->channels.size()) {
+        data->channels[channel_id].receivedBytes += length;
+        ++data->channels[channel_id].receivedPackets;
+    }
+    if (peer != NULL && peer->data != NULL) {
+        EnetPeerData* peerData = static_cast<EnetPeerData*>(peer->data);
+        peerData->traffic.receivedBytes += length;
+        ++peerData->traffic.receivedPackets;
+    }
+}
+
+
+static const unsigned PROFILE_NO_OPCODE = 256;  // Opcode recorded for events without a payload
+
+
+////////////////////////////////////////////////////////////
+void CountEnetScriptAllocation(std::size_t size)
+{
+    if (profileCounting == NULL) return;
+    ++profileCounting->allocations;
+    profileCounting->allocatedBytes += size;
+}
+
+
+////////////////////////////////////////////////////////////
+// Event types whose channel means something
+////////////////////////////////////////////////////////////
+static bool profile_has_channel(int type)
+{
+    return type == ENET_EVENT_TYPE_RECEIVE || type == ENET_EVENT_TYPE_SHARD_MESSAGE || (type >= ENET_EVENT_TYPE_STREAM_PROGRESS && type <= ENET_EVENT_TYPE_STREAM_CANCELLED);
+}
+
+
+////////////////////////////////////////////////////////////
+// Profile categories pack the event type, channel and opcode into one key
+////////////////////////////////////////////////////////////
+static unsigned long long profile_key(int type, unsigned channel, unsigned opcode)
+{
+    return ((unsigned long long) (unsigned) type << 17) | ((unsigned long long) channel << 9) | opcode;
+}
+
+
+////////////////////////////////////////////////////////////
+// Counts an event about to be handed to the script and starts timing it
+////////////////////////////////////////////////////////////
+static void profile_event(EnetHostData* data, const EnetScriptEvent& event)
+{
+    if (data == NULL || data->profiler == NULL || !data->profiler->active) return;
+    EnetProfiler* profiler = data->profiler;
+    bool payload = event.packet != NULL && (event.type == ENET_EVENT_TYPE_RECEIVE || event.type == ENET_EVENT_TYPE_SHARD_MESSAGE);
+    unsigned opcode = payload && event.length > 0 ? event.packet->data[event.offset] : PROFILE_NO_OPCODE;
+    unsigned long long key = profile_key(event.type, profile_has_channel(event.type) ? event.channelID : 0, opcode);
+    EnetProfileEntry& entry = profiler->entries[key];
+    ++entry.count;
+    if (event.packet != NULL) entry.bytes += event.length;
+    if (profiler->pending.empty()) {
+        profiler->allocations = 0;
+        profiler->allocatedBytes = 0;
+        profileCounting = profiler;
+    }
+    profiler->pending.push_back(key);
+    profiler->handedOut = std::chrono::steady_clock::now();
+}
+
+
+////////////////////////////////////////////////////////////
+// Charges the time and allocations since the pending events were handed over, split evenly between them
+//
+// Called as soon as dispatch and run handlers return, and by
+// Host.profile_done for events taken with service, check_events
+// or service_batch. Events handed over together share the time.
+//
+////////////////////////////////////////////////////////////
+static void profile_settle(EnetProfiler* profiler)
+{
+    if (profiler->pending.empty()) return;
+    unsigned long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profiler->handedOut).count();
+    unsigned long long share = elapsed / profiler->pending.size();
+    for (std::size_t i = 0; i < profiler->pending.size(); i++) {
+        EnetProfileEntry& entry = profiler->entries[profiler->pending[i]];
+        ++entry.timed;
+        entry.nanoseconds += share;
+        if (share > entry.maxNanoseconds) entry.maxNanoseconds = share;
+        entry.allocations += profiler->allocations / profiler->pending.size();
+        entry.allocatedBytes += profiler->allocatedBytes / profiler->pending.size();
+    }
+    profiler->pending.clear();
+    if (profileCounting == profiler) profileCounting = NULL;
+}
+
+
+////////////////////////////////////////////////////////////
+// Stops timing polled events the script never called Host.profile_done for, which keep only their count and bytes
+//
+// Whatever the script did between polls, such as rendering a
+// frame, would otherwise be charged to the last events it took.
+//
+////////////////////////////////////////////////////////////
+static void profile_drop(EnetProfiler* profiler)
+{
+    profiler->pending.clear();
+    if (profileCounting == profiler) profileCounting = NULL;
+}
+
+
+////////////////////////////////////////////////////////////
+static void capture_put(enet_uint8* out, unsigned long long value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; i++) {
+        out[i] = (enet_uint8) (value >> (8 * i));
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static unsigned long long capture_get(const enet_uint8* in, std::size_t bytes)
+{
+    unsigned long long value = 0;
+    for (std::size_t i = 0; i < bytes; i++) {
+        value |= (unsigned long long) in[i] << (8 * i);
+    }
+    return value;
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends one record to the host's capture log, ending the capture if the log can't grow
+////////////////////////////////////////////////////////////
+static void capture_record(EnetHostData* data, EnetCaptureKind kind, ENetPeer* peer, enet_uint8 channel_id, enet_uint32 flags, const enet_uint8* payload, std::size_t length)
+{
+    EnetCaptureWriter* capture = data->capture;
+    if (capture == NULL) return;
+    enet_uint8 header[CAPTURE_RECORD_HEADER];
+    header[0] = (enet_uint8) kind;
+    header[1] = channel_id;
+    capture_put(header + 2, peer != NULL ? (enet_uint16) (peer - data->host->peers) : CAPTURE_NO_PEER, 2);
+    capture_put(header + 4, flags, 4);
+    capture_put(header + 8, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - capture->start).count(), 8);
+    capture_put(header + 16, length, 4);
+    if (!capture->append(header, sizeof(header), payload, length)) {
+        wr::Print(data->vm, "Capture stopped: the log could not grow\n");
+        delete capture;
+        data->capture = NULL;
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static void capture_send(EnetHostData* data, ENetPeer* peer, enet_uint8 channel_id, const ENetPacket* packet)
+{
+    if (data == NULL || data->capture == NULL) return;
+    capture_record(data, peer != NULL ? CAPTURE_SEND : CAPTURE_BROADCAST, peer, channel_id, packet->flags, packet->data, packet->dataLength);
+}
+
+
+////////////////////////////////////////////////////////////
+static void capture_event(EnetHostData* data, const EnetScriptEvent& event)
+{
+    switch (event.type) {
+    case ENET_EVENT_TYPE_CONNECT :
+        capture_record(data, CAPTURE_CONNECT, event.peer, 0, event.data, NULL, 0);
+        break;
+    case ENET_EVENT_TYPE_DISCONNECT :
+        capture_record(data, CAPTURE_DISCONNECT, event.peer, 0, event.data, NULL, 0);
+        break;
+    case ENET_EVENT_TYPE_RECEIVE :
+        capture_record(data, CAPTURE_RECEIVE, event.peer, event.channelID, event.packet->flags, event.packet->data + event.offset, event.length);
+        break;
+    default :
+        break;
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Interest grid coordinates are clamped well inside 32 bits and packed into one key
+////////////////////////////////////////////////////////////
+static int interest_coord(SQFloat cellSize, SQFloat value)
+{
+    SQFloat coord = std::floor(value / cellSize);
+    if (!(coord > -1073741824.0)) return -1073741824;
+    if (coord > 1073741824.0) return 1073741824;
+    return (int) coord;
+}
+
+
+////////////////////////////////////////////////////////////
+static unsigned long long interest_key(int cx, int cy)
+{
+    return ((unsigned long long) (enet_uint32) cx << 32) | (enet_uint32) cy;
+}
+
+
+////////////////////////////////////////////////////////////
+static void interest_remove(EnetPeerData* data)
+{
+    if (!data->positioned) return;
+    std::vector<EnetPeerData*>& cell = data->host->cells[data->cell];
+    for (std::size_t i = 0; i < cell.size(); i++) {
+        if (cell[i] == data) {
+            cell[i] = cell.back();
+            cell.pop_back();
+            break;
+        }
+    }
+    if (cell.empty()) data->host->cells.erase(data->cell);
+    data->positioned = false;
+}
+
+
+////////////////////////////////////////////////////////////
+static void interest_insert(EnetPeerData* data)
+{
+    EnetHostData* host = data->host;
+    data->cell = interest_key(interest_coord(host->cellSize, data->x), interest_coord(host->cellSize, data->y));
+    host->cells[data->cell].push_back(data);
+    if (data->radius > host->maxRadius) host->maxRadius = data->radius;
+    data->positioned = true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Collects the connected peers whose interest circle overlaps the given circle
+////////////////////////////////////////////////////////////
+static void interest_query(EnetHostData* data, SQFloat x, SQFloat y, SQFloat radius, std::vector<ENetPeer*>& peers)
+{
+    SQFloat reach = radius + data->maxRadius;
+    int minX = interest_coord(data->cellSize, x - reach);
+    int maxX = interest_coord(data->cellSize, x + reach);
+    int minY = interest_coord(data->cellSize, y - reach);
+    int maxY = interest_coord(data->cellSize, y + reach);
+    std::vector<const std::vector<EnetPeerData*>*> candidates;
+
+    // A query covering more cells than are occupied is cheaper as a walk over the occupied ones
+    double span = ((double) maxX - minX + 1) * ((double) maxY - minY + 1);
+    if (span > (double) data->cells.size()) {
+        std::unordered_map<unsigned long long, std::vector<EnetPeerData*> >::const_iterator it;
+        for (it = data->cells.begin(); it != data->cells.end(); ++it) {
+            candidates.push_back(&it->second);
+        }
+    } else {
+        for (int cx = minX; cx <= maxX; cx++) {
+            for (int cy = minY; cy <= maxY; cy++) {
+                std::unordered_map<unsigned long long, std::vector<EnetPeerData*> >::const_iterator it = data->cells.find(interest_key(cx, cy));
+                if (it != data->cells.end()) candidates.push_back(&it->second);
+            }
+        }
+    }
+    for (std::size_t i = 0; i < candidates.size(); i++) {
+        const std::vector<EnetPeerData*>& cell = *candidates[i];
+        for (std::size_t j = 0; j < cell.size(); j++) {
+            SQFloat dx = cell[j]->x - x;
+            SQFloat dy = cell[j]->y - y;
+            SQFloat limit = radius + cell[j]->radius;
+            ENetPeer* peer = &data->host->peers[cell[j] - &data->peers[0]];
+            if (dx * dx + dy * dy <= limit * limit && peer->state == ENET_PEER_STATE_CONNECTED) {
+                peers.push_back(peer);
+            }
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Forgets every baseline kept for the peer, so the next snapshot either way goes whole
+////////////////////////////////////////////////////////////
+static void clear_snapshots(EnetPeerData* data)
+{
+    data->snapshotSequence = 0;
+    data->snapshotBase = EnetSnapshot();
+    data->snapshotsSent.clear();
+    data->snapshotsReceived.clear();
+}
+
+
+////////////////////////////////////////////////////////////
+// Abandons the peer's streams both ways without raising events; unfinished files are deleted
+////////////////////////////////////////////////////////////
+static void clear_streams(EnetPeerData* data)
+{
+    for (std::size_t i = 0; i < data->streamsIn.size(); i++) {
+        data->host->streamReserved -= data->streamsIn[i]->total;
+    }
+    data->host->incomingStreams -= data->streamsIn.size();
+    data->streamsOut.clear();
+    data->streamsIn.clear();
+    data->streamFiles.clear();
+}
+
+
+////////////////////////////////////////////////////////////
+// Drops every packet the scheduler holds for the peer
+////////////////////////////////////////////////////////////
+static void clear_schedule(EnetPeerData* data)
+{
+    data->host->scheduledBytes -= data->scheduledBytes;
+    data->host->scheduledPackets -= data->scheduledPackets;
+    data->queues.clear();
+    data->scheduledBytes = 0;
+    data->scheduledPackets = 0;
+    data->scheduleCursor = 0;
+    data->scheduleResume = false;
+    data->budget = EnetTokenBucket();
+}
+
+
+////////////////////////////////////////////////////////////
+// Drops everything the binding kept for the connection in a peer slot and retires its ID
+////////////////////////////////////////////////////////////
+static void release_peer(EnetPeerData* data)
+{
+    interest_remove(data);
+    data->highWater = 0;
+    data->blocked = false;
+    data->stages.clear();
+    data->staged = false;
+    clear_snapshots(data);
+    clear_streams(data);
+    clear_schedule(data);
+    data->buckets.clear();
+    data->coalesceMalformed = 0;
+    data->rateDropped = 0;
+    data->floodDrops = 0;
+    ++data->generation;
+    sq_release(data->host->vm, &data->instance);
+    sq_release(data->host->vm, &data->userdata);
+    sq_resetobject(&data->instance);
+    sq_resetobject(&data->userdata);
+    data->releasePending = false;
+    data->flooded = false;
+    data->disconnectPending = false;
+}
+
+
+////////////////////////////////////////////////////////////
+// Schedules a peer's objects to be released once scripts have seen its last event
+//
+// Nothing is cleared until then, so Peer.id and user data still
+// match what the script stored for the connection while it
+// handles the DISCONNECT.
+//
+////////////////////////////////////////////////////////////
+static void defer_release_peer(ENetPeer* peer)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    if (data != NULL && !data->releasePending) {
+        data->releasePending = true;
+        data->host->pendingRelease.push_back(data);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static void release_pending_peers(EnetHostData* data)
+{
+    if (data == NULL) return;
+    for (std::size_t i = 0; i < data->pendingRelease.size(); i++) {
+        // A slot reused by Host.connect since it was scheduled has already been released
+        if (data->pendingRelease[i]->releasePending) {
+            release_peer(data->pendingRelease[i]);
+        }
+    }
+    data->pendingRelease.clear();
+}
+
+
+
+////////////////////////////////////////////////////////////
+// Host names resolved recently, shared by every host and the resolver threads
+////////////////////////////////////////////////////////////
+struct EnetAddressCache
+{
+    EnetAddressCache() : ttl(std::chrono::seconds(60)) {}
+
+    struct Entry
+    {
+        enet_uint32 host;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::mutex lock;
+    std::map<std::string, Entry> entries;
+    std::chrono::steady_clock::duration ttl; // Zero turns the cache off
+};
+
+static EnetAddressCache addressCache;
+
+
+////////////////////////////////////////////////////////////
+static bool cached_address(const std::string& name, ENetAddress& address)
+{
+    std::lock_guard<std::mutex> guard(addressCache.lock);
+    std::map<std::string, EnetAddressCache::Entry>::iterator it = addressCache.entries.find(name);
+    if (it == addressCache.entries.end()) return false;
+    if (std::chrono::steady_clock::now() >= it->second.expires) {
+        addressCache.entries.erase(it);
+        return false;
+    }
+    address.host = it->second.host;
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Resolves a host name through the cache, blocking on the system resolver when it misses
+////////////////////////////////////////////////////////////
+static bool resolve_host(const std::string& name, ENetAddress& address)
+{
+    if (cached_address(name, address)) return true;
+    if (enet_address_set_host(&address, name.c_str()) != 0) return false;
+    std::lock_guard<std::mutex> guard(addressCache.lock);
+    if (addressCache.ttl > std::chrono::steady_clock::duration::zero()) {
+        EnetAddressCache::Entry entry;
+        entry.host = address.host;
+        entry.expires = std::chrono::steady_clock::now() + addressCache.ttl;
+        addressCache.entries[name] = entry;
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Splits "host:port" and parses the port, returning NULL on success or why it failed
+////////////////////////////////////////////////////////////
+static const SQChar* split_address(const std::string& addr_str, std::string& host_str, ENetAddress& address)
+{
+    size_t colonPos = addr_str.find(':');
+    if (colonPos == std::string::npos) return _SC("Failed to parse address (missing port in address?)");
+    host_str = addr_str.substr(0, colonPos);
+    std::string port_str = addr_str.substr(colonPos + 1);
+    if (host_str.empty()) return _SC("Failed to parse address");
+    if (port_str.empty()) return _SC("Missing port in address");
+    if (port_str == "*") {
+        address.port = ENET_PORT_ANY;
+        return NULL;
+    }
+    if (port_str.size() > 5 || port_str.find_first_not_of("0123456789") != std::string::npos) return _SC("Invalid port in address");
+    unsigned long port = std::strtoul(port_str.c_str(), NULL, 10);
+    if (port > 65535) return _SC("Invalid port in address");
+    address.port = (enet_uint16) port;
+    return NULL;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns NULL on success or a message describing why the address could not be parsed
+////////////////////////////////////////////////////////////
+static const SQChar* parse_address(const std::string& addr_str, ENetAddress& address)
+{
+    std::string host_str;
+    const SQChar* error = split_address(addr_str, host_str, address);
+    if (error != NULL) return error;
+    if (host_str == "*") {
+        address.host = ENET_HOST_ANY;
+    } else {
+        if (!resolve_host(host_str, address)) return _SC("Failed to resolve host name");
+    }
+    return NULL;
+}
 
 
 ////////////////////////////////////////////////////////////
 static SQInteger parse_address(HSQUIRRELVM v, const std::string& addr_str, ENetAddress& address)
 {
-    size_t colonPos = addr_str.find(':');
-    if (colonPos == std::string::npos) return sq_throwerror(v, _SC("Failed to parse address (missing port in address?)"));
-    std::string host_str = addr_str.substr(0, colonPos);
-    std::string port_str = addr_str.substr(colonPos + 1);
-    if (host_str.empty()) return sq_throwerror(v, _SC("Failed to parse address"));
-    if (port_str.empty()) return sq_throwerror(v, _SC("Missing port in address"));
-    if (host_str == "*") {
-        address.host = ENET_HOST_ANY;
-    } else {
-        if (enet_address_set_host(&address, host_str.c_str()) != 0) return sq_throwerror(v, _SC("Failed to resolve host name"));
+    const SQChar* error = parse_address(addr_str, address);
+    if (error != NULL) return sq_throwerror(v, error);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Takes the network thread's lock, if the host has one, for calls that must not race it
+////////////////////////////////////////////////////////////
+class EnetHostLock
+{
+public:
+    explicit EnetHostLock(ENetHost* host) : thread(NULL)
+    {
+        EnetHostData* data = get_host_data(host);
+        if (data != NULL && data->thread != NULL) {
+            thread = data->thread;
+            thread->lock.lock();
+        }
+    }
+
+    ~EnetHostLock()
+    {
+        if (thread) thread->lock.unlock();
+    }
+
+private:
+    EnetHostLock(const EnetHostLock&);
+    EnetHostLock& operator=(const EnetHostLock&);
+
+    EnetHostThread* thread;
+};
+
+
+////////////////////////////////////////////////////////////
+// Returns a packet nothing on the VM thread still refers to, copying it if a script holds it
+////////////////////////////////////////////////////////////
+static ENetPacket* private_packet(ENetPacket* packet)
+{
+    if (packet->referenceCount == 0) return packet;
+    return enet_packet_create(packet->data, packet->dataLength, packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED | ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT));
+}
+
+
+////////////////////////////////////////////////////////////
+// Adds up the bytes in a peer's outgoing command lists; O(queue), so only done once per service
+//
+// ENet 1.3.17 merged the reliable and unreliable lists into one
+// and added a list for reliable commands held back by the window.
+//
+////////////////////////////////////////////////////////////
+static std::size_t walk_queued_bytes(ENetPeer* peer)
+{
+    std::size_t total = 0;
+#if ENET_VERSION >= ENET_VERSION_CREATE(1, 3, 17)
+    ENetList* lists[] = { &peer->outgoingCommands, &peer->outgoingSendReliableCommands };
+#else
+    ENetList* lists[] = { &peer->outgoingReliableCommands, &peer->outgoingUnreliableCommands };
+#endif
+    for (std::size_t i = 0; i < 2; i++) {
+        for (ENetListIterator it = enet_list_begin(lists[i]); it != enet_list_end(lists[i]); it = enet_list_next(it)) {
+            total += ((ENetOutgoingCommand*) it)->fragmentLength;
+        }
+    }
+    return total;
+}
+
+
+////////////////////////////////////////////////////////////
+// Brings every peer's queued byte count back in line with ENet's lists after ENet has sent what it could
+//
+// Between services sends only ever add to the counts, so this
+// is the one place they come down. Peers nothing was sent to
+// since their lists emptied are skipped without a walk. Call
+// with the host locked.
+//
+////////////////////////////////////////////////////////////
+static void settle_queued_bytes(ENetHost* host)
+{
+    EnetHostData* data = get_host_data(host);
+    if (data == NULL) return;
+    for (std::size_t i = 0; i < data->peers.size(); i++) {
+        EnetPeerData& peerData = data->peers[i];
+        if (peerData.queuedBytes == 0 && data->broadcastBytes == 0) continue;
+        peerData.queuedBytes = walk_queued_bytes(&host->peers[i]);
+    }
+    data->broadcastBytes = 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Counts a packet entering the send ring against the peer it's for, or every peer for a broadcast
+////////////////////////////////////////////////////////////
+static void count_ring_bytes(ENetHost* host, ENetPeer* peer, std::size_t bytes)
+{
+    if (peer != NULL) {
+        EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+        if (data != NULL) data->ringBytes += bytes;
+    } else {
+        EnetHostData* data = get_host_data(host);
+        if (data != NULL) data->ringBroadcastBytes += bytes;
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Must be called with the thread's lock held (or with the thread stopped)
+////////////////////////////////////////////////////////////
+static void run_send_command(EnetHostThread* thread, const EnetSendCommand& command)
+{
+    if (command.peer != NULL) {
+        EnetPeerData* data = static_cast<EnetPeerData*>(command.peer->data);
+        if (data != NULL) data->ringBytes -= command.packet->dataLength;
+        if (enet_peer_send(command.peer, command.channelID, command.packet) == 0 && data != NULL) {
+            data->queuedBytes += command.packet->dataLength;
+        }
+    } else {
+        EnetHostData* data = get_host_data(thread->host);
+        if (data != NULL) {
+            data->ringBroadcastBytes -= command.packet->dataLength;
+            data->broadcastBytes += command.packet->dataLength;
+        }
+        enet_host_broadcast(thread->host, command.channelID, command.packet);
+    }
+    if (--command.packet->referenceCount == 0) {
+        enet_packet_destroy(command.packet);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static void drain_sends(EnetHostThread* thread)
+{
+    EnetSendCommand command;
+    while (thread->sends.pop(command)) {
+        run_send_command(thread, command);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Hands a packet, with one reference already counted for the command, to the network thread
+////////////////////////////////////////////////////////////
+static void queue_send(EnetHostThread* thread, ENetPeer* peer, enet_uint8 channel_id, ENetPacket* packet)
+{
+    EnetSendCommand command;
+    command.peer = peer;
+    command.channelID = channel_id;
+    command.packet = packet;
+    count_ring_bytes(thread->host, peer, packet->dataLength);
+    if (!thread->sends.push(command)) {
+        // The network thread is behind, so catch up on its behalf to keep packets in order
+        std::lock_guard<std::mutex> guard(thread->lock);
+        drain_sends(thread);
+        run_send_command(thread, command);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Must be called with the target shard's lock held
+////////////////////////////////////////////////////////////
+static void run_shard_message(EnetHostThread* thread, const EnetShardMessage& message)
+{
+    ENetHost* host = thread->host;
+    if (message.type == SHARD_FORWARD) {
+        std::size_t slot = (std::size_t) (message.peerID & 0xFFFF);
+        if (slot < host->peerCount) {
+            ENetPeer* peer = &host->peers[slot];
+            EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+            if (data != NULL && peer_id(peer, data) == message.peerID && peer->state == ENET_PEER_STATE_CONNECTED) {
+                if (enet_peer_send(peer, message.channelID, message.packet) == 0) data->queuedBytes += message.packet->dataLength;
+            }
+        }
+    } else if (message.type == SHARD_BROADCAST) {
+        EnetHostData* data = get_host_data(host);
+        if (data != NULL) data->broadcastBytes += message.packet->dataLength;
+        enet_host_broadcast(host, message.channelID, message.packet);
+    } else {
+        // Events hand their packet over unreferenced, just like ENet's own receive events
+        --message.packet->referenceCount;
+        EnetScriptEvent event;
+        event.type = ENET_EVENT_TYPE_SHARD_MESSAGE;
+        event.peer = NULL;
+        event.channelID = message.channelID;
+        event.data = (enet_uint32) message.from;
+        event.packet = message.packet;
+        event.length = message.packet->dataLength;
+        thread->overflow.push_back(event);
+        return;
+    }
+    if (--message.packet->referenceCount == 0) {
+        enet_packet_destroy(message.packet);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static void drain_shard_mail(EnetHostThread* thread)
+{
+    std::size_t count = thread->shards->hosts.size();
+    EnetShardMessage message;
+    for (std::size_t from = 0; from < count; from++) {
+        EnetSpscQueue<EnetShardMessage>* mailbox = thread->shards->mailboxes[from * count + thread->shardIndex];
+        if (mailbox == NULL) continue;
+        while (mailbox->pop(message)) {
+            run_shard_message(thread, message);
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Held datagrams are sent back to the host's own socket behind this header so ENet receives them in order
+////////////////////////////////////////////////////////////
+static const std::size_t IMPAIR_HEADER = 14;     // Token, then the original sender's host and port
+static const std::size_t IMPAIR_MAX_HELD = 4096; // Datagrams beyond this are dropped like a full router queue
+
+
+////////////////////////////////////////////////////////////
+static int ENET_CALLBACK impair_intercept(ENetHost* host, ENetEvent* event)
+{
+    (void) event;
+    EnetHostData* data = get_host_data(host);
+    if (data == NULL) return 0;
+    EnetImpairment& impairment = data->impairment;
+    if (impairment.token != 0 && host->receivedDataLength >= IMPAIR_HEADER && host->receivedAddress.host == ENET_HOST_TO_NET_32(0x7F000001) &&
+        host->receivedAddress.port == impairment.port && std::memcmp(host->receivedData, &impairment.token, sizeof(impairment.token)) == 0) {
+        // One of ours coming back; make it look like it just arrived from its sender
+        std::memcpy(&host->receivedAddress.host, host->receivedData + 8, 4);
+        std::memcpy(&host->receivedAddress.port, host->receivedData + 12, 2);
+        host->receivedDataLength -= IMPAIR_HEADER;
+        std::memmove(host->receivedData, host->receivedData + IMPAIR_HEADER, host->receivedDataLength);
+        return 0;
+    }
+    if (!impairment.active) return 0;
+
+    if (impairment.loss > 0 && std::uniform_real_distribution<double>(0, 1)(impairment.random) < impairment.loss) {
+        impairment.dropped++;
+        return 1;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point departure = now;
+    if (impairment.bandwidth > 0) {
+        // Datagrams queue behind each other on the simulated link before latency applies
+        if (impairment.linkFree > departure) departure = impairment.linkFree;
+        departure += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((double) host->receivedDataLength / impairment.bandwidth));
+        impairment.linkFree = departure;
+    }
+    std::chrono::steady_clock::duration delay = impairment.latency;
+    if (impairment.jitter.count() > 0) {
+        delay += std::chrono::steady_clock::duration(std::uniform_int_distribution<long long>(-impairment.jitter.count(), impairment.jitter.count())(impairment.random));
+        if (delay.count() < 0) delay = std::chrono::steady_clock::duration::zero();
+    }
+    std::chrono::steady_clock::time_point due = departure + delay;
+    if (due <= now && impairment.held.empty()) return 0;
+    if (impairment.held.size() >= IMPAIR_MAX_HELD) {
+        impairment.dropped++;
+        return 1;
+    }
+    EnetDelayedDatagram datagram;
+    datagram.from = host->receivedAddress;
+    datagram.bytes.assign(host->receivedData, host->receivedData + host->receivedDataLength);
+    impairment.held.insert(std::make_pair(due, datagram));
+    impairment.delayed++;
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends held datagrams that are due, or all of them when everything is set, back to the host
+////////////////////////////////////////////////////////////
+static void release_held(ENetHost* host, EnetHostData* data, bool everything)
+{
+    EnetImpairment& impairment = data->impairment;
+    if (impairment.held.empty()) return;
+    if (impairment.port == 0) {
+        // Holding anything means the socket has been bound by now
+        ENetAddress bound;
+        if (enet_socket_get_address(host->socket, &bound) == 0) impairment.port = bound.port;
+    }
+    ENetAddress self;
+    self.host = ENET_HOST_TO_NET_32(0x7F000001);
+    self.port = impairment.port;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!impairment.held.empty() && (everything || impairment.held.begin()->first <= now)) {
+        EnetDelayedDatagram& datagram = impairment.held.begin()->second;
+        enet_uint8 header[IMPAIR_HEADER];
+        std::memcpy(header, &impairment.token, 8);
+        std::memcpy(header + 8, &datagram.from.host, 4);
+        std::memcpy(header + 12, &datagram.from.port, 2);
+        ENetBuffer buffers[2];
+        buffers[0].data = header;
+        buffers[0].dataLength = IMPAIR_HEADER;
+        buffers[1].data = &datagram.bytes[0];
+        buffers[1].dataLength = datagram.bytes.size();
+        enet_socket_send(host->socket, &self, buffers, 2);
+        impairment.held.erase(impairment.held.begin());
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Shortens a service timeout so the host wakes when its next held datagram is due
+////////////////////////////////////////////////////////////
+static enet_uint32 held_timeout(const EnetHostData* data, enet_uint32 timeout)
+{
+    if (data->impairment.held.empty()) return timeout;
+    std::chrono::steady_clock::duration wait = data->impairment.held.begin()->first - std::chrono::steady_clock::now();
+    long long ms = (std::chrono::duration_cast<std::chrono::microseconds>(wait).count() + 999) / 1000;
+    if (ms <= 0) return 0;
+    return ms < timeout ? (enet_uint32) ms : timeout;
+}
+
+
+////////////////////////////////////////////////////////////
+static void host_thread_main(EnetHostThread* thread)
+{
+    ENetHost* host = thread->host;
+    while (thread->running.load()) {
+        // Sleep on the socket without the lock so the VM thread can connect or disconnect meanwhile
+        enet_uint32 condition = ENET_SOCKET_WAIT_RECEIVE;
+        enet_socket_wait(host->socket, &condition, thread->interval);
+
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> guard(thread->lock);
+            drain_sends(thread);
+            if (thread->shards != NULL) drain_shard_mail(thread);
+            EnetHostData* data = get_host_data(host);
+            if (data != NULL) release_held(host, data, false);
+            ENetEvent event;
+            int out;
+            while ((out = enet_host_service(host, &event, 0)) > 0) {
+                thread->overflow.push_back(script_event(event));
+            }
+            if (out < 0) thread->failed.store(true);
+            settle_queued_bytes(host);
+            while (!thread->overflow.empty() && thread->events.push(thread->overflow.front())) {
+                thread->overflow.pop_front();
+                queued = true;
+            }
+        }
+        if (queued) {
+            std::lock_guard<std::mutex> wait(thread->waitLock);
+            thread->ready.notify_one();
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static int thread_next_event(EnetHostThread* thread, EnetScriptEvent& event, enet_uint32 timeout)
+{
+    if (thread->events.pop(event)) return 1;
+    if (timeout > 0) {
+        std::unique_lock<std::mutex> wait(thread->waitLock);
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        while (!thread->failed.load()) {
+            if (thread->events.pop(event)) return 1;
+            if (thread->ready.wait_until(wait, deadline) == std::cv_status::timeout) {
+                if (thread->events.pop(event)) return 1;
+                break;
+            }
+        }
+    }
+    if (thread->failed.exchange(false)) return -1;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Stops the network thread, handing queued packets back to ENet and queued events to the host
+////////////////////////////////////////////////////////////
+static void stop_host_thread(EnetHostData* data)
+{
+    EnetHostThread* thread = data->thread;
+    if (thread == NULL) return;
+    thread->running.store(false);
+    thread->thread.join();
+    drain_sends(thread);
+    EnetScriptEvent event;
+    while (thread->events.pop(event)) {
+        data->backlog.push_back(event);
+    }
+    data->backlog.insert(data->backlog.end(), thread->overflow.begin(), thread->overflow.end());
+    data->thread = NULL;
+    delete thread;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the bytes a peer has queued in ENet, or on their way to it through the send ring, and not yet sent
+////////////////////////////////////////////////////////////
+static std::size_t queued_bytes(ENetPeer* peer)
+{
+    const EnetPeerData* data = static_cast<const EnetPeerData*>(peer->data);
+    if (data == NULL) return walk_queued_bytes(peer);
+    return data->queuedBytes + data->host->broadcastBytes + data->ringBytes.load() + data->host->ringBroadcastBytes.load();
+}
+
+
+////////////////////////////////////////////////////////////
+// Outgoing bytes held for a peer, waiting in the scheduler, queued or sent and unacknowledged; call with the host locked
+////////////////////////////////////////////////////////////
+static std::size_t outgoing_bytes(ENetPeer* peer)
+{
+    const EnetPeerData* data = static_cast<const EnetPeerData*>(peer->data);
+    return queued_bytes(peer) + peer->reliableDataInTransit + (data != NULL ? data->scheduledBytes : 0);
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues writable events for refused peers that have drained below their low-water mark
+////////////////////////////////////////////////////////////
+static void check_writable(EnetHostData* data)
+{
+    if (data->blocked.empty()) return;
+    EnetHostLock lock(data->host);
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < data->blocked.size(); i++) {
+        EnetPeerData* peerData = data->blocked[i];
+        ENetPeer* peer = &data->host->peers[peerData - &data->peers[0]];
+        if (!peerData->blocked) continue;
+        if (outgoing_bytes(peer) > peerData->lowWater) {
+            data->blocked[kept++] = peerData;
+            continue;
+        }
+        peerData->blocked = false;
+        EnetScriptEvent event;
+        event.type = ENET_EVENT_TYPE_WRITABLE;
+        event.peer = peer;
+        event.channelID = 0;
+        event.data = 0;
+        event.packet = NULL;
+        data->backlog.push_back(event);
+    }
+    data->blocked.resize(kept);
+}
+
+
+////////////////////////////////////////////////////////////
+// Fetches the next event for the host, servicing the socket first when service is set
+////////////////////////////////////////////////////////////
+static int host_next_event(ENetHost* host, EnetHostData* data, EnetScriptEvent& event, enet_uint32 timeout, bool service)
+{
+    if (data != NULL && !data->backlog.empty()) {
+        event = data->backlog.front();
+        data->backlog.pop_front();
+        return 1;
+    }
+    if (data != NULL && data->thread != NULL) {
+        return thread_next_event(data->thread, event, service ? timeout : 0);
+    }
+    ENetEvent received;
+    int out;
+    if (service && data != NULL && !data->impairment.held.empty()) {
+        // Wait in slices so held datagrams go out on time
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        for (;;) {
+            release_held(host, data, false);
+            out = enet_host_service(host, &received, held_timeout(data, timeout));
+            if (out != 0) break;
+            std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+            if (left.count() <= 0) break;
+            timeout = (enet_uint32) std::chrono::duration_cast<std::chrono::milliseconds>(left).count();
+        }
+    } else {
+        if (data != NULL) release_held(host, data, false);
+        out = service ? enet_host_service(host, &received, timeout) : enet_host_check_events(host, &received);
+    }
+    if (service) settle_queued_bytes(host);
+    if (out > 0) event = script_event(received);
+    return out;
+}
+
+
+////////////////////////////////////////////////////////////
+// Native serializer
+//
+// Every value starts with a tag byte. Integers are zigzag
+// varints, strings and containers are prefixed with a varint
+// length, and table keys that repeat inside one message (or
+// were registered with Host.serializer_keys) are sent as a
+// varint index instead of the string itself.
+//
+////////////////////////////////////////////////////////////
+enum EnetSerializerTag
+{
+    SERIAL_NULL,
+    SERIAL_FALSE,
+    SERIAL_TRUE,
+    SERIAL_INTEGER,
+    SERIAL_FLOAT32,
+    SERIAL_FLOAT64,
+    SERIAL_STRING,
+    SERIAL_KEY_REF,
+    SERIAL_PRESET_KEY_REF,
+    SERIAL_ARRAY,
+    SERIAL_TABLE
+};
+
+static const int SERIAL_MAX_DEPTH = 32;
+static const std::size_t SERIAL_MAX_KEYS = 64;
+
+
+////////////////////////////////////////////////////////////
+struct EnetSerializerState
+{
+    explicit EnetSerializerState(const EnetHostData* host) : host(host) {}
+
+    const EnetHostData* host;
+    std::vector<const SQChar*> keys; // Squirrel interns strings, so equal keys share a pointer
+    std::vector<HSQOBJECT> keyObjects;
+};
+
+
+////////////////////////////////////////////////////////////
+static bool serial_write_varint(EnetPacketBuffer& out, SQUnsignedInteger value)
+{
+    enet_uint8 bytes[(sizeof(SQUnsignedInteger) * 8 + 6) / 7];
+    std::size_t size = 0;
+    do {
+        bytes[size] = (enet_uint8) (value & 0x7F);
+        value >>= 7;
+        if (value != 0) bytes[size] |= 0x80;
+        size++;
+    } while (value != 0);
+    enet_uint8* data = out.append(size);
+    if (data == NULL) return false;
+    std::memcpy(data, bytes, size);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+static bool serial_write_tag(EnetPacketBuffer& out, enet_uint8 tag)
+{
+    enet_uint8* data = out.append(1);
+    if (data == NULL) return false;
+    data[0] = tag;
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+static bool serial_write_bytes(EnetPacketBuffer& out, const void* bytes, std::size_t size)
+{
+    if (!serial_write_varint(out, size)) return false;
+    enet_uint8* data = out.append(size);
+    if (data == NULL) return false;
+    std::memcpy(data, bytes, size);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+static SQInteger serialize_value(HSQUIRRELVM v, SQInteger idx, EnetPacketBuffer& out, EnetSerializerState& state, bool isKey, int depth)
+{
+    if (depth > SERIAL_MAX_DEPTH) return sq_throwerror(v, _SC("Value is nested too deeply to serialize"));
+    if (idx < 0) idx = sq_gettop(v) + idx + 1;
+    bool ok = true;
+    switch (sq_gettype(v, idx)) {
+    case OT_NULL :
+        ok = serial_write_tag(out, SERIAL_NULL);
+        break;
+    case OT_BOOL : {
+        SQBool value;
+        sq_getbool(v, idx, &value);
+        ok = serial_write_tag(out, value ? SERIAL_TRUE : SERIAL_FALSE);
+        break;
+    }
+    case OT_INTEGER : {
+        SQInteger value;
+        sq_getinteger(v, idx, &value);
+        SQUnsignedInteger zigzag = ((SQUnsignedInteger) value << 1) ^ (SQUnsignedInteger) (value >> (sizeof(SQInteger) * 8 - 1));
+        ok = serial_write_tag(out, SERIAL_INTEGER) && serial_write_varint(out, zigzag);
+        break;
+    }
+    case OT_FLOAT : {
+        SQFloat value;
+        sq_getfloat(v, idx, &value);
+        enet_uint8* data;
+        ok = serial_write_tag(out, sizeof(SQFloat) == 8 ? SERIAL_FLOAT64 : SERIAL_FLOAT32) && (data = out.append(sizeof(SQFloat))) != NULL;
+        if (ok) {
+            // Stored little-endian regardless of the host byte order
+            enet_uint8 bytes[sizeof(SQFloat)];
+            std::memcpy(bytes, &value, sizeof(SQFloat));
+            const enet_uint16 probe = 1;
+            bool little = *(const enet_uint8*) &probe == 1;
+            for (std::size_t i = 0; i < sizeof(SQFloat); i++) {
+                data[i] = bytes[little ? i : sizeof(SQFloat) - 1 - i];
+            }
+        }
+        break;
+    }
+    case OT_STRING : {
+        const SQChar* value;
+        sq_getstring(v, idx, &value);
+        if (isKey) {
+            if (state.host != NULL) {
+                std::map<const SQChar*, std::size_t>::const_iterator preset = state.host->presetIndex.find(value);
+                if (preset != state.host->presetIndex.end()) {
+                    ok = serial_write_tag(out, SERIAL_PRESET_KEY_REF) && serial_write_varint(out, preset->second);
+                    break;
+                }
+            }
+            std::size_t key;
+            for (key = 0; key < state.keys.size(); key++) {
+                if (state.keys[key] == value) break;
+            }
+            if (key < state.keys.size()) {
+                ok = serial_write_tag(out, SERIAL_KEY_REF) && serial_write_varint(out, key);
+                break;
+            }
+            if (state.keys.size() < SERIAL_MAX_KEYS) state.keys.push_back(value);
+        }
+        ok = serial_write_tag(out, SERIAL_STRING) && serial_write_bytes(out, value, sq_getsize(v, idx) * sizeof(SQChar));
+        break;
+    }
+    case OT_ARRAY :
+    case OT_TABLE : {
+        bool table = sq_gettype(v, idx) == OT_TABLE;
+        if (isKey) return sq_throwerror(v, _SC("Cannot serialize a container as a table key"));
+        ok = serial_write_tag(out, table ? SERIAL_TABLE : SERIAL_ARRAY) && serial_write_varint(out, sq_getsize(v, idx));
+        if (!ok) break;
+        sq_pushnull(v);
+        while (SQ_SUCCEEDED(sq_next(v, idx))) {
+            SQInteger result = 0;
+            if (table) result = serialize_value(v, -2, out, state, true, depth + 1);
+            if (SQ_SUCCEEDED(result)) result = serialize_value(v, -1, out, state, false, depth + 1);
+            sq_pop(v, 2);
+            if (SQ_FAILED(result)) {
+                sq_pop(v, 1);
+                return result;
+            }
+        }
+        sq_pop(v, 1);
+        break;
+    }
+    default :
+        return sq_throwerror(v, _SC("Cannot serialize value of this type"));
+    }
+    if (!ok) return sq_throwerror(v, _SC("Failed to grow packet"));
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+static bool serial_read_varint(const enet_uint8*& data, const enet_uint8* end, SQUnsignedInteger& value)
+{
+    value = 0;
+    unsigned int shift = 0;
+    do {
+        if (data == end || shift >= sizeof(SQUnsignedInteger) * 8) return false;
+        value |= (SQUnsignedInteger) (*data & 0x7F) << shift;
+        shift += 7;
+    } while (*data++ & 0x80);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Pushes the decoded value, leaving the stack untouched on failure
+////////////////////////////////////////////////////////////
+static bool deserialize_value(HSQUIRRELVM v, const enet_uint8*& data, const enet_uint8* end, EnetSerializerState& state, bool isKey, int depth)
+{
+    if (data == end || depth > SERIAL_MAX_DEPTH) return false;
+    SQUnsignedInteger value;
+    switch (*data++) {
+    case SERIAL_NULL :
+        sq_pushnull(v);
+        return true;
+    case SERIAL_FALSE :
+        sq_pushbool(v, SQFalse);
+        return true;
+    case SERIAL_TRUE :
+        sq_pushbool(v, SQTrue);
+        return true;
+    case SERIAL_INTEGER :
+        if (!serial_read_varint(data, end, value)) return false;
+        sq_pushinteger(v, (SQInteger) (value >> 1) ^ -(SQInteger) (value & 1));
+        return true;
+    case SERIAL_FLOAT32 :
+    case SERIAL_FLOAT64 : {
+        std::size_t size = data[-1] == SERIAL_FLOAT32 ? 4 : 8;
+        if ((std::size_t) (end - data) < size) return false;
+        enet_uint8 bytes[8];
+        const enet_uint16 probe = 1;
+        bool little = *(const enet_uint8*) &probe == 1;
+        for (std::size_t i = 0; i < size; i++) {
+            bytes[little ? i : size - 1 - i] = data[i];
+        }
+        data += size;
+        if (size == 4) {
+            float number;
+            std::memcpy(&number, bytes, 4);
+            sq_pushfloat(v, (SQFloat) number);
+        } else {
+            double number;
+            std::memcpy(&number, bytes, 8);
+            sq_pushfloat(v, (SQFloat) number);
+        }
+        return true;
+    }
+    case SERIAL_STRING :
+        if (!serial_read_varint(data, end, value) || value > (SQUnsignedInteger) (end - data) || value % sizeof(SQChar) != 0) return false;
+        sq_pushstring(v, (const SQChar*) data, value / sizeof(SQChar));
+        data += value;
+        if (isKey && state.keyObjects.size() < SERIAL_MAX_KEYS) {
+            HSQOBJECT key;
+            sq_getstackobj(v, -1, &key);
+            state.keyObjects.push_back(key);
+        }
+        return true;
+    case SERIAL_KEY_REF :
+        if (!serial_read_varint(data, end, value) || value >= state.keyObjects.size()) return false;
+        sq_pushobject(v, state.keyObjects[value]);
+        return true;
+    case SERIAL_PRESET_KEY_REF :
+        if (state.host == NULL || !serial_read_varint(data, end, value) || value >= state.host->presetKeys.size()) return false;
+        sq_pushobject(v, state.host->presetKeys[value]);
+        return true;
+    case SERIAL_ARRAY :
+    case SERIAL_TABLE : {
+        bool table = data[-1] == SERIAL_TABLE;
+        if (isKey || !serial_read_varint(data, end, value) || value > (SQUnsignedInteger) (end - data)) return false;
+        SQInteger top = sq_gettop(v);
+        if (table) {
+            sq_newtable(v);
+        } else {
+            sq_newarray(v, 0);
+        }
+        for (SQUnsignedInteger i = 0; i < value; i++) {
+            if (table && !deserialize_value(v, data, end, state, true, depth + 1)) {
+                sq_settop(v, top);
+                return false;
+            }
+            if (!deserialize_value(v, data, end, state, false, depth + 1)) {
+                sq_settop(v, top);
+                return false;
+            }
+            if (table) {
+                if (sq_gettype(v, -2) == OT_NULL || SQ_FAILED(sq_newslot(v, -3, SQFalse))) {
+                    sq_settop(v, top);
+                    return false;
+                }
+            } else {
+                sq_arrayappend(v, -2);
+            }
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+
+////////////////////////////////////////////////////////////
+// LZ77 datagram compressor in the style of LZ4 blocks
+//
+// Each sequence is a token byte (literal count in the high nibble,
+// match length - 4 in the low nibble, 15 meaning more length bytes
+// follow, each adding up to 255), the literals, then a 16-bit
+// little-endian offset back into the output or the dictionary
+// before it. The last sequence stops after its literals.
+//
+////////////////////////////////////////////////////////////
+static const std::size_t LZ_MIN_MATCH = 4;
+static const std::size_t LZ_MAX_OFFSET = 65535;
+static const int LZ_HASH_BITS = 12;
+static const int LZ_MAX_LEVEL = 9;
+
+struct EnetLzCompressor
+{
+    EnetLzCompressor(int level, const enet_uint8* dictionary, std::size_t dictionarySize, EnetCompressionStats* stats);
+
+    int level;                              // 1 probes one candidate per position, each level above doubles that
+    std::vector<enet_uint8> dictionary;     // Trailing bytes of the preset dictionary, at most LZ_MAX_OFFSET
+    std::vector<int> dictionaryHead;        // Hash heads after indexing the dictionary
+    std::vector<int> dictionaryChain;       // Previous position with the same hash, for dictionary positions
+    std::vector<enet_uint8> window;         // Dictionary followed by the datagram being coded
+    std::vector<int> head;
+    std::vector<int> chain;                 // As dictionaryChain, for positions after the dictionary
+    EnetCompressionStats* stats;
+};
+
+
+////////////////////////////////////////////////////////////
+static enet_uint32 lz_hash(const enet_uint8* data)
+{
+    enet_uint32 value = data[0] | (data[1] << 8) | (data[2] << 16) | ((enet_uint32) data[3] << 24);
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+////////////////////////////////////////////////////////////
+static int lz_previous(const EnetLzCompressor* lz, int position)
+{
+    std::size_t dictionarySize = lz->dictionary.size();
+    if ((std::size_t) position < dictionarySize) return lz->dictionaryChain[position];
+    return lz->chain[position - dictionarySize];
+}
+
+
+////////////////////////////////////////////////////////////
+static void lz_insert(EnetLzCompressor* lz, std::vector<int>& head, int position)
+{
+    enet_uint32 hash = lz_hash(&lz->window[position]);
+    std::size_t dictionarySize = lz->dictionary.size();
+    if ((std::size_t) position < dictionarySize) {
+        lz->dictionaryChain[position] = head[hash];
+    } else {
+        lz->chain[position - dictionarySize] = head[hash];
+    }
+    head[hash] = position;
+}
+
+
+////////////////////////////////////////////////////////////
+EnetLzCompressor::EnetLzCompressor(int level, const enet_uint8* data, std::size_t size, EnetCompressionStats* stats) : level(level), dictionaryHead(1 << LZ_HASH_BITS, -1), head(1 << LZ_HASH_BITS), stats(stats)
+{
+    // Only the tail of a long dictionary can be reached by a 16-bit offset
+    if (size > LZ_MAX_OFFSET) {
+        data += size - LZ_MAX_OFFSET;
+        size = LZ_MAX_OFFSET;
+    }
+    dictionary.assign(data, data + size);
+    dictionaryChain.resize(size);
+    window = dictionary;
+    for (std::size_t i = 0; i + LZ_MIN_MATCH <= size; i++) {
+        lz_insert(this, dictionaryHead, (int) i);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends a sequence length's extra bytes, returning false if out of room
+////////////////////////////////////////////////////////////
+static bool lz_write_length(enet_uint8*& out, enet_uint8* end, std::size_t length)
+{
+    while (length >= 255) {
+        if (out == end) return false;
+        *out++ = 255;
+        length -= 255;
+    }
+    if (out == end) return false;
+    *out++ = (enet_uint8) length;
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+static bool lz_write_sequence(enet_uint8*& out, enet_uint8* end, const enet_uint8* literals, std::size_t literalCount, std::size_t offset, std::size_t matchLength)
+{
+    if (out == end) return false;
+    std::size_t matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    *out++ = (enet_uint8) (((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    if (literalCount >= 15 && !lz_write_length(out, end, literalCount - 15)) return false;
+    if ((std::size_t) (end - out) < literalCount) return false;
+    std::memcpy(out, literals, literalCount);
+    out += literalCount;
+    if (matchLength == 0) return true;
+    if (end - out < 2) return false;
+    *out++ = (enet_uint8) offset;
+    *out++ = (enet_uint8) (offset >> 8);
+    if (matchCode >= 15 && !lz_write_length(out, end, matchCode - 15)) return false;
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the compressed size, or 0 to have ENet send the datagram as it is
+////////////////////////////////////////////////////////////
+static std::size_t lz_compress(EnetLzCompressor* lz, const ENetBuffer* inBuffers, std::size_t inBufferCount, std::size_t inLimit, enet_uint8* outData, std::size_t outLimit)
+{
+    std::size_t start = lz->dictionary.size();
+    lz->window.resize(start + inLimit);
+    std::size_t size = start;
+    for (std::size_t i = 0; i < inBufferCount && size < lz->window.size(); i++) {
+        std::size_t length = inBuffers[i].dataLength;
+        if (length > lz->window.size() - size) length = lz->window.size() - size;
+        std::memcpy(&lz->window[size], inBuffers[i].data, length);
+        size += length;
+    }
+    lz->head = lz->dictionaryHead;
+    lz->chain.resize(size - start);
+
+    // Never produce more than the input, since then sending it raw is cheaper
+    enet_uint8* out = outData;
+    enet_uint8* end = outData + (outLimit < inLimit ? outLimit : inLimit);
+    const enet_uint8* window = &lz->window[0];
+    int attempts = 1 << (lz->level - 1);
+    std::size_t anchor = start;
+    std::size_t position = start;
+    while (position + LZ_MIN_MATCH <= size) {
+        std::size_t bestLength = 0;
+        std::size_t bestOffset = 0;
+        int candidate = lz->head[lz_hash(window + position)];
+        for (int i = 0; i < attempts && candidate >= 0 && position - candidate <= LZ_MAX_OFFSET; i++) {
+            std::size_t length = 0;
+            while (position + length < size && window[candidate + length] == window[position + length]) {
+                length++;
+            }
+            if (length > bestLength) {
+                bestLength = length;
+                bestOffset = position - candidate;
+            }
+            candidate = lz_previous(lz, candidate);
+        }
+        lz_insert(lz, lz->head, (int) position);
+        if (bestLength < LZ_MIN_MATCH) {
+            position++;
+            continue;
+        }
+        if (!lz_write_sequence(out, end, window + anchor, position - anchor, bestOffset, bestLength)) return 0;
+        std::size_t matchEnd = position + bestLength;
+
+        // The fastest level only indexes the tail of each match
+        for (position = lz->level > 1 ? position + 1 : matchEnd - 2; position < matchEnd; position++) {
+            if (position + LZ_MIN_MATCH <= size) lz_insert(lz, lz->head, (int) position);
+        }
+        anchor = position = matchEnd;
+    }
+    if (!lz_write_sequence(out, end, window + anchor, size - anchor, 0, 0)) return 0;
+    if (out == end) return 0;
+    return out - outData;
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a sequence length's extra bytes, returning false if the input ends first
+////////////////////////////////////////////////////////////
+static bool lz_read_length(const enet_uint8*& in, const enet_uint8* end, std::size_t& length)
+{
+    enet_uint8 byte;
+    do {
+        if (in == end) return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the decompressed size, or 0 if the input is malformed or does not fit
+////////////////////////////////////////////////////////////
+static std::size_t lz_decompress(EnetLzCompressor* lz, const enet_uint8* inData, std::size_t inLimit, enet_uint8* outData, std::size_t outLimit)
+{
+    std::size_t start = lz->dictionary.size();
+    lz->window.resize(start + outLimit);
+    enet_uint8* window = &lz->window[0];
+    std::size_t position = start;
+    std::size_t limit = start + outLimit;
+    const enet_uint8* in = inData;
+    const enet_uint8* end = inData + inLimit;
+    while (in < end) {
+        enet_uint8 token = *in++;
+        std::size_t literalCount = token >> 4;
+        if (literalCount == 15 && !lz_read_length(in, end, literalCount)) return 0;
+        if ((std::size_t) (end - in) < literalCount || limit - position < literalCount) return 0;
+        std::memcpy(window + position, in, literalCount);
+        in += literalCount;
+        position += literalCount;
+        if (in == end) break;
+        if (end - in < 2) return 0;
+        std::size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        std::size_t matchLength = token & 15;
+        if (matchLength == 15 && !lz_read_length(in, end, matchLength)) return 0;
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > position || limit - position < matchLength) return 0;
+
+        // Byte by byte, since a match may overlap the bytes it produces
+        for (std::size_t i = 0; i < matchLength; i++, position++) {
+            window[position] = window[position - offset];
+        }
+    }
+    std::memcpy(outData, window + start, position - start);
+    return position - start;
+}
+
+
+////////////////////////////////////////////////////////////
+static std::size_t ENET_CALLBACK lz_compress_callback(void* context, const ENetBuffer* inBuffers, std::size_t inBufferCount, std::size_t inLimit, enet_uint8* outData, std::size_t outLimit)
+{
+    EnetLzCompressor* lz = static_cast<EnetLzCompressor*>(context);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::size_t size = lz_compress(lz, inBuffers, inBufferCount, inLimit, outData, outLimit);
+    lz->stats->compressTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (size == 0) {
+        ++lz->stats->skipped;
+    } else {
+        ++lz->stats->packets;
+        lz->stats->rawBytes += inLimit;
+        lz->stats->compressedBytes += size;
+    }
+    return size;
+}
+
+
+////////////////////////////////////////////////////////////
+static std::size_t ENET_CALLBACK lz_decompress_callback(void* context, const enet_uint8* inData, std::size_t inLimit, enet_uint8* outData, std::size_t outLimit)
+{
+    EnetLzCompressor* lz = static_cast<EnetLzCompressor*>(context);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::size_t size = lz_decompress(lz, inData, inLimit, outData, outLimit);
+    lz->stats->decompressTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (size == 0) {
+        ++lz->stats->failures;
+    } else {
+        ++lz->stats->decompressedPackets;
+        lz->stats->decompressedBytes += size;
+    }
+    return size;
+}
+
+
+////////////////////////////////////////////////////////////
+static void ENET_CALLBACK lz_destroy_callback(void* context)
+{
+    delete static_cast<EnetLzCompressor*>(context);
+}
+
+
+////////////////////////////////////////////////////////////
+// Pushes the payload of a receive or shard message event as the host's receive mode dictates
+////////////////////////////////////////////////////////////
+static void push_payload(HSQUIRRELVM v, const EnetHostData* data, const EnetScriptEvent& event)
+{
+    if (data != NULL && data->receiveMode == ENET_RECEIVE_PACKET && event.shared) {
+        // A coalesced message gets a packet of its own so scripts never see its neighbours
+        ENetPacket* message = enet_packet_create(event.packet->data + event.offset, event.length, event.packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED));
+        if (message != NULL) {
+            Sqrat::PushVar(v, EnetPacketBuffer(message));
+        } else {
+            sq_pushnull(v);
+        }
+    } else if (data != NULL && data->receiveMode == ENET_RECEIVE_PACKET) {
+        Sqrat::PushVar(v, EnetPacketBuffer(event.packet));
+    } else if (data != NULL && data->receiveMode == ENET_RECEIVE_DECODED) {
+        // Malformed payloads are delivered as null rather than interrupting the service loop
+        EnetSerializerState state(data);
+        const enet_uint8* begin = event.packet->data + event.offset;
+        const enet_uint8* end = begin + event.length;
+        if (!deserialize_value(v, begin, end, state, false, 0)) {
+            sq_pushnull(v);
+        } else if (begin != end) {
+            sq_poptop(v);
+            sq_pushnull(v);
+        }
+    } else {
+        sq_pushstring(v, (const SQChar*) (event.packet->data + event.offset), event.length / sizeof(SQChar));
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Drops the event's hold on its packet, freeing it unless a script still refers to it
+////////////////////////////////////////////////////////////
+static void release_event_packet(const EnetScriptEvent& event)
+{
+    if (event.shared) --event.packet->referenceCount;
+    if (event.packet->referenceCount == 0) {
+        enet_packet_destroy(event.packet);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns where a finished file stream was written, forgetting it
+////////////////////////////////////////////////////////////
+static std::string take_stream_file(const EnetScriptEvent& event)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(event.peer->data);
+    std::string path;
+    std::map<enet_uint32, std::string>::iterator it;
+    if (data != NULL && (it = data->streamFiles.find(event.data)) != data->streamFiles.end()) {
+        path.swap(it->second);
+        data->streamFiles.erase(it);
+    }
+    return path;
+}
+
+
+////////////////////////////////////////////////////////////
+static void push_event(HSQUIRRELVM v, EnetHostData* data, const EnetScriptEvent& event)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    sq_newtable(v);
+    if (event.peer) {
+        Sqrat::PushVar(v, "peer");
+        push_peer(v, event.peer);
+        sq_newslot(v, -3, false);
+    }
+    switch (event.type) {
+    case ENET_EVENT_TYPE_CONNECT :
+        Sqrat::PushVar(v, "data");
+        Sqrat::PushVar(v, event.data);
+        sq_newslot(v, -3, false);
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, ENET_EVENT_TYPE_CONNECT);
+        break;
+    case ENET_EVENT_TYPE_DISCONNECT :
+        Sqrat::PushVar(v, "data");
+        Sqrat::PushVar(v, event.data);
+        sq_newslot(v, -3, false);
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, ENET_EVENT_TYPE_DISCONNECT);
+        if (!event.replayed) defer_release_peer(event.peer);
+        break;
+    case ENET_EVENT_TYPE_RECEIVE :
+    case ENET_EVENT_TYPE_SHARD_MESSAGE :
+        if (event.type == ENET_EVENT_TYPE_RECEIVE && !event.replayed) {
+            count_received(data, event.peer, event.channelID, event.length);
+        }
+        Sqrat::PushVar(v, "data");
+        push_payload(v, data, event);
+        sq_newslot(v, -3, false);
+        Sqrat::PushVar(v, "channel");
+        Sqrat::PushVar(v, event.channelID);
+        sq_newslot(v, -3, false);
+        if (event.type == ENET_EVENT_TYPE_SHARD_MESSAGE) {
+            Sqrat::PushVar(v, "shard");
+            Sqrat::PushVar(v, event.data);
+            sq_newslot(v, -3, false);
+        }
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, event.type);
+        release_event_packet(event);
+        break;
+    case ENET_EVENT_TYPE_WRITABLE :
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, event.type);
+        break;
+    case ENET_EVENT_TYPE_CONNECT_READY :
+    case ENET_EVENT_TYPE_CONNECT_FAILED :
+    case ENET_EVENT_TYPE_REPLAY_DONE :
+        Sqrat::PushVar(v, "data");
+        Sqrat::PushVar(v, event.data);
+        sq_newslot(v, -3, false);
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, event.type);
+        break;
+    case ENET_EVENT_TYPE_STREAM_PROGRESS :
+    case ENET_EVENT_TYPE_STREAM_COMPLETE :
+    case ENET_EVENT_TYPE_STREAM_FAILED :
+    case ENET_EVENT_TYPE_STREAM_SENT :
+    case ENET_EVENT_TYPE_STREAM_CANCELLED :
+        Sqrat::PushVar(v, "stream");
+        Sqrat::PushVar(v, event.data);
+        sq_newslot(v, -3, false);
+        Sqrat::PushVar(v, "bytes");
+        Sqrat::PushVar(v, (SQInteger) event.offset);
+        sq_newslot(v, -3, false);
+        Sqrat::PushVar(v, "total");
+        Sqrat::PushVar(v, (SQInteger) event.length);
+        sq_newslot(v, -3, false);
+        if (event.type == ENET_EVENT_TYPE_STREAM_COMPLETE && event.packet != NULL) {
+            Sqrat::PushVar(v, "data");
+            Sqrat::PushVar(v, EnetPacketBuffer(event.packet));
+            sq_newslot(v, -3, false);
+            release_event_packet(event);
+        } else if (event.type == ENET_EVENT_TYPE_STREAM_COMPLETE) {
+            Sqrat::PushVar(v, "path");
+            Sqrat::PushVar(v, take_stream_file(event));
+            sq_newslot(v, -3, false);
+        }
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, event.type);
+        break;
+    case ENET_EVENT_TYPE_NONE :
+        Sqrat::PushVar(v, "type");
+        Sqrat::PushVar(v, ENET_EVENT_TYPE_NONE);
+        break;
+    }
+    sq_newslot(v, -3, false);
+    if (data != NULL) record_time(data->dispatchTime, start);
+}
+
+
+////////////////////////////////////////////////////////////
+// Calls a handler as fn(peer, data), with data the payload or the event's integer
+////////////////////////////////////////////////////////////
+static SQRESULT call_handler(HSQUIRRELVM v, HSQOBJECT handler, EnetHostData* data, const EnetScriptEvent& event, bool payload)
+{
+    sq_pushobject(v, handler);
+    sq_pushroottable(v);
+    push_peer(v, event.peer);
+    if (payload) {
+        push_payload(v, data, event);
+    } else {
+        sq_pushinteger(v, (SQInteger) event.data);
+    }
+    SQRESULT result = sq_call(v, 3, SQFalse, SQTrue);
+    sq_poptop(v);
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////
+// Hands an event straight to its registered handler, falling back to on_event and then dropping it
+////////////////////////////////////////////////////////////
+static SQRESULT deliver_event(HSQUIRRELVM v, EnetHostData* data, const EnetScriptEvent& event)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SQRESULT result = SQ_OK;
+    switch (event.type) {
+    case ENET_EVENT_TYPE_CONNECT :
+        if (sq_isnull(data->onConnect)) break;
+        result = call_handler(v, data->onConnect, data, event, false);
+        record_time(data->dispatchTime, start);
+        return result;
+    case ENET_EVENT_TYPE_DISCONNECT :
+        if (sq_isnull(data->onDisconnect)) break;
+        result = call_handler(v, data->onDisconnect, data, event, false);
+        if (!event.replayed) defer_release_peer(event.peer);
+        record_time(data->dispatchTime, start);
+        return result;
+    case ENET_EVENT_TYPE_RECEIVE :
+        if (event.channelID >= data->onReceive.size() || sq_isnull(data->onReceive[event.channelID])) break;
+        if (!event.replayed) count_received(data, event.peer, event.channelID, event.length);
+        result = call_handler(v, data->onReceive[event.channelID], data, event, true);
+        release_event_packet(event);
+        record_time(data->dispatchTime, start);
+        return result;
+    }
+    if (!sq_isnull(data->onEvent)) {
+        sq_pushobject(v, data->onEvent);
+        sq_pushroottable(v);
+        push_event(v, data, event);
+        result = sq_call(v, 2, SQFalse, SQTrue);
+        sq_poptop(v);
+        return result;
+    }
+
+    // Nobody is listening, so only do what the event table would have done
+    if (event.type == ENET_EVENT_TYPE_RECEIVE && !event.replayed) {
+        count_received(data, event.peer, event.channelID, event.length);
+    }
+    if (event.packet != NULL) {
+        release_event_packet(event);
+    } else if (event.type == ENET_EVENT_TYPE_STREAM_COMPLETE) {
+        take_stream_file(event);
+    }
+    if (event.type == ENET_EVENT_TYPE_DISCONNECT && !event.replayed) {
+        defer_release_peer(event.peer);
+    }
+    return SQ_OK;
+}
+
+
+////////////////////////////////////////////////////////////
+// Delivers an event to its handlers, timing them while the host is profiled
+////////////////////////////////////////////////////////////
+static SQRESULT dispatch_event(HSQUIRRELVM v, EnetHostData* data, const EnetScriptEvent& event)
+{
+    if (data->profiler == NULL || !data->profiler->active) return deliver_event(v, data, event);
+    profile_event(data, event);
+    SQRESULT result = deliver_event(v, data, event);
+    profile_settle(data->profiler);
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////
+// Flag value meaning "reliable for strings, the packet's own flags for enet.Packet"
+////////////////////////////////////////////////////////////
+static const enet_uint32 PACKET_FLAG_DEFAULT = 0xFFFFFFFF;
+
+
+////////////////////////////////////////////////////////////
+static SQInteger read_packet(HSQUIRRELVM v, SQInteger idx, const EnetHostData* data, ENetPacket*& packet, enet_uint32 flag)
+{
+    if (flag != PACKET_FLAG_DEFAULT && flag != ENET_PACKET_FLAG_RELIABLE && flag != ENET_PACKET_FLAG_UNSEQUENCED && flag != 0) {
+        return sq_throwerror(v, _SC("Unknown packet flag"));
+    }
+    if (sq_gettype(v, idx) == OT_TABLE || sq_gettype(v, idx) == OT_ARRAY) {
+        EnetPacketBuffer buffer(128, flag == PACKET_FLAG_DEFAULT ? (enet_uint32) ENET_PACKET_FLAG_RELIABLE : flag);
+        if (buffer.packet == NULL) {
+            return sq_throwerror(v, _SC("Failed to create packet"));
+        }
+        EnetSerializerState state(data);
+        SQInteger result = serialize_value(v, idx, buffer, state, false, 0);
+        if (SQ_FAILED(result)) {
+            return result;
+        }
+        packet = buffer.detach();
+        return 0;
+    }
+    if (sq_gettype(v, idx) == OT_STRING) {
+        // Read the script string in place rather than copying it into a std::string first
+        const SQChar* string;
+        sq_getstring(v, idx, &string);
+        packet = enet_packet_create(string, sq_getsize(v, idx) * sizeof(SQChar), flag == PACKET_FLAG_DEFAULT ? (enet_uint32) ENET_PACKET_FLAG_RELIABLE : flag);
+        if (packet == NULL) {
+            return sq_throwerror(v, _SC("Failed to create packet"));
+        }
+        return 0;
+    }
+    Sqrat::Var<EnetPacketBuffer*> buffer(v, idx);
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, _SC("Expected a string, table, array or enet.Packet"));
+    }
+    if (buffer.value->packet == NULL) {
+        return sq_throwerror(v, _SC("Packet is empty"));
+    }
+    if (flag != PACKET_FLAG_DEFAULT && flag != (buffer.value->packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED))) {
+        return sq_throwerror(v, _SC("Packet was created with different flags"));
+    }
+    packet = buffer.value->packet;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Hands a packet to ENet, or to the network thread, bypassing the scheduler
+////////////////////////////////////////////////////////////
+static int transmit_packet(ENetPeer* peer, enet_uint8 channel_id, ENetPacket* packet)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    if (data != NULL && data->host->thread != NULL) {
+        packet = private_packet(packet);
+        if (packet == NULL) return -1;
+        count_sent(data->host, peer, channel_id, packet, 1);
+        capture_send(data->host, peer, channel_id, packet);
+        ++packet->referenceCount;
+        queue_send(data->host->thread, peer, channel_id, packet);
+        return 0;
+    }
+    // Counted once ENet has taken it, so refused sends don't show up as sent; the
+    // reference held across the call keeps the packet readable either way
+    ++packet->referenceCount;
+    int result = enet_peer_send(peer, channel_id, packet);
+    if (result == 0 && data != NULL) {
+        count_sent(data->host, peer, channel_id, packet, 1);
+        capture_send(data->host, peer, channel_id, packet);
+        data->queuedBytes += packet->dataLength;
+    }
+    if (--packet->referenceCount == 0) {
+        enet_packet_destroy(packet);
+    }
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues a packet for the peer behind others on its channel, until run_scheduler releases it
+////////////////////////////////////////////////////////////
+static int schedule_packet(ENetPeer* peer, EnetPeerData* data, enet_uint8 channel_id, ENetPacket* packet)
+{
+    EnetHostData* host = data->host;
+    if (peer->state != ENET_PEER_STATE_CONNECTED || data->disconnectPending || channel_id >= peer->channelCount) {
+        // Refused like ENet refuses a peer it is disconnecting later
+        if (packet->referenceCount == 0) enet_packet_destroy(packet);
+        return -1;
+    }
+    if (data->queues.size() < peer->channelCount) data->queues.resize(peer->channelCount);
+    EnetScheduledChannel& queue = data->queues[channel_id];
+    if (!(packet->flags & ENET_PACKET_FLAG_RELIABLE) && channel_id < host->schedule.size() && host->schedule[channel_id].supersede) {
+        // Anything unreliable still waiting is older state the new packet makes pointless
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < queue.packets.size(); i++) {
+            if (queue.packets[i].packet->flags & ENET_PACKET_FLAG_RELIABLE) {
+                if (kept != i) queue.packets[kept] = queue.packets[i];
+                kept++;
+                continue;
+            }
+            data->scheduledBytes -= queue.packets[i].size();
+            data->scheduledPackets--;
+            host->scheduledBytes -= queue.packets[i].size();
+            host->scheduledPackets--;
+            host->superseded++;
+        }
+        queue.packets.erase(queue.packets.begin() + kept, queue.packets.end());
+    }
+    queue.packets.push_back(EnetPacketBuffer(packet));
+    data->scheduledBytes += packet->dataLength;
+    data->scheduledPackets++;
+    host->scheduledBytes += packet->dataLength;
+    host->scheduledPackets++;
+    if (!data->scheduled) {
+        data->scheduled = true;
+        host->scheduled.push_back(data);
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends a packet to a peer, through the scheduler while the host has a send budget
+////////////////////////////////////////////////////////////
+static int send_packet(ENetPeer* peer, enet_uint8 channel_id, ENetPacket* packet)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    if (data != NULL && data->host->sendBudget > 0) {
+        return schedule_packet(peer, data, channel_id, packet);
+    }
+    return transmit_packet(peer, channel_id, packet);
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues a packet for every connected peer of a scheduled host, each counted as it is released
+////////////////////////////////////////////////////////////
+static void schedule_peers(ENetHost* host, EnetHostData* data, enet_uint8 channel_id, ENetPacket* packet, ENetPeer* const* peers, std::size_t count)
+{
+    // Hold a reference across the loop so a refused peer can't free the packet early
+    ++packet->referenceCount;
+    for (std::size_t i = 0; i < count; i++) {
+        ENetPeer* peer = peers != NULL ? peers[i] : &host->peers[i];
+        if (peer->state == ENET_PEER_STATE_CONNECTED) schedule_packet(peer, &data->peers[peer - host->peers], channel_id, packet);
+    }
+    if (--packet->referenceCount == 0) {
+        enet_packet_destroy(packet);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+static void broadcast_packet(ENetHost* host, enet_uint8 channel_id, ENetPacket* packet)
+{
+    EnetHostData* data = get_host_data(host);
+    if (data != NULL && data->sendBudget > 0) {
+        schedule_peers(host, data, channel_id, packet, NULL, host->peerCount);
+        return;
+    }
+    if (data != NULL) {
+        // enet_host_broadcast skips peers that are disconnecting, which connectedPeers still includes
+        std::size_t connected = 0;
+        {
+            EnetHostLock lock(host);
+            for (std::size_t i = 0; i < host->peerCount; i++) {
+                if (host->peers[i].state == ENET_PEER_STATE_CONNECTED) connected++;
+            }
+        }
+        count_sent(data, NULL, channel_id, packet, connected);
+        capture_send(data, NULL, channel_id, packet);
+    }
+    if (data != NULL && data->thread != NULL) {
+        packet = private_packet(packet);
+        if (packet == NULL) return;
+        ++packet->referenceCount;
+        queue_send(data->thread, NULL, channel_id, packet);
+        return;
+    }
+    if (data != NULL) data->broadcastBytes += packet->dataLength;
+    enet_host_broadcast(host, channel_id, packet);
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends one shared packet to each of the given peers of a host
+////////////////////////////////////////////////////////////
+static bool multicast_packet(ENetHost* host, const std::vector<ENetPeer*>& peers, enet_uint8 channel_id, ENetPacket* packet)
+{
+    EnetHostData* data = get_host_data(host);
+    if (data != NULL && data->sendBudget > 0) {
+        schedule_peers(host, data, channel_id, packet, peers.empty() ? NULL : &peers[0], peers.size());
+        return true;
+    }
+    if (data != NULL && data->thread != NULL && !peers.empty()) {
+        for (std::size_t i = 0; i < peers.size(); i++) {
+            count_sent(data, peers[i], channel_id, packet, 1);
+            capture_send(data, peers[i], channel_id, packet);
+        }
+        // Copy once if a script holds the packet, then give every command its own reference up front
+        ENetPacket* shared = private_packet(packet);
+        if (shared == NULL) {
+            if (packet->referenceCount == 0) enet_packet_destroy(packet);
+            return false;
+        }
+        shared->referenceCount += peers.size();
+        for (std::size_t i = 0; i < peers.size(); i++) {
+            queue_send(data->thread, peers[i], channel_id, shared);
+        }
+        return true;
+    }
+
+    // Hold a reference across the loop so a failed send can't free the packet early
+    ++packet->referenceCount;
+    for (std::size_t i = 0; i < peers.size(); i++) {
+        if (enet_peer_send(peers[i], channel_id, packet) == 0 && peers[i]->data != NULL) {
+            static_cast<EnetPeerData*>(peers[i]->data)->queuedBytes += packet->dataLength;
+            count_sent(data, peers[i], channel_id, packet, 1);
+            capture_send(data, peers[i], channel_id, packet);
+        }
+    }
+    if (--packet->referenceCount == 0) {
+        enet_packet_destroy(packet);
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Coalesced packets are a run of messages, each a varint length followed by its bytes
+////////////////////////////////////////////////////////////
+static const std::size_t COALESCE_HEADER_MAX = 5;
+
+
+////////////////////////////////////////////////////////////
+// Returns a new packet holding the bytes as a single coalesced message, or NULL if out of memory
+////////////////////////////////////////////////////////////
+static ENetPacket* frame_message(const enet_uint8* bytes, std::size_t length, enet_uint32 flags)
+{
+    EnetPacketBuffer framed(length + COALESCE_HEADER_MAX, flags);
+    enet_uint8* out;
+    if (framed.packet == NULL || !serial_write_varint(framed, length) || (out = framed.append(length)) == NULL) {
+        return NULL;
+    }
+    std::memcpy(out, bytes, length);
+    return framed.detach();
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a packet for sending, framing it as one message when the host coalesces
+////////////////////////////////////////////////////////////
+static SQInteger read_send_packet(HSQUIRRELVM v, SQInteger idx, const EnetHostData* data, ENetPacket*& packet, enet_uint32 flag)
+{
+    SQInteger result = read_packet(v, idx, data, packet, flag);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    if (data != NULL && data->coalesceLimit > 0) {
+        ENetPacket* framed = frame_message(packet->data, packet->dataLength, packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED));
+        if (packet->referenceCount == 0) enet_packet_destroy(packet);
+        if (framed == NULL) {
+            return sq_throwerror(v, _SC("Failed to create packet"));
+        }
+        packet = framed;
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+static void flush_stage(ENetPeer* peer, EnetPeerData* data, enet_uint8 channel_id)
+{
+    if (channel_id >= data->stages.size() || data->stages[channel_id].packet == NULL) return;
+    send_packet(peer, channel_id, data->stages[channel_id].detach());
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends every staged message of one peer
+////////////////////////////////////////////////////////////
+static void flush_peer_stages(ENetPeer* peer, EnetPeerData* data)
+{
+    for (std::size_t channel = 0; channel < data->stages.size(); channel++) {
+        flush_stage(peer, data, (enet_uint8) channel);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends every staged message of the host's peers
+////////////////////////////////////////////////////////////
+static void flush_staged(EnetHostData* data)
+{
+    for (std::size_t i = 0; i < data->staged.size(); i++) {
+        EnetPeerData* peerData = data->staged[i];
+        if (!peerData->staged) continue;
+        flush_peer_stages(&data->host->peers[peerData - &data->peers[0]], peerData);
+        peerData->staged = false;
+    }
+    data->staged.clear();
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a script message without copying it, serializing tables into the host's scratch buffer
+//
+// The bytes stay valid until the next call for the same host or
+// until the script value goes away. flags is only changed for an
+// enet.Packet, to the flags the packet was created with.
+//
+////////////////////////////////////////////////////////////
+static SQInteger read_message(HSQUIRRELVM v, SQInteger idx, EnetHostData* host, const enet_uint8*& bytes, std::size_t& length, enet_uint32& flags)
+{
+    if (sq_gettype(v, idx) == OT_TABLE || sq_gettype(v, idx) == OT_ARRAY) {
+        if (host->scratch.packet == NULL) host->scratch = EnetPacketBuffer(128);
+        if (host->scratch.packet == NULL) {
+            return sq_throwerror(v, _SC("Failed to create packet"));
+        }
+        host->scratch.packet->dataLength = 0;
+        EnetSerializerState state(host);
+        SQInteger result = serialize_value(v, idx, host->scratch, state, false, 0);
+        if (SQ_FAILED(result)) {
+            return result;
+        }
+        bytes = host->scratch.packet->data;
+        length = host->scratch.packet->dataLength;
+    } else if (sq_gettype(v, idx) == OT_STRING) {
+        const SQChar* string;
+        sq_getstring(v, idx, &string);
+        bytes = (const enet_uint8*) string;
+        length = sq_getsize(v, idx) * sizeof(SQChar);
+    } else {
+        Sqrat::Var<EnetPacketBuffer*> buffer(v, idx);
+        if (Sqrat::Error::Occurred(v)) {
+            return sq_throwerror(v, _SC("Expected a string, table, array or enet.Packet"));
+        }
+        if (buffer.value->packet == NULL) {
+            return sq_throwerror(v, _SC("Packet is empty"));
+        }
+        bytes = buffer.value->packet->data;
+        length = buffer.value->packet->dataLength;
+        flags = buffer.value->packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED);
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns true, marking the peer to be told when it drains, if a send of size more bytes would pass its high-water mark
+////////////////////////////////////////////////////////////
+static bool refuse_send(ENetPeer* peer, EnetPeerData* data, std::size_t size)
+{
+    if (data == NULL || data->highWater == 0) return false;
+    std::size_t outgoing;
+    {
+        EnetHostLock lock(peer->host);
+        outgoing = outgoing_bytes(peer);
+    }
+    if (outgoing + size <= data->highWater) return false;
+    if (!data->blocked) {
+        data->blocked = true;
+        data->host->blocked.push_back(data);
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends a script value to the peer's stage for the channel, sending the stage first if it is full
+////////////////////////////////////////////////////////////
+static SQInteger stage_message(HSQUIRRELVM v, SQInteger idx, ENetPeer* peer, enet_uint8 channel_id, enet_uint32 flag, bool& queued)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    EnetHostData* host = data->host;
+    if (flag != PACKET_FLAG_DEFAULT && flag != ENET_PACKET_FLAG_RELIABLE && flag != ENET_PACKET_FLAG_UNSEQUENCED && flag != 0) {
+        return sq_throwerror(v, _SC("Unknown packet flag"));
+    }
+    const enet_uint8* bytes;
+    std::size_t length;
+    enet_uint32 flags = flag == PACKET_FLAG_DEFAULT ? (enet_uint32) ENET_PACKET_FLAG_RELIABLE : flag;
+    enet_uint32 own = flags;
+    SQInteger result = read_message(v, idx, host, bytes, length, own);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    if (flag != PACKET_FLAG_DEFAULT && flag != own) {
+        return sq_throwerror(v, _SC("Packet was created with different flags"));
+    }
+    flags = own;
+    if (peer->state != ENET_PEER_STATE_CONNECTED || data->disconnectPending || channel_id >= peer->channelCount) {
+        // Refused now, as an unstaged send would be, rather than dropped at the next flush
+        queued = false;
+        return 0;
+    }
+    if (refuse_send(peer, data, length)) {
+        queued = false;
+        return 0;
+    }
+    if (data->stages.empty()) {
+        data->stages.resize(peer->channelCount, EnetPacketBuffer((ENetPacket*) NULL));
+    }
+
+    // A message too big to share a packet goes alone, after whatever was staged before it
+    if (length + COALESCE_HEADER_MAX > host->coalesceLimit) {
+        flush_stage(peer, data, channel_id);
+        ENetPacket* packet = frame_message(bytes, length, flags);
+        if (packet == NULL) {
+            return sq_throwerror(v, _SC("Failed to create packet"));
+        }
+        queued = send_packet(peer, channel_id, packet) >= 0;
+        return 0;
+    }
+    EnetPacketBuffer& stage = data->stages[channel_id];
+    if (stage.packet != NULL && (stage.size() + length + COALESCE_HEADER_MAX > host->coalesceLimit || (stage.packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED)) != flags)) {
+        flush_stage(peer, data, channel_id);
+    }
+    if (stage.packet == NULL) {
+        stage = EnetPacketBuffer(host->coalesceLimit, flags);
+    }
+    enet_uint8* out;
+    if (stage.packet == NULL || !serial_write_varint(stage, length) || (out = stage.append(length)) == NULL) {
+        return sq_throwerror(v, _SC("Failed to create packet"));
+    }
+    std::memcpy(out, bytes, length);
+    if (!data->staged) {
+        data->staged = true;
+        host->staged.push_back(data);
+    }
+    queued = true;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Disconnects a peer that keeps flooding past its limits, queueing the disconnect event ENet won't raise for it
+////////////////////////////////////////////////////////////
+static void flood_disconnect(EnetHostData* data, ENetPeer* peer)
+{
+    static_cast<EnetPeerData*>(peer->data)->flooded = true;
+    {
+        EnetHostLock lock(data->host);
+        enet_peer_disconnect_now(peer, ENET_DISCONNECT_FLOOD);
+    }
+    EnetScriptEvent event;
+    event.type = ENET_EVENT_TYPE_DISCONNECT;
+    event.peer = peer;
+    event.data = ENET_DISCONNECT_FLOOD;
+    data->backlog.push_back(event);
+    data->floodDisconnects++;
+}
+
+
+////////////////////////////////////////////////////////////
+// Checks a received packet against its channel's rate limit, releasing it if it is to be dropped
+////////////////////////////////////////////////////////////
+static bool admit_packet(EnetHostData* data, EnetScriptEvent& event)
+{
+    if (event.peer == NULL || event.peer->data == NULL) return true;
+    EnetPeerData* peer = static_cast<EnetPeerData*>(event.peer->data);
+    if (peer->flooded) {
+        release_event_packet(event);
+        return false;
+    }
+    if (event.channelID >= data->rateLimits.size() || peer->releasePending) return true;
+    const EnetRateLimit& limit = data->rateLimits[event.channelID];
+    if (limit.packetRate <= 0 && limit.byteRate <= 0) return true;
+    if (peer->buckets.size() < data->rateLimits.size()) peer->buckets.resize(data->rateLimits.size());
+    EnetTokenBucket& bucket = peer->buckets[event.channelID];
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (!bucket.started) {
+        bucket.packets = limit.packetBurst;
+        bucket.bytes = limit.byteBurst;
+        bucket.started = true;
+    } else {
+        double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+        bucket.packets = std::min(limit.packetBurst, bucket.packets + elapsed * limit.packetRate);
+        bucket.bytes = std::min(limit.byteBurst, bucket.bytes + elapsed * limit.byteRate);
+    }
+    bucket.refilled = now;
+    if ((limit.packetRate <= 0 || bucket.packets >= 1) && (limit.byteRate <= 0 || bucket.bytes >= event.length)) {
+        if (limit.packetRate > 0) bucket.packets -= 1;
+        if (limit.byteRate > 0) bucket.bytes -= event.length;
+        return true;
+    }
+
+    peer->rateDropped++;
+    data->rateDropped++;
+    if (data->floodLimit > 0) {
+        if (now - peer->floodWindow >= std::chrono::seconds(1)) {
+            peer->floodWindow = now;
+            peer->floodDrops = 0;
+        }
+        if (++peer->floodDrops > data->floodLimit) {
+            release_event_packet(event);
+            flood_disconnect(data, event.peer);
+            return false;
+        }
+    }
+    if (!limit.drop) return true;
+    release_event_packet(event);
+    return false;
+}
+
+
+////////////////////////////////////////////////////////////
+// Messages on a host's snapshot channel, each starting with its kind
+//
+// A keyframe is followed by its sequence and the snapshot. A delta
+// carries its sequence, the snapshot's length, the sequence of the
+// baseline it was made against, then runs of (unchanged bytes to
+// skip, count, count bytes to XOR into the baseline) as varints
+// and raw bytes; bytes past the end of the baseline count as zero.
+// An ack names the newest snapshot rebuilt, or 0 to ask for a
+// keyframe because a delta's baseline was gone.
+//
+////////////////////////////////////////////////////////////
+enum EnetSnapshotKind
+{
+    SNAPSHOT_KEYFRAME = 1,
+    SNAPSHOT_DELTA,
+    SNAPSHOT_ACK
+};
+
+static const std::size_t SNAPSHOT_MIN_GAP = 4; // Unchanged bytes it takes to end a run of changes
+
+
+////////////////////////////////////////////////////////////
+// Writes the XOR of bytes against the baseline as skip/count runs, returning false if out of memory
+////////////////////////////////////////////////////////////
+static bool snapshot_delta(EnetPacketBuffer& out, const enet_uint8* bytes, std::size_t length, const std::vector<enet_uint8>& base)
+{
+    std::size_t position = 0;
+    while (position < length) {
+        std::size_t start = position;
+        while (start < length && start < base.size() && bytes[start] == base[start]) start++;
+        if (start == length) break;
+
+        // Extend the run until enough unchanged bytes follow its last change
+        std::size_t last = start;
+        for (std::size_t i = start + 1; i < length && i - last <= SNAPSHOT_MIN_GAP; i++) {
+            if (i >= base.size() || bytes[i] != base[i]) last = i;
+        }
+        std::size_t count = last + 1 - start;
+        enet_uint8* run;
+        if (!serial_write_varint(out, start - position) || !serial_write_varint(out, count) || (run = out.append(count)) == NULL) {
+            return false;
+        }
+        for (std::size_t i = 0; i < count; i++) {
+            std::size_t at = start + i;
+            run[i] = bytes[at] ^ (at < base.size() ? base[at] : 0);
+        }
+        position = last + 1;
+    }
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends a snapshot to one peer as a delta against its acknowledged baseline, or whole if it has none
+////////////////////////////////////////////////////////////
+static bool send_snapshot(ENetPeer* peer, EnetHostData* host, const std::shared_ptr<const std::vector<enet_uint8> >& snapshot)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    if (data == NULL || peer->state != ENET_PEER_STATE_CONNECTED || (std::size_t) host->snapshotChannel >= peer->channelCount) {
+        return false;
+    }
+    const std::vector<enet_uint8>& bytes = *snapshot;
+    const enet_uint8* raw = bytes.empty() ? NULL : &bytes[0];
+    EnetSnapshot sent;
+    sent.sequence = ++data->snapshotSequence;
+    if (sent.sequence == 0) {
+        // Wrapped; 0 means "no baseline" on the wire, so start over from a keyframe
+        clear_snapshots(data);
+        sent.sequence = ++data->snapshotSequence;
+    }
+    sent.bytes = snapshot;
+
+    EnetPacketBuffer out(bytes.size() / 4 + 16, 0);
+    if (out.packet == NULL) return false;
+    bool delta = false;
+    if (data->snapshotBase.sequence != 0) {
+        enet_uint8* kind = out.append(1);
+        if (kind == NULL) return false;
+        *kind = SNAPSHOT_DELTA;
+        if (!serial_write_varint(out, sent.sequence) || !serial_write_varint(out, bytes.size()) || !serial_write_varint(out, data->snapshotBase.sequence) ||
+            !snapshot_delta(out, raw, bytes.size(), *data->snapshotBase.bytes)) {
+            return false;
+        }
+        // A delta no smaller than the keyframe (kind, sequence of up to 5 bytes, snapshot) isn't worth the receiver's trouble
+        delta = out.size() < bytes.size() + 6;
+        if (!delta) out.packet->dataLength = 0;
+    }
+    if (!delta) {
+        enet_uint8* kind = out.append(1);
+        enet_uint8* copy;
+        if (kind == NULL) return false;
+        *kind = SNAPSHOT_KEYFRAME;
+        if (!serial_write_varint(out, sent.sequence) || (copy = out.append(bytes.size())) == NULL) return false;
+        if (!bytes.empty()) std::memcpy(copy, raw, bytes.size());
+    }
+
+    data->snapshotsSent.push_back(sent);
+    if (data->snapshotsSent.size() > host->snapshotHistory) data->snapshotsSent.pop_front();
+    ++(delta ? host->snapshots.deltas : host->snapshots.keyframes);
+    host->snapshots.rawBytes += bytes.size();
+    host->snapshots.sentBytes += out.size();
+    return send_packet(peer, (enet_uint8) host->snapshotChannel, out.detach()) >= 0;
+}
+
+
+////////////////////////////////////////////////////////////
+static void send_snapshot_ack(ENetPeer* peer, EnetHostData* host, enet_uint32 sequence)
+{
+    EnetPacketBuffer out(8, 0);
+    enet_uint8* kind;
+    if (out.packet == NULL || (kind = out.append(1)) == NULL) return;
+    *kind = SNAPSHOT_ACK;
+    if (!serial_write_varint(out, sequence)) return;
+    send_packet(peer, (enet_uint8) host->snapshotChannel, out.detach());
+}
+
+
+////////////////////////////////////////////////////////////
+// Handles a packet on the snapshot channel, turning snapshots back into whole payloads
+//
+// Returns false when nothing is left for scripts: an ack, a stale
+// or malformed message, or a delta whose baseline is gone. The
+// event's packet is released in that case.
+//
+////////////////////////////////////////////////////////////
+static bool read_snapshot(EnetHostData* host, EnetScriptEvent& event)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(event.peer->data);
+    const enet_uint8* cursor = event.packet->data + event.offset;
+    const enet_uint8* end = cursor + event.length;
+    SQUnsignedInteger sequence = 0;
+    std::vector<enet_uint8>* rebuilt = NULL;
+    std::shared_ptr<std::vector<enet_uint8> > snapshot;
+    enet_uint8 kind = cursor < end ? *cursor++ : 0;
+    if (data == NULL || !serial_read_varint(cursor, end, sequence) || sequence > 0xFFFFFFFF) {
+        kind = 0;
+    }
+
+    if (kind == SNAPSHOT_ACK) {
+        if (sequence == 0) {
+            data->snapshotBase = EnetSnapshot();
+        }
+        bool found = false;
+        while (sequence != 0 && !data->snapshotsSent.empty() && data->snapshotsSent.front().sequence <= sequence) {
+            if (data->snapshotsSent.front().sequence == sequence) {
+                data->snapshotBase = data->snapshotsSent.front();
+                found = true;
+            }
+            data->snapshotsSent.pop_front();
+        }
+        if (sequence != 0 && !found && sequence > data->snapshotBase.sequence && sequence <= data->snapshotSequence) {
+            // The round trip outlasted the history, so the peer keeps getting keyframes
+            host->snapshots.lateAcks++;
+        }
+    } else if (kind == SNAPSHOT_KEYFRAME || (kind == SNAPSHOT_DELTA && (data->snapshotsReceived.empty() || sequence > data->snapshotsReceived.back().sequence))) {
+        // A keyframe is taken whatever its sequence, since the sender may have started over
+        snapshot = std::make_shared<std::vector<enet_uint8> >();
+        rebuilt = snapshot.get();
+        if (kind == SNAPSHOT_KEYFRAME) {
+            rebuilt->assign(cursor, end);
+            data->snapshotsReceived.clear();
+        } else {
+            SQUnsignedInteger length, baseSequence;
+            const EnetSnapshot* base = NULL;
+            if (serial_read_varint(cursor, end, length) && serial_read_varint(cursor, end, baseSequence) && length <= (SQUnsignedInteger) 0x7FFFFFFF) {
+                for (std::size_t i = 0; i < data->snapshotsReceived.size(); i++) {
+                    if (data->snapshotsReceived[i].sequence == baseSequence) base = &data->snapshotsReceived[i];
+                }
+            }
+            if (base == NULL) {
+                host->snapshots.undecodable++;
+                send_snapshot_ack(event.peer, host, 0);
+                rebuilt = NULL;
+            } else {
+                rebuilt->assign(base->bytes->begin(), base->bytes->begin() + std::min(base->bytes->size(), (std::size_t) length));
+                rebuilt->resize((std::size_t) length, 0);
+                std::size_t position = 0;
+                while (rebuilt != NULL && cursor < end) {
+                    SQUnsignedInteger skip, count;
+                    if (!serial_read_varint(cursor, end, skip) || !serial_read_varint(cursor, end, count) || count > (SQUnsignedInteger) (end - cursor) ||
+                        skip > length - position || count > length - position - skip) {
+                        rebuilt = NULL;
+                        break;
+                    }
+                    position += (std::size_t) skip;
+                    for (std::size_t i = 0; i < count; i++) (*rebuilt)[position + i] ^= cursor[i];
+                    position += (std::size_t) count;
+                    cursor += count;
+                }
+
+                // The sender has moved past everything older than this baseline
+                while (rebuilt != NULL && data->snapshotsReceived.front().sequence < baseSequence) {
+                    data->snapshotsReceived.pop_front();
+                }
+            }
+        }
+    }
+
+    enet_uint32 flags = event.packet->flags & (ENET_PACKET_FLAG_RELIABLE | ENET_PACKET_FLAG_UNSEQUENCED);
+    if (event.packet->referenceCount == 0) enet_packet_destroy(event.packet);
+    event.packet = NULL;
+    if (rebuilt == NULL) return false;
+
+    event.packet = enet_packet_create(rebuilt->empty() ? NULL : &(*rebuilt)[0], rebuilt->size(), flags);
+    if (event.packet == NULL) return false;
+    event.offset = 0;
+    event.length = rebuilt->size();
+
+    EnetSnapshot received;
+    received.sequence = (enet_uint32) sequence;
+    received.bytes = snapshot;
+    data->snapshotsReceived.push_back(received);
+    if (data->snapshotsReceived.size() > host->snapshotHistory) {
+        data->snapshotsReceived.pop_front();
+    }
+    send_snapshot_ack(event.peer, host, received.sequence);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues a stream event for scripts, with the stream id as its data
+////////////////////////////////////////////////////////////
+static void queue_stream_event(EnetHostData* host, int type, ENetPeer* peer, enet_uint32 id, std::size_t bytes, std::size_t total, ENetPacket* packet)
+{
+    EnetScriptEvent event;
+    event.type = type;
+    event.peer = peer;
+    event.channelID = (enet_uint8) host->streamChannel;
+    event.data = id;
+    event.packet = packet;
+    event.offset = bytes;
+    event.length = total;
+    host->backlog.push_back(event);
+}
+
+
+////////////////////////////////////////////////////////////
+static void send_stream_control(ENetPeer* peer, EnetHostData* host, EnetStreamKind kind, enet_uint32 id)
+{
+    EnetPacketBuffer out(8, ENET_PACKET_FLAG_RELIABLE);
+    enet_uint8* header;
+    if (out.packet == NULL || (header = out.append(1)) == NULL) return;
+    *header = (enet_uint8) kind;
+    if (!serial_write_varint(out, id)) return;
+    send_packet(peer, (enet_uint8) host->streamChannel, out.detach());
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends the next chunk of a stream, returning the bytes queued or 0 if the stream can't go on
+////////////////////////////////////////////////////////////
+static std::size_t send_stream_chunk(ENetPeer* peer, EnetHostData* host, EnetOutgoingStream* stream)
+{
+    std::size_t chunk = peer->mtu > STREAM_CHUNK_OVERHEAD * 2 ? peer->mtu - STREAM_CHUNK_OVERHEAD : STREAM_CHUNK_OVERHEAD;
+    std::size_t length = std::min(chunk, stream->total - stream->sent);
+    EnetPacketBuffer out(length + 16, ENET_PACKET_FLAG_RELIABLE);
+    enet_uint8* kind;
+    enet_uint8* bytes;
+    if (out.packet == NULL || (kind = out.append(1)) == NULL) return 0;
+    *kind = stream->started ? STREAM_CHUNK : STREAM_BEGIN;
+    if (!serial_write_varint(out, stream->id) || (!stream->started && !serial_write_varint(out, stream->total))) return 0;
+    if ((bytes = out.append(length)) == NULL || !stream->read(bytes, length)) return 0;
+    std::size_t size = out.size();
+    if (send_packet(peer, (enet_uint8) host->streamChannel, out.detach()) < 0) return 0;
+    stream->started = true;
+    host->streams.sentBytes += length;
+    return size;
+}
+
+
+////////////////////////////////////////////////////////////
+// Tops up every streaming peer's outgoing queue to its window, a chunk from each of its streams in turn
+//
+// Chunks are only added while the peer's queued and in-flight
+// bytes, gameplay traffic included, are under the host's stream
+// window, so other packets never wait behind more than a window
+// of stream data.
+//
+////////////////////////////////////////////////////////////
+static void pump_streams(EnetHostData* data)
+{
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < data->streaming.size(); i++) {
+        EnetPeerData* peerData = data->streaming[i];
+        ENetPeer* peer = &data->host->peers[peerData - &data->peers[0]];
+        if (peer->state == ENET_PEER_STATE_CONNECTED && !peerData->streamsOut.empty()) {
+            std::size_t outgoing;
+            {
+                EnetHostLock lock(data->host);
+                outgoing = outgoing_bytes(peer);
+            }
+            while (outgoing < data->streamWindow && !peerData->streamsOut.empty()) {
+                std::shared_ptr<EnetOutgoingStream> stream = peerData->streamsOut.front();
+                peerData->streamsOut.pop_front();
+                std::size_t queued = send_stream_chunk(peer, data, stream.get());
+                if (queued == 0) {
+                    send_stream_control(peer, data, STREAM_ABORT, stream->id);
+                    queue_stream_event(data, ENET_EVENT_TYPE_STREAM_CANCELLED, peer, stream->id, stream->sent, stream->total, NULL);
+                } else if (stream->sent == stream->total) {
+                    data->streams.sent++;
+                    queue_stream_event(data, ENET_EVENT_TYPE_STREAM_SENT, peer, stream->id, stream->sent, stream->total, NULL);
+                } else {
+                    peerData->streamsOut.push_back(stream);
+                }
+                outgoing += queued;
+            }
+        }
+        if (peerData->streamsOut.empty()) {
+            peerData->streaming = false;
+            continue;
+        }
+        data->streaming[kept++] = peerData;
+    }
+    data->streaming.resize(kept);
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues a stream behind the peer's others and returns its id
+////////////////////////////////////////////////////////////
+static enet_uint32 start_stream(EnetPeerData* data, const std::shared_ptr<EnetOutgoingStream>& stream)
+{
+    data->streamsOut.push_back(stream);
+    if (!data->streaming) {
+        data->streaming = true;
+        data->host->streaming.push_back(data);
+    }
+    return stream->id;
+}
+
+
+////////////////////////////////////////////////////////////
+// Takes an incoming stream off its peer, giving back what it reserved from the host's budget
+////////////////////////////////////////////////////////////
+static std::shared_ptr<EnetIncomingStream> drop_incoming_stream(EnetHostData* host, EnetPeerData* data, std::size_t index)
+{
+    std::shared_ptr<EnetIncomingStream> stream = data->streamsIn[index];
+    data->streamsIn.erase(data->streamsIn.begin() + index);
+    host->streamReserved -= stream->total;
+    host->incomingStreams--;
+    return stream;
+}
+
+
+////////////////////////////////////////////////////////////
+// Refuses an incoming stream, telling the sender and raising a failed event
+////////////////////////////////////////////////////////////
+static void refuse_stream(EnetHostData* host, ENetPeer* peer, enet_uint32 id, std::size_t received, std::size_t total)
+{
+    send_stream_control(peer, host, STREAM_REFUSE, id);
+    host->streams.failed++;
+    queue_stream_event(host, ENET_EVENT_TYPE_STREAM_FAILED, peer, id, received, total, NULL);
+}
+
+
+////////////////////////////////////////////////////////////
+// Handles a packet on the stream channel, reassembling streams and queueing their events
+//
+// Nothing on the channel reaches scripts as a receive, and the
+// event's packet is always released.
+//
+////////////////////////////////////////////////////////////
+static void read_stream(EnetHostData* host, const EnetScriptEvent& event)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(event.peer->data);
+    const enet_uint8* cursor = event.packet->data + event.offset;
+    const enet_uint8* end = cursor + event.length;
+    SQUnsignedInteger id = 0;
+    enet_uint8 kind = cursor < end ? *cursor++ : 0;
+    if (data == NULL || !serial_read_varint(cursor, end, id) || id > 0xFFFFFFFF) {
+        kind = 0;
+    }
+
+    std::size_t index = 0;
+    while (data != NULL && index < data->streamsIn.size() && data->streamsIn[index]->id != id) index++;
+    if (kind == STREAM_BEGIN && index == data->streamsIn.size()) {
+        SQUnsignedInteger total;
+        std::shared_ptr<EnetIncomingStream> stream;
+        if (!serial_read_varint(cursor, end, total)) {
+            kind = 0;
+        } else if (total > host->streamMaxSize || data->streamsIn.size() >= STREAM_MAX_INCOMING || total > host->streamBudget || host->streamReserved > host->streamBudget - total) {
+            refuse_stream(host, event.peer, (enet_uint32) id, 0, (std::size_t) total);
+            kind = 0;
+        } else {
+            stream = std::make_shared<EnetIncomingStream>((enet_uint32) id, (std::size_t) total);
+            bool opened;
+            if (host->streamDirectory.empty()) {
+                opened = stream->open();
+            } else {
+                char name[32];
+                std::snprintf(name, sizeof(name), "/%lld-%u", (long long) peer_id(event.peer, data), (unsigned) id);
+                opened = stream->open(host->streamDirectory + name);
+            }
+            if (!opened) {
+                refuse_stream(host, event.peer, (enet_uint32) id, 0, (std::size_t) total);
+                kind = 0;
+            } else {
+                stream->nextProgress = std::max(STREAM_PROGRESS_STEP, stream->total / STREAM_PROGRESS_EVENTS);
+                stream->lastChunk = std::chrono::steady_clock::now();
+                data->streamsIn.push_back(stream);
+                host->streamReserved += stream->total;
+                host->incomingStreams++;
+            }
+        }
+    } else if (kind == STREAM_BEGIN) {
+        // A begin reusing the id of a stream still arriving is malformed
+        kind = 0;
+    }
+
+    if ((kind == STREAM_BEGIN || kind == STREAM_CHUNK) && index < data->streamsIn.size()) {
+        std::shared_ptr<EnetIncomingStream> stream = data->streamsIn[index];
+        stream->lastChunk = std::chrono::steady_clock::now();
+        if (!stream->write(cursor, end - cursor)) {
+            drop_incoming_stream(host, data, index);
+            refuse_stream(host, event.peer, stream->id, stream->received, stream->total);
+        } else if (stream->received == stream->total) {
+            drop_incoming_stream(host, data, index);
+            host->streams.receivedBytes += end - cursor;
+            bool ok;
+            ENetPacket* packet = stream->finish(ok);
+            if (ok) {
+                if (packet == NULL) data->streamFiles[stream->id] = stream->path;
+                host->streams.completed++;
+                queue_stream_event(host, ENET_EVENT_TYPE_STREAM_COMPLETE, event.peer, stream->id, stream->received, stream->total, packet);
+            } else {
+                host->streams.failed++;
+                queue_stream_event(host, ENET_EVENT_TYPE_STREAM_FAILED, event.peer, stream->id, stream->received, stream->total, NULL);
+            }
+        } else {
+            host->streams.receivedBytes += end - cursor;
+            if (stream->received >= stream->nextProgress) {
+                stream->nextProgress = stream->received + std::max(STREAM_PROGRESS_STEP, stream->total / STREAM_PROGRESS_EVENTS);
+                queue_stream_event(host, ENET_EVENT_TYPE_STREAM_PROGRESS, event.peer, stream->id, stream->received, stream->total, NULL);
+            }
+        }
+    } else if (kind == STREAM_ABORT && index < data->streamsIn.size()) {
+        std::shared_ptr<EnetIncomingStream> stream = drop_incoming_stream(host, data, index);
+        host->streams.failed++;
+        queue_stream_event(host, ENET_EVENT_TYPE_STREAM_FAILED, event.peer, stream->id, stream->received, stream->total, NULL);
+    } else if (kind == STREAM_REFUSE) {
+        for (std::size_t i = 0; i < data->streamsOut.size(); i++) {
+            if (data->streamsOut[i]->id != id) continue;
+            queue_stream_event(host, ENET_EVENT_TYPE_STREAM_CANCELLED, event.peer, data->streamsOut[i]->id, data->streamsOut[i]->sent, data->streamsOut[i]->total, NULL);
+            data->streamsOut.erase(data->streamsOut.begin() + i);
+            break;
+        }
+    }
+
+    if (event.packet->referenceCount == 0) enet_packet_destroy(event.packet);
+}
+
+
+////////////////////////////////////////////////////////////
+// Refuses incoming streams that have gone without a chunk for longer than the host's stream timeout
+//
+// Looks at most once a second, so a stream may outlive the
+// timeout by up to that much.
+//
+////////////////////////////////////////////////////////////
+static void expire_streams(EnetHostData* host)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < host->streamCheck) return;
+    host->streamCheck = now + std::chrono::seconds(1);
+    for (std::size_t i = 0; i < host->peers.size(); i++) {
+        EnetPeerData* data = &host->peers[i];
+        for (std::size_t index = 0; index < data->streamsIn.size();) {
+            if (now - data->streamsIn[index]->lastChunk <= host->streamTimeout) {
+                index++;
+                continue;
+            }
+            std::shared_ptr<EnetIncomingStream> stream = drop_incoming_stream(host, data, index);
+            host->streams.timedOut++;
+            refuse_stream(host, &host->host->peers[i], stream->id, stream->received, stream->total);
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Splits a received coalesced packet into one event per message, queueing all but the first
+////////////////////////////////////////////////////////////
+static bool split_coalesced(EnetHostData* data, EnetScriptEvent& event)
+{
+    const enet_uint8* begin = event.packet->data;
+    const enet_uint8* end = begin + event.packet->dataLength;
+    std::vector<EnetScriptEvent> messages;
+    const enet_uint8* cursor = begin;
+    while (cursor < end) {
+        SQUnsignedInteger length;
+        if (!serial_read_varint(cursor, end, length) || length > (SQUnsignedInteger) (end - cursor)) {
+            messages.clear();
+            break;
+        }
+        EnetScriptEvent message = event;
+        message.offset = cursor - begin;
+        message.length = (std::size_t) length;
+        message.shared = true;
+        messages.push_back(message);
+        cursor += length;
+    }
+    if (messages.empty()) {
+        if (event.packet->referenceCount == 0) enet_packet_destroy(event.packet);
+        return false;
+    }
+    event.packet->referenceCount += messages.size();
+    event = messages[0];
+    data->backlog.insert(data->backlog.begin(), messages.begin() + 1, messages.end());
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+// Fetches the next event for scripts, splitting coalesced packets into their messages
+////////////////////////////////////////////////////////////
+static int next_event(ENetHost* host, EnetHostData* data, EnetScriptEvent& event, enet_uint32 timeout, bool service)
+{
+    for (;;) {
+        int out = host_next_event(host, data, event, timeout, service);
+        if (out > 0 && event.replayed) {
+            // The log holds what scripts saw, already split and rebuilt, so it goes out as it is
+            return out;
+        }
+        if (out > 0 && event.type == ENET_EVENT_TYPE_CONNECT && event.peer->data != NULL && static_cast<EnetPeerData*>(event.peer->data)->releasePending) {
+            // ENet handed the slot to a new connection before the last one's release came around
+            release_peer(static_cast<EnetPeerData*>(event.peer->data));
+        }
+        if (out > 0 && data != NULL && event.type == ENET_EVENT_TYPE_RECEIVE && !event.shared && !data->rateLimits.empty() && !admit_packet(data, event)) {
+            // Over the peer's limit; nothing of it reaches the VM
+            service = false;
+            continue;
+        }
+        if (out > 0 && data != NULL && event.type == ENET_EVENT_TYPE_RECEIVE && !event.shared && (int) event.channelID == data->snapshotChannel) {
+            if (read_snapshot(data, event)) {
+                if (data->capture != NULL) capture_event(data, event);
+                return out;
+            }
+
+            // Acks and snapshots that can't be rebuilt stay inside the binding
+            service = false;
+            continue;
+        }
+        if (out > 0 && data != NULL && event.type == ENET_EVENT_TYPE_RECEIVE && !event.shared && (int) event.channelID == data->streamChannel) {
+            // Stream chunks come back out as stream events once read_stream has queued them
+            read_stream(data, event);
+            service = false;
+            continue;
+        }
+        if (out <= 0 || data == NULL || data->coalesceLimit == 0 || event.type != ENET_EVENT_TYPE_RECEIVE || event.shared) {
+            if (out > 0 && data != NULL && data->capture != NULL) capture_event(data, event);
+            return out;
+        }
+        if (split_coalesced(data, event)) {
+            if (data->capture != NULL) capture_event(data, event);
+            return out;
+        }
+
+        // A malformed packet is dropped, then only what is already waiting is considered
+        data->coalesceMalformed++;
+        if (event.peer->data != NULL) static_cast<EnetPeerData*>(event.peer->data)->coalesceMalformed++;
+        service = false;
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Starts connecting to an address, reclaiming the slot ENet picks if its last peer is still pending release
+////////////////////////////////////////////////////////////
+static ENetPeer* connect_peer(ENetHost* host, const ENetAddress& address, std::size_t channelCount, enet_uint32 data)
+{
+    EnetHostLock lock(host);
+    ENetPeer* peer = enet_host_connect(host, &address, channelCount, data);
+    if (peer != NULL && peer->data != NULL && static_cast<EnetPeerData*>(peer->data)->releasePending) {
+        release_peer(static_cast<EnetPeerData*>(peer->data));
+    }
+    return peer;
+}
+
+
+////////////////////////////////////////////////////////////
+static void resolver_main(std::shared_ptr<EnetResolver> resolver)
+{
+    std::unique_lock<std::mutex> guard(resolver->lock);
+    for (;;) {
+        while (!resolver->stopping && resolver->pending.empty()) {
+            resolver->wake.wait(guard);
+        }
+        if (resolver->stopping) return;
+        EnetResolveRequest request = resolver->pending.front();
+        resolver->pending.pop_front();
+
+        // Look up without the lock so connect_async never waits on DNS
+        guard.unlock();
+        request.resolved = resolve_host(request.name, request.address);
+        guard.lock();
+        resolver->done.push_back(request);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Connects a resolved request and queues the event telling scripts how it went
+////////////////////////////////////////////////////////////
+static void finish_connect(EnetHostData* data, const EnetResolveRequest& request)
+{
+    EnetScriptEvent event;
+    event.data = request.id;
+    event.type = ENET_EVENT_TYPE_CONNECT_FAILED;
+    if (request.resolved) {
+        event.peer = connect_peer(data->host, request.address, request.channelCount, request.data);
+        if (event.peer != NULL) event.type = ENET_EVENT_TYPE_CONNECT_READY;
+    }
+    data->backlog.push_back(event);
+}
+
+
+////////////////////////////////////////////////////////////
+static void collect_resolved(EnetHostData* data)
+{
+    if (!data->resolver) return;
+    std::deque<EnetResolveRequest> done;
+    {
+        std::lock_guard<std::mutex> guard(data->resolver->lock);
+        done.swap(data->resolver->done);
+    }
+    for (std::size_t i = 0; i < done.size(); i++) {
+        finish_connect(data, done[i]);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Replayed events are topped up to this many per service so a fast replay doesn't load the whole log at once
+////////////////////////////////////////////////////////////
+static const std::size_t REPLAY_BATCH = 256;
+
+
+////////////////////////////////////////////////////////////
+// Moves the replay's due records into the backlog, ending it with a replay-done event
+////////////////////////////////////////////////////////////
+static void feed_replay(EnetHostData* data)
+{
+    EnetReplay* replay = data->replay;
+    if (replay == NULL) return;
+    unsigned long long due = 0;
+    if (replay->speed > 0) {
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - replay->start;
+        due = (unsigned long long) (elapsed.count() * replay->speed);
+    }
+    while (data->backlog.size() < REPLAY_BATCH) {
+        const enet_uint8* record = replay->bytes + replay->position;
+        std::size_t left = replay->size - replay->position;
+        std::size_t length = left >= CAPTURE_RECORD_HEADER ? (std::size_t) capture_get(record + 16, 4) : 0;
+        if (left < CAPTURE_RECORD_HEADER || left - CAPTURE_RECORD_HEADER < length) {
+            // End of the log, or a record cut short by a capture that was never stopped
+            EnetScriptEvent event;
+            event.type = ENET_EVENT_TYPE_REPLAY_DONE;
+            event.data = (enet_uint32) replay->replayed;
+            data->backlog.push_back(event);
+            delete replay;
+            data->replay = NULL;
+            return;
+        }
+        if (replay->speed > 0 && capture_get(record + 8, 8) > due) return;
+        replay->position += CAPTURE_RECORD_HEADER + length;
+
+        // Only what the host received is replayed; its own sends are in the log for reference
+        std::size_t slot = (std::size_t) capture_get(record + 2, 2);
+        enet_uint8 channel_id = record[1];
+        if (slot >= data->host->peerCount) continue;
+        EnetScriptEvent event;
+        event.peer = &data->host->peers[slot];
+        event.replayed = true;
+        switch (record[0]) {
+        case CAPTURE_CONNECT :
+            event.type = ENET_EVENT_TYPE_CONNECT;
+            event.data = (enet_uint32) capture_get(record + 4, 4);
+            break;
+        case CAPTURE_DISCONNECT :
+            event.type = ENET_EVENT_TYPE_DISCONNECT;
+            event.data = (enet_uint32) capture_get(record + 4, 4);
+            break;
+        case CAPTURE_RECEIVE :
+            if (channel_id >= data->host->channelLimit) continue;
+            event.packet = enet_packet_create(record + CAPTURE_RECORD_HEADER, length, (enet_uint32) capture_get(record + 4, 4));
+            if (event.packet == NULL) continue;
+            event.type = ENET_EVENT_TYPE_RECEIVE;
+            event.channelID = channel_id;
+            event.length = length;
+            break;
+        default :
+            continue;
+        }
+        data->backlog.push_back(event);
+        replay->replayed++;
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Scheduler quantum, the bytes a channel of weight 1 is offered per round
+////////////////////////////////////////////////////////////
+static const long long SCHEDULE_QUANTUM = 1200;
+
+
+////////////////////////////////////////////////////////////
+// Has ENet disconnect the peer once its outgoing queues are empty,
+// handing it whatever is still in the network thread's send ring first
+////////////////////////////////////////////////////////////
+static void disconnect_when_sent(ENetPeer* peer, enet_uint32 data)
+{
+    EnetPeerData* peerData = static_cast<EnetPeerData*>(peer->data);
+    EnetHostLock lock(peer->host);
+    if (peerData != NULL && peerData->host->thread != NULL) drain_sends(peerData->host->thread);
+    enet_peer_disconnect_later(peer, data);
+}
+
+
+////////////////////////////////////////////////////////////
+// Forgets a Peer.disconnect_later still waiting on the scheduler, for when a script disconnects sooner
+////////////////////////////////////////////////////////////
+static void cancel_disconnect_later(ENetPeer* peer)
+{
+    EnetPeerData* data = static_cast<EnetPeerData*>(peer->data);
+    if (data != NULL) data->disconnectPending = false;
+}
+
+
+////////////////////////////////////////////////////////////
+// Releases a peer's waiting packets to ENet until its budget runs out
+//
+// Only the most urgent priority with anything waiting is served,
+// and its channels share the budget by weight in deficit round
+// robin. A packet is released whole once the peer has any budget
+// left, so the budget can go into debt and big packets can't be
+// stuck behind it forever. With the scheduler off everything goes.
+//
+////////////////////////////////////////////////////////////
+static void release_scheduled(EnetHostData* data, ENetPeer* peer, EnetPeerData* peerData, std::chrono::steady_clock::time_point now)
+{
+    EnetTokenBucket& budget = peerData->budget;
+    bool limited = data->sendBudget > 0;
+    if (limited && !budget.started) {
+        budget.bytes = data->sendBurst;
+        budget.started = true;
+    } else if (limited) {
+        double elapsed = std::chrono::duration<double>(now - budget.refilled).count();
+        budget.bytes = std::min(data->sendBurst, budget.bytes + elapsed * data->sendBudget);
+    }
+    budget.refilled = now;
+
+    std::size_t channels = peerData->queues.size();
+    while (peerData->scheduledPackets > 0 && (!limited || budget.bytes > 0)) {
+        int level = 0;
+        bool found = false;
+        for (std::size_t channel = 0; channel < channels; channel++) {
+            if (peerData->queues[channel].packets.empty()) continue;
+            int priority = channel < data->schedule.size() ? data->schedule[channel].priority : 0;
+            if (!found || priority < level) level = priority;
+            found = true;
+        }
+
+        for (std::size_t i = 0; i < channels && (!limited || budget.bytes > 0); i++) {
+            std::size_t channel = peerData->scheduleCursor % channels;
+            EnetScheduledChannel& queue = peerData->queues[channel];
+            const EnetChannelSchedule* schedule = channel < data->schedule.size() ? &data->schedule[channel] : NULL;
+            if (queue.packets.empty() || (schedule != NULL ? schedule->priority : 0) != level) {
+                peerData->scheduleCursor = (channel + 1) % channels;
+                peerData->scheduleResume = false;
+                continue;
+            }
+            if (!peerData->scheduleResume) queue.deficit += SCHEDULE_QUANTUM * (schedule != NULL ? schedule->weight : 1);
+            peerData->scheduleResume = false;
+            while (!queue.packets.empty() && (long long) queue.packets.front().size() <= queue.deficit) {
+                if (limited && budget.bytes <= 0) {
+                    // Out of budget partway through the channel's turn, which carries on next time
+                    peerData->scheduleResume = true;
+                    break;
+                }
+                std::size_t size = queue.packets.front().size();
+                ENetPacket* packet = queue.packets.front().detach();
+                queue.packets.pop_front();
+                queue.deficit -= (long long) size;
+                budget.bytes -= (double) size;
+                peerData->scheduledBytes -= size;
+                peerData->scheduledPackets--;
+                data->scheduledBytes -= size;
+                data->scheduledPackets--;
+                transmit_packet(peer, (enet_uint8) channel, packet);
+            }
+            if (queue.packets.empty()) queue.deficit = 0;
+            if (peerData->scheduleResume) break;
+            peerData->scheduleCursor = (channel + 1) % channels;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Releases what each scheduled peer's budget allows, leaving the rest waiting for the next service or flush
+////////////////////////////////////////////////////////////
+static void run_scheduler(EnetHostData* data)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < data->scheduled.size(); i++) {
+        EnetPeerData* peerData = data->scheduled[i];
+        release_scheduled(data, &data->host->peers[peerData - &data->peers[0]], peerData, now);
+        if (peerData->scheduledPackets == 0) {
+            peerData->scheduled = false;
+            if (peerData->disconnectPending) {
+                peerData->disconnectPending = false;
+                disconnect_when_sent(&data->host->peers[peerData - &data->peers[0]], peerData->disconnectData);
+            }
+            continue;
+        }
+        data->scheduled[kept++] = peerData;
+    }
+    data->scheduled.resize(kept);
+}
+
+
+////////////////////////////////////////////////////////////
+// Pushes staged messages and every queued packet onto the wire
+////////////////////////////////////////////////////////////
+static void flush_host(ENetHost* host, EnetHostData* data)
+{
+    if (data != NULL) flush_staged(data);
+    if (data != NULL && !data->scheduled.empty()) run_scheduler(data);
+    EnetHostLock lock(host);
+    if (data != NULL && data->thread != NULL) drain_sends(data->thread);
+    enet_host_flush(host);
+    settle_queued_bytes(host);
+}
+
+
+////////////////////////////////////////////////////////////
+// Housekeeping done before each call that hands events to scripts
+////////////////////////////////////////////////////////////
+static void begin_service(EnetHostData* data)
+{
+    if (data == NULL) return;
+    if (data->profiler != NULL) profile_drop(data->profiler);
+    release_pending_peers(data);
+    check_writable(data);
+    flush_staged(data);
+    collect_resolved(data);
+    feed_replay(data);
+    if (!data->streaming.empty()) pump_streams(data);
+    if (data->incomingStreams > 0) expire_streams(data);
+    if (!data->scheduled.empty()) run_scheduler(data);
+}
+
+
+////////////////////////////////////////////////////////////
+// Makes room for size more bytes at the end of a packet being built
+////////////////////////////////////////////////////////////
+static SQInteger packet_write(HSQUIRRELVM v, EnetPacketBuffer* packet, std::size_t size, enet_uint8*& data)
+{
+    if (packet->packet == NULL) {
+        return sq_throwerror(v, _SC("Packet is empty"));
+    }
+    if (packet->packet->referenceCount > 1) {
+        return sq_throwerror(v, _SC("Packet is queued for sending and can no longer be modified"));
+    }
+    data = packet->append(size);
+    if (data == NULL) {
+        return sq_throwerror(v, _SC("Failed to grow packet"));
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Advances the read position of a packet, failing if it would run past the end
+////////////////////////////////////////////////////////////
+static SQInteger packet_read(HSQUIRRELVM v, EnetPacketBuffer* packet, std::size_t size, const enet_uint8*& data)
+{
+    if (packet->packet == NULL || size > packet->size() - packet->position) {
+        return sq_throwerror(v, _SC("Read past the end of the packet"));
+    }
+    data = packet->packet->data + packet->position;
+    packet->position += size;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the size of the packet in bytes
+////////////////////////////////////////////////////////////
+static std::size_t enetPacket_len(EnetPacketBuffer* left)
+{
+    return left->size();
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the current read position
+////////////////////////////////////////////////////////////
+static std::size_t enetPacket_tell(EnetPacketBuffer* left)
+{
+    return left->position;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the number of bytes left to read
+////////////////////////////////////////////////////////////
+static std::size_t enetPacket_remaining(EnetPacketBuffer* left)
+{
+    return left->size() - left->position;
+}
+
+
+////////////////////////////////////////////////////////////
+// Moves the read position
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_seek(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<std::size_t> position(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            if (position.value > left.value->size()) return sq_throwerror(v, _SC("Seek past the end of the packet"));
+            left.value->position = position.value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads an unsigned 8-bit integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_u8(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            const enet_uint8* data;
+            SQInteger result = packet_read(v, left.value, 1, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            sq_pushinteger(v, data[0]);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a little-endian unsigned 16-bit integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_u16(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            const enet_uint8* data;
+            SQInteger result = packet_read(v, left.value, 2, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            sq_pushinteger(v, data[0] | (data[1] << 8));
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a little-endian unsigned 32-bit integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_u32(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            const enet_uint8* data;
+            SQInteger result = packet_read(v, left.value, 4, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            sq_pushinteger(v, (SQInteger) (data[0] | (data[1] << 8) | (data[2] << 16) | ((enet_uint32) data[3] << 24)));
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a little-endian 32-bit float
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_f32(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            const enet_uint8* data;
+            SQInteger result = packet_read(v, left.value, 4, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            enet_uint32 bits = data[0] | (data[1] << 8) | (data[2] << 16) | ((enet_uint32) data[3] << 24);
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            sq_pushfloat(v, value);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads an unsigned LEB128 variable-length integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_varint(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQUnsignedInteger value = 0;
+            unsigned int shift = 0;
+            const enet_uint8* data;
+            do {
+                if (shift >= sizeof(SQUnsignedInteger) * 8) return sq_throwerror(v, _SC("Malformed varint"));
+                SQInteger result = packet_read(v, left.value, 1, data);
+                if (SQ_FAILED(result)) {
+                    return result;
+                }
+                value |= (SQUnsignedInteger) (data[0] & 0x7F) << shift;
+                shift += 7;
+            } while (data[0] & 0x80);
+            sq_pushinteger(v, (SQInteger) value);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads the given number of bytes into a string, or the rest of the packet when omitted
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_string(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            const enet_uint8* data;
+            std::size_t size = left.value->size() - left.value->position;
+            SQInteger result = packet_read(v, left.value, size, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            sq_pushstring(v, (const SQChar*) data, size);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<std::size_t> size(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            const enet_uint8* data;
+            SQInteger result = packet_read(v, left.value, size.value, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            sq_pushstring(v, (const SQChar*) data, size.value);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends an unsigned 8-bit integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_u8(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<enet_uint32> value(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            enet_uint8* data;
+            SQInteger result = packet_write(v, left.value, 1, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            data[0] = (enet_uint8) value.value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends a little-endian unsigned 16-bit integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_u16(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<enet_uint32> value(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            enet_uint8* data;
+            SQInteger result = packet_write(v, left.value, 2, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            data[0] = (enet_uint8) value.value;
+            data[1] = (enet_uint8) (value.value >> 8);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends a little-endian unsigned 32-bit integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_u32(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<enet_uint32> value(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            enet_uint8* data;
+            SQInteger result = packet_write(v, left.value, 4, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            data[0] = (enet_uint8) value.value;
+            data[1] = (enet_uint8) (value.value >> 8);
+            data[2] = (enet_uint8) (value.value >> 16);
+            data[3] = (enet_uint8) (value.value >> 24);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends a little-endian 32-bit float
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_f32(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<float> value(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            enet_uint8* data;
+            SQInteger result = packet_write(v, left.value, 4, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            enet_uint32 bits;
+            std::memcpy(&bits, &value.value, sizeof(bits));
+            data[0] = (enet_uint8) bits;
+            data[1] = (enet_uint8) (bits >> 8);
+            data[2] = (enet_uint8) (bits >> 16);
+            data[3] = (enet_uint8) (bits >> 24);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends an unsigned LEB128 variable-length integer
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_varint(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        Sqrat::Var<SQInteger> value(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            enet_uint8 bytes[(sizeof(SQUnsignedInteger) * 8 + 6) / 7];
+            std::size_t size = 0;
+            SQUnsignedInteger remaining = (SQUnsignedInteger) value.value;
+            do {
+                bytes[size] = (enet_uint8) (remaining & 0x7F);
+                remaining >>= 7;
+                if (remaining != 0) bytes[size] |= 0x80;
+                size++;
+            } while (remaining != 0);
+            enet_uint8* data;
+            SQInteger result = packet_write(v, left.value, size, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            std::memcpy(data, bytes, size);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends the raw bytes of a string (no length prefix)
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_string(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            if (sq_gettype(v, 2) != OT_STRING) return sq_throwerror(v, _SC("Expected a string"));
+            const SQChar* value;
+            sq_getstring(v, 2, &value);
+            std::size_t size = sq_getsize(v, 2) * sizeof(SQChar);
+            enet_uint8* data;
+            SQInteger result = packet_write(v, left.value, size, data);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            std::memcpy(data, value, size);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Appends a table, array or scalar in the native serializer format, using the host's preset keys if given
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_write_value(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2 || sq_gettop(v) == 3) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        const EnetHostData* data = NULL;
+        if (sq_gettop(v) == 3) {
+            Sqrat::Var<ENetHost*> host(v, 3);
+            if (!Sqrat::Error::Occurred(v)) data = get_host_data(host.value);
+        }
+        if (!Sqrat::Error::Occurred(v)) {
+            enet_uint8* unused;
+            SQInteger result = packet_write(v, left.value, 0, unused);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            std::size_t length = left.value->size();
+            EnetSerializerState state(data);
+            result = serialize_value(v, 2, *left.value, state, false, 0);
+            if (SQ_FAILED(result)) {
+                left.value->packet->dataLength = length;
+                return result;
+            }
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Reads a value written in the native serializer format, using the host's preset keys if given
+////////////////////////////////////////////////////////////
+static SQInteger enetPacket_read_value(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1 || sq_gettop(v) == 2) {
+        Sqrat::Var<EnetPacketBuffer*> left(v, 1);
+        const EnetHostData* data = NULL;
+        if (sq_gettop(v) == 2) {
+            Sqrat::Var<ENetHost*> host(v, 2);
+            if (!Sqrat::Error::Occurred(v)) data = get_host_data(host.value);
+        }
+        if (!Sqrat::Error::Occurred(v)) {
+            if (left.value->packet == NULL) return sq_throwerror(v, _SC("Read past the end of the packet"));
+            EnetSerializerState state(data);
+            const enet_uint8* begin = left.value->packet->data + left.value->position;
+            const enet_uint8* end = left.value->packet->data + left.value->size();
+            if (!deserialize_value(v, begin, end, state, false, 0)) {
+                return sq_throwerror(v, _SC("Malformed serialized value"));
+            }
+            left.value->position = begin - left.value->packet->data;
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Constructor
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_constructor(HSQUIRRELVM v)
+{
+    return sq_throwerror(v, _SC("constructor is protected"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Requests a disconnection from a peer
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_disconnect(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostLock lock(left.value->host);
+            cancel_disconnect_later(left.value);
+            enet_peer_disconnect(left.value, 0);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<enet_uint32> data(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostLock lock(left.value->host);
+            cancel_disconnect_later(left.value);
+            enet_peer_disconnect(left.value, data.value);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Requests a disconnection from a peer, but only after all queued outgoing packets are sent
+//
+// Coalesced messages still staged for the peer are sent first.
+// Packets the scheduler is still holding for the peer count as
+// queued: ENet is only asked once they have all been released,
+// and anything sent to the peer in the meantime is refused.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_disconnect_later(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 1 && top != 2) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetPeer*> left(v, 1);
+    enet_uint32 value = 0;
+    if (top == 2) {
+        Sqrat::Var<enet_uint32> data(v, 2);
+        value = data.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetPeerData* peerData = static_cast<EnetPeerData*>(left.value->data);
+    if (peerData != NULL && left.value->state == ENET_PEER_STATE_CONNECTED) {
+        // ENet refuses sends once it is disconnecting, so the stages can't wait for the next flush
+        flush_peer_stages(left.value, peerData);
+    }
+    if (peerData != NULL && peerData->scheduledPackets > 0 && left.value->state == ENET_PEER_STATE_CONNECTED) {
+        peerData->disconnectPending = true;
+        peerData->disconnectData = value;
+        return 0;
+    }
+    disconnect_when_sent(left.value, value);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Force an immediate disconnection from a peer
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_disconnect_now(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostLock lock(left.value->host);
+            cancel_disconnect_later(left.value);
+            enet_peer_disconnect_now(left.value, 0);
+            defer_release_peer(left.value);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<enet_uint32> data(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostLock lock(left.value->host);
+            cancel_disconnect_later(left.value);
+            enet_peer_disconnect_now(left.value, data.value);
+            defer_release_peer(left.value);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the index of the peer
+////////////////////////////////////////////////////////////
+static std::size_t enetPeer_index(ENetPeer* left)
+{
+    return (left - left->host->peers) + 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns an ID for the current connection in this slot that no later connection will reuse
+//
+// Without _SQ64 the ID only has room for 32768 connections per
+// slot before it comes around again.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_id(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Peer does not belong to a host made by host_create"));
+            sq_pushinteger(v, peer_id(left.value, data));
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues a packet to be sent
+//
+// Parameters
+//  data    : String, table, array or enet.Packet to send
+//  channel : Channel to send on (default 0)
+//  flag    : Packet flag (default reliable)
+//
+// Returns false without queueing anything when the peer is over the
+// high-water mark set with set_send_limit, or the send fails.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_send(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    enet_uint8 channel_id = 0;
+    enet_uint32 flag = PACKET_FLAG_DEFAULT;
+    if (top < 2 || top > 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetPeer*> left(v, 1);
+    if (top >= 3) {
+        Sqrat::Var<enet_uint8> channel(v, 3);
+        channel_id = channel.value;
+    }
+    if (top == 4) {
+        Sqrat::Var<enet_uint32> flags(v, 4);
+        flag = flags.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+    if (data != NULL && data->host->coalesceLimit > 0) {
+        // The message's size is only known once it is read, so stage_message checks the mark
+        bool queued;
+        SQInteger result = stage_message(v, 2, left.value, channel_id, flag, queued);
+        if (SQ_FAILED(result)) {
+            return result;
+        }
+        sq_pushbool(v, queued ? SQTrue : SQFalse);
+        return 1;
+    }
+    ENetPacket* packet;
+    SQInteger result = read_packet(v, 2, get_host_data(left.value->host), packet, flag);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    if (refuse_send(left.value, data, packet->dataLength)) {
+        if (packet->referenceCount == 0) enet_packet_destroy(packet);
+        sq_pushbool(v, SQFalse);
+        return 1;
+    }
+    sq_pushbool(v, send_packet(left.value, channel_id, packet) < 0 ? SQFalse : SQTrue);
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Copies a script snapshot so it can be kept as a baseline
+////////////////////////////////////////////////////////////
+static SQInteger read_snapshot_value(HSQUIRRELVM v, SQInteger idx, EnetHostData* host, std::shared_ptr<const std::vector<enet_uint8> >& snapshot)
+{
+    if (host->snapshotChannel < 0) return sq_throwerror(v, _SC("Host has no snapshot channel"));
+    const enet_uint8* bytes;
+    std::size_t length;
+    enet_uint32 flags = 0;
+    SQInteger result = read_message(v, idx, host, bytes, length, flags);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    snapshot = std::make_shared<std::vector<enet_uint8> >(bytes, bytes + length);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends the current state to the peer on its host's snapshot channel as a delta against what the peer last acknowledged
+//
+// Parameters
+//  data : String, table, array or enet.Packet holding the whole state
+//
+// Returns false if the peer isn't connected or the snapshot
+// couldn't be queued. The peer receives the whole state, rebuilt
+// by its binding, as an ordinary receive on the same channel.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_send_snapshot(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            std::shared_ptr<const std::vector<enet_uint8> > snapshot;
+            SQInteger result = read_snapshot_value(v, 2, data->host, snapshot);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            sq_pushbool(v, send_snapshot(left.value, data->host, snapshot) ? SQTrue : SQFalse);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Streams a large payload to the peer in paced chunks on its host's stream channel
+//
+// Parameters
+//  data : String, table, array or enet.Packet to send
+//
+// Returns the stream's id, or null if the peer isn't connected.
+// An enet.Packet is read as it goes rather than copied, so leave
+// it alone until ENET_EVENT_TYPE_STREAM_SENT names the stream.
+// The peer's binding reassembles the stream and raises stream
+// events for it instead of a receive.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_send_stream(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (data->host->streamChannel < 0) return sq_throwerror(v, _SC("Host has no stream channel"));
+            if (left.value->state != ENET_PEER_STATE_CONNECTED) {
+                sq_pushnull(v);
+                return 1;
+            }
+            ENetPacket* packet;
+            SQInteger result = read_packet(v, 2, data->host, packet, PACKET_FLAG_DEFAULT);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            std::shared_ptr<EnetOutgoingStream> stream = std::make_shared<EnetOutgoingStream>(++data->nextStreamId);
+            stream->open(packet);
+            sq_pushinteger(v, (SQInteger) start_stream(data, stream));
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Streams a file to the peer in paced chunks on its host's stream channel
+//
+// Parameters
+//  path : File to send, mapped rather than read where the platform allows
+//
+// Returns the stream's id, or null if the peer isn't connected.
+// The file must not shrink until the stream has been sent.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_send_file(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<const std::string&> path(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (data->host->streamChannel < 0) return sq_throwerror(v, _SC("Host has no stream channel"));
+            if (left.value->state != ENET_PEER_STATE_CONNECTED) {
+                sq_pushnull(v);
+                return 1;
+            }
+            std::shared_ptr<EnetOutgoingStream> stream = std::make_shared<EnetOutgoingStream>(data->nextStreamId + 1);
+            if (!stream->open(path.value)) {
+                return sq_throwerror(v, _SC("Failed to open file"));
+            }
+            ++data->nextStreamId;
+            sq_pushinteger(v, (SQInteger) start_stream(data, stream));
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Stops sending a stream, telling the peer to discard what it has of it
+//
+// Returns false if the stream had already been sent or isn't
+// known. No event is raised for a stream cancelled this way.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_cancel_stream(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<SQInteger> id(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            for (std::size_t i = 0; i < data->streamsOut.size(); i++) {
+                if ((SQInteger) data->streamsOut[i]->id != id.value) continue;
+                if (data->streamsOut[i]->started) send_stream_control(left.value, data->host, STREAM_ABORT, data->streamsOut[i]->id);
+                data->streamsOut.erase(data->streamsOut.begin() + i);
+                sq_pushbool(v, SQTrue);
+                return 1;
+            }
+            sq_pushbool(v, SQFalse);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Limits how many outgoing bytes send will let pile up for the peer
+//
+// Parameters
+//  high : Bytes queued or in flight above which send refuses packets, 0 to remove the limit
+//  low  : Bytes below which a refused peer raises ENET_EVENT_TYPE_WRITABLE (default high / 2)
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_set_send_limit(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top == 2 || top == 3) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<std::size_t> high(v, 2);
+        std::size_t low = high.value / 2;
+        if (top == 3) {
+            Sqrat::Var<std::size_t> lowWater(v, 3);
+            low = lowWater.value;
+        }
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Peer does not belong to a host made by host_create"));
+            if (high.value > 0 && low >= high.value) return sq_throwerror(v, _SC("Low-water mark must be below the high-water mark"));
+            data->highWater = high.value;
+            data->lowWater = low;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the bytes queued for the peer that ENet has not sent yet
+////////////////////////////////////////////////////////////
+static std::size_t enetPeer_queued_bytes(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return queued_bytes(left);
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the reliable bytes sent to the peer and not yet acknowledged
+////////////////////////////////////////////////////////////
+static enet_uint32 enetPeer_reliable_data_in_transit(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return left->reliableDataInTransit;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the most reliable bytes ENet will have in flight to the peer
+////////////////////////////////////////////////////////////
+static enet_uint32 enetPeer_window_size(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return left->windowSize;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends a ping request to a peer
+////////////////////////////////////////////////////////////
+static void enetPeer_ping(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    enet_peer_ping(left);
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets how often, in milliseconds, a peer is pinged while nothing else is sent to it
+////////////////////////////////////////////////////////////
+static void enetPeer_ping_interval(ENetPeer* left, enet_uint32 pingInterval)
+{
+    EnetHostLock lock(left->host);
+    enet_peer_ping_interval(left, pingInterval);
+}
+
+
+////////////////////////////////////////////////////////////
+// Forcefully disconnects a peer without notifying it
+////////////////////////////////////////////////////////////
+static void enetPeer_reset(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    enet_peer_reset(left);
+    defer_release_peer(left);
+}
+
+
+////////////////////////////////////////////////////////////
+// Configures how quickly unreliable packets to a peer are throttled as its round trip time changes
+////////////////////////////////////////////////////////////
+static void enetPeer_throttle_configure(ENetPeer* left, enet_uint32 interval, enet_uint32 acceleration, enet_uint32 deceleration)
+{
+    EnetHostLock lock(left->host);
+    enet_peer_throttle_configure(left, interval, acceleration, deceleration);
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets the limits, in milliseconds, after which an unresponsive peer is disconnected
+////////////////////////////////////////////////////////////
+static void enetPeer_timeout(ENetPeer* left, enet_uint32 timeoutLimit, enet_uint32 timeoutMinimum, enet_uint32 timeoutMaximum)
+{
+    EnetHostLock lock(left->host);
+    enet_peer_timeout(left, timeoutLimit, timeoutMinimum, timeoutMaximum);
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the value attached to the peer with set_userdata, or null
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_userdata(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Peer does not belong to a host made by host_create"));
+            sq_pushobject(v, data->userdata);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Attaches a value to the peer that is released when it disconnects or is reset
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_set_userdata(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Peer does not belong to a host made by host_create"));
+            HSQOBJECT value;
+            sq_getstackobj(v, 2, &value);
+            sq_addref(v, &value);
+            sq_release(v, &data->userdata);
+            data->userdata = value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Places the peer in its host's interest grid for Host.broadcast_near
+//
+// Parameters
+//  x, y   : Position of the peer
+//  radius : How far around the position the peer wants events from (default 0)
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_set_position(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top == 3 || top == 4) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<SQFloat> x(v, 2);
+        Sqrat::Var<SQFloat> y(v, 3);
+        SQFloat radius = 0;
+        if (top == 4) {
+            Sqrat::Var<SQFloat> r(v, 4);
+            radius = r.value;
+        }
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Peer does not belong to a host made by host_create"));
+            if (radius < 0) return sq_throwerror(v, _SC("Radius must not be negative"));
+            if (left.value->state != ENET_PEER_STATE_CONNECTED) return sq_throwerror(v, _SC("Peer is not connected"));
+            interest_remove(data);
+            data->x = x.value;
+            data->y = y.value;
+            data->radius = radius;
+            interest_insert(data);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Removes the peer from its host's interest grid
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_clear_position(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data != NULL) interest_remove(data);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+static void push_stat(HSQUIRRELVM v, const SQChar* key, SQInteger value)
+{
+    sq_pushstring(v, key, -1);
+    sq_pushinteger(v, value);
+    sq_newslot(v, -3, false);
+}
+
+
+////////////////////////////////////////////////////////////
+static void push_traffic(HSQUIRRELVM v, const EnetTrafficStats& traffic)
+{
+    push_stat(v, _SC("sent_bytes"), (SQInteger) traffic.sentBytes);
+    push_stat(v, _SC("sent_packets"), (SQInteger) traffic.sentPackets);
+    push_stat(v, _SC("received_bytes"), (SQInteger) traffic.receivedBytes);
+    push_stat(v, _SC("received_packets"), (SQInteger) traffic.receivedPackets);
+}
+
+
+////////////////////////////////////////////////////////////
+// Pushes a histogram as {count, sum_us, buckets}, where buckets[i] counts samples below 2^i us
+////////////////////////////////////////////////////////////
+static void push_histogram(HSQUIRRELVM v, const SQChar* key, const EnetHistogram& histogram)
+{
+    sq_pushstring(v, key, -1);
+    sq_newtable(v);
+    push_stat(v, _SC("count"), (SQInteger) histogram.count);
+    push_stat(v, _SC("sum_us"), (SQInteger) histogram.sum);
+    sq_pushstring(v, _SC("buckets"), -1);
+    sq_newarray(v, 0);
+    for (std::size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        sq_pushinteger(v, (SQInteger) histogram.buckets[i]);
+        sq_arrayappend(v, -2);
+    }
+    sq_newslot(v, -3, false);
+    sq_newslot(v, -3, false);
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns a table of the peer's traffic through the binding and ENet's link estimates
+////////////////////////////////////////////////////////////
+static SQInteger enetPeer_stats(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetPeer*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetPeerData* data = static_cast<EnetPeerData*>(left.value->data);
+            if (data == NULL) return sq_throwerror(v, _SC("Peer does not belong to a host made by host_create"));
+            EnetHostLock lock(left.value->host);
+            sq_newtable(v);
+            push_traffic(v, data->traffic);
+            push_stat(v, _SC("round_trip_time"), left.value->roundTripTime);
+            push_stat(v, _SC("round_trip_time_variance"), left.value->roundTripTimeVariance);
+            push_stat(v, _SC("packet_throttle"), left.value->packetThrottle);
+            push_stat(v, _SC("mtu"), left.value->mtu);
+            push_stat(v, _SC("rate_dropped"), (SQInteger) data->rateDropped);
+            push_stat(v, _SC("coalesce_malformed"), (SQInteger) data->coalesceMalformed);
+            push_stat(v, _SC("scheduled_bytes"), (SQInteger) data->scheduledBytes);
+            sq_pushstring(v, _SC("packet_loss"), -1);
+            sq_pushfloat(v, left.value->packetLoss * (SQFloat) 100 / ENET_PEER_PACKET_LOSS_SCALE);
+            sq_newslot(v, -3, false);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the downstream bandwidth of the client in bytes/second
+////////////////////////////////////////////////////////////
+static enet_uint32 enetPeer_incoming_bandwidth(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return left->incomingBandwidth;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the upstream bandwidth of the client in bytes/second
+////////////////////////////////////////////////////////////
+static enet_uint32 enetPeer_outgoing_bandwidth(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return left->outgoingBandwidth;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the mean packet loss of reliable packets as a percentage
+////////////////////////////////////////////////////////////
+static SQFloat enetPeer_packet_loss(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return left->packetLoss * (SQFloat) 100 / ENET_PEER_PACKET_LOSS_SCALE;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the current round trip time (i.e. ping)
+////////////////////////////////////////////////////////////
+static enet_uint32 enetPeer_round_trip_time(ENetPeer* left)
+{
+    EnetHostLock lock(left->host);
+    return left->roundTripTime;
+}
+
+
+////////////////////////////////////////////////////////////
+// Constructor
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_constructor(HSQUIRRELVM v)
+{
+    return sq_throwerror(v, _SC("constructor is protected"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues a packet to be sent to all peers associated with the host
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_broadcast(HSQUIRRELVM v)
+{
+    ENetPacket* packet;
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQInteger result = read_send_packet(v, 2, get_host_data(left.value), packet, PACKET_FLAG_DEFAULT);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            broadcast_packet(left.value, 0, packet);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 3) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<enet_uint8> channel_id(v, 3);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQInteger result = read_send_packet(v, 2, get_host_data(left.value), packet, PACKET_FLAG_DEFAULT);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            broadcast_packet(left.value, channel_id.value, packet);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 4) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<enet_uint8> channel_id(v, 3);
+        Sqrat::Var<enet_uint32> flag(v, 4);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQInteger result = read_send_packet(v, 2, get_host_data(left.value), packet, flag.value);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            broadcast_packet(left.value, channel_id.value, packet);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Checks for any queued events on the host and dispatches one if available
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_check_events(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            EnetScriptEvent event;
+            begin_service(data);
+            int out = next_event(left.value, data, event, 0, false);
+            if (out == 0) {
+                sq_pushnull(v);
+                return 1;
+            }
+            if (out < 0) return sq_throwerror(v, _SC("Error checking network event"));
+            profile_event(data, event);
+            push_event(v, data, event);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Initiates a connection to a foreign host
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_connect(HSQUIRRELVM v)
+{
+    ENetAddress address;
+    ENetPeer* peer;
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<const std::string&> addr_str(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQInteger result = parse_address(v, addr_str.value, address);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            peer = connect_peer(left.value, address, 1, 0);
+            if (peer == NULL) {
+                return sq_throwerror(v, _SC("Failed to create peer"));
+            }
+            push_peer(v, peer);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 3) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<const std::string&> addr_str(v, 2);
+        Sqrat::Var<size_t> channelCount(v, 3);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQInteger result = parse_address(v, addr_str.value, address);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            peer = connect_peer(left.value, address, channelCount.value, 0);
+            if (peer == NULL) {
+                return sq_throwerror(v, _SC("Failed to create peer"));
+            }
+            push_peer(v, peer);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    } else if (sq_gettop(v) == 4) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<const std::string&> addr_str(v, 2);
+        Sqrat::Var<size_t> channelCount(v, 3);
+        Sqrat::Var<enet_uint32> data(v, 4);
+        if (!Sqrat::Error::Occurred(v)) {
+            SQInteger result = parse_address(v, addr_str.value, address);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            peer = connect_peer(left.value, address, channelCount.value, data.value);
+            if (peer == NULL) {
+                return sq_throwerror(v, _SC("Failed to create peer"));
+            }
+            push_peer(v, peer);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Connects to a foreign host without blocking on name resolution
+//
+// Parameters
+//  address       : "host:port" to connect to
+//  channel_count : Number of channels to allocate (default 1)
+//  data          : Integer handed to the foreign host with the connection (default 0)
+//
+// Returns a request ID. An ENET_EVENT_TYPE_CONNECT_READY event with
+// the new peer follows once the name is resolved, or an
+// ENET_EVENT_TYPE_CONNECT_FAILED event if it can't be or no peer is
+// free; either carries the request ID as its data. Names resolved
+// within the cache TTL (see enet.resolve_ttl) connect on the next
+// service without touching the resolver thread.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_connect_async(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    std::size_t channel_count = 1;
+    enet_uint32 connect_data = 0;
+    if (top < 2 || top > 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<const std::string&> addr_str(v, 2);
+    if (top >= 3) {
+        Sqrat::Var<std::size_t> channelCount(v, 3);
+        channel_count = channelCount.value;
+    }
+    if (top == 4) {
+        Sqrat::Var<enet_uint32> data(v, 4);
+        connect_data = data.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    EnetResolveRequest request;
+    const SQChar* error = split_address(addr_str.value, request.name, request.address);
+    if (error != NULL) return sq_throwerror(v, error);
+    if (request.name == "*") return sq_throwerror(v, _SC("Cannot connect to any address"));
+    request.id = ++data->nextResolveId;
+    request.channelCount = channel_count;
+    request.data = connect_data;
+    request.resolved = cached_address(request.name, request.address);
+    if (request.resolved) {
+        finish_connect(data, request);
+    } else {
+        if (!data->resolver) {
+            data->resolver = std::make_shared<EnetResolver>();
+            std::thread(resolver_main, data->resolver).detach();
+        }
+        std::lock_guard<std::mutex> guard(data->resolver->lock);
+        data->resolver->pending.push_back(request);
+        data->resolver->wake.notify_one();
+    }
+    sq_pushinteger(v, (SQInteger) request.id);
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues one shared packet to be sent to every peer in an array
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_send_to(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    enet_uint8 channel_id = 0;
+    enet_uint32 flag = PACKET_FLAG_DEFAULT;
+    if (top < 3 || top > 5) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (top >= 4) {
+        Sqrat::Var<enet_uint8> channel(v, 4);
+        channel_id = channel.value;
+    }
+    if (top == 5) {
+        Sqrat::Var<enet_uint32> flags(v, 5);
+        flag = flags.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    if (sq_gettype(v, 2) != OT_ARRAY) {
+        return sq_throwerror(v, _SC("Expected an array of peers"));
+    }
+    ENetPacket* packet;
+    SQInteger result = read_send_packet(v, 3, get_host_data(left.value), packet, flag);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+
+    // Hold a reference across the loop so a failed send can't free the packet early
+    ++packet->referenceCount;
+    std::vector<ENetPeer*> peers;
+    SQInteger count = sq_getsize(v, 2);
+    peers.reserve(count);
+    for (SQInteger i = 0; i < count; i++) {
+        sq_pushinteger(v, i);
+        sq_get(v, 2);
+        Sqrat::Var<ENetPeer*> peer(v, -1);
+        sq_pop(v, 1);
+        if (Sqrat::Error::Occurred(v)) {
+            if (--packet->referenceCount == 0) enet_packet_destroy(packet);
+            return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+        }
+        if (peer.value->host != left.value) {
+            if (--packet->referenceCount == 0) enet_packet_destroy(packet);
+            return sq_throwerror(v, _SC("Peer belongs to a different host"));
+        }
+        peers.push_back(peer.value);
+    }
+    --packet->referenceCount;
+    if (!multicast_packet(left.value, peers, channel_id, packet)) {
+        return sq_throwerror(v, _SC("Failed to create packet"));
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Queues one shared packet for every connected peer whose interest circle overlaps the given one
+//
+// Parameters
+//  x, y    : Centre of the event
+//  radius  : Radius of the event; peers match when within radius plus their own interest radius
+//  data    : String, table, array or enet.Packet to send
+//  channel : Channel to send on (default 0)
+//  flag    : Packet flag (default reliable)
+//
+// Returns the number of peers the packet was queued for.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_broadcast_near(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    enet_uint8 channel_id = 0;
+    enet_uint32 flag = PACKET_FLAG_DEFAULT;
+    if (top < 5 || top > 7) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQFloat> x(v, 2);
+    Sqrat::Var<SQFloat> y(v, 3);
+    Sqrat::Var<SQFloat> radius(v, 4);
+    if (top >= 6) {
+        Sqrat::Var<enet_uint8> channel(v, 6);
+        channel_id = channel.value;
+    }
+    if (top == 7) {
+        Sqrat::Var<enet_uint32> flags(v, 7);
+        flag = flags.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (radius.value < 0) return sq_throwerror(v, _SC("Radius must not be negative"));
+    ENetPacket* packet;
+    SQInteger result = read_send_packet(v, 5, data, packet, flag);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    std::vector<ENetPeer*> peers;
+    interest_query(data, x.value, y.value, radius.value, peers);
+    if (!multicast_packet(left.value, peers, channel_id, packet)) {
+        return sq_throwerror(v, _SC("Failed to create packet"));
+    }
+    sq_pushinteger(v, (SQInteger) peers.size());
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets the cell size of the host's interest grid, rebuilding it around the current positions
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_interest_grid(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<SQFloat> cellSize(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (!(cellSize.value > 0)) return sq_throwerror(v, _SC("Cell size must be positive"));
+            data->cells.clear();
+            data->cellSize = cellSize.value;
+            data->maxRadius = 0;
+            for (std::size_t i = 0; i < data->peers.size(); i++) {
+                if (data->peers[i].positioned) interest_insert(&data->peers[i]);
+            }
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Waits for events on the host specified and shuttles packets between the host and its peers
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_service(HSQUIRRELVM v)
+{
+    enet_uint32 timeout = 0;
+    if (sq_gettop(v) == 1 || sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (sq_gettop(v) == 2) {
+            Sqrat::Var<enet_uint32> timeout_ms(v, 2);
+            timeout = timeout_ms.value;
+        }
+        if (!Sqrat::Error::Occurred(v)) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            EnetHostData* data = get_host_data(left.value);
+            EnetScriptEvent event;
+            begin_service(data);
+            int out = next_event(left.value, data, event, timeout, true);
+            if (data != NULL) record_time(data->serviceTime, start);
+            if (out == 0) {
+                sq_pushnull(v);
+                return 1;
+            }
+            if (out < 0) return sq_throwerror(v, _SC("Error during network servicing"));
+            profile_event(data, event);
+            push_event(v, data, event);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Services the host once and returns an array of every event that is ready
+//
+// Parameters
+//  timeout    : Milliseconds to wait for the first event (default 0)
+//  max_events : Maximum number of events to return, 0 for no limit (default 0)
+//  events     : Array to clear and fill instead of creating a new one (optional)
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_service_batch(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    enet_uint32 timeout = 0;
+    std::size_t max_events = 0;
+    if (top < 1 || top > 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (top >= 2) {
+        Sqrat::Var<enet_uint32> timeout_ms(v, 2);
+        timeout = timeout_ms.value;
+    }
+    if (top >= 3) {
+        Sqrat::Var<std::size_t> limit(v, 3);
+        max_events = limit.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    if (top == 4) {
+        if (sq_gettype(v, 4) != OT_ARRAY) return sq_throwerror(v, _SC("Expected an array to fill with events"));
+        sq_push(v, 4);
+        sq_arrayresize(v, -1, 0);
+    } else {
+        sq_newarray(v, 0);
+    }
+
+    // Only the first call may touch the socket, the rest drain what it queued
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    EnetHostData* data = get_host_data(left.value);
+    EnetScriptEvent event;
+    std::size_t count = 0;
+    begin_service(data);
+    int out = next_event(left.value, data, event, timeout, true);
+    while (out > 0) {
+        profile_event(data, event);
+        push_event(v, data, event);
+        sq_arrayappend(v, -2);
+        if (++count == max_events) break;
+        out = next_event(left.value, data, event, 0, false);
+    }
+    if (data != NULL) record_time(data->serviceTime, start);
+    if (out < 0) return sq_throwerror(v, _SC("Error during network servicing"));
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Replaces a handler slot with the function at idx, or clears it for null
+////////////////////////////////////////////////////////////
+static SQInteger set_handler(HSQUIRRELVM v, SQInteger idx, HSQOBJECT& handler)
+{
+    SQObjectType type = sq_gettype(v, idx);
+    if (type != OT_CLOSURE && type != OT_NATIVECLOSURE && type != OT_NULL) {
+        return sq_throwerror(v, _SC("Expected a function or null"));
+    }
+    HSQOBJECT value;
+    sq_getstackobj(v, idx, &value);
+    sq_addref(v, &value);
+    sq_release(v, &handler);
+    handler = value;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets the function Host.dispatch calls as fn(peer, data) when a peer connects
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_on_connect(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            return set_handler(v, 2, data->onConnect);
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets the function Host.dispatch calls as fn(peer, data) when a peer disconnects
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_on_disconnect(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            return set_handler(v, 2, data->onDisconnect);
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets the function Host.dispatch calls as fn(peer, data) for packets received on a channel
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_on_receive(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 3) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<std::size_t> channel(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (channel.value >= data->onReceive.size()) return sq_throwerror(v, _SC("Channel is beyond the host's channel limit"));
+            return set_handler(v, 3, data->onReceive[channel.value]);
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets the function Host.dispatch calls with the event table of any event no other handler takes
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_on_event(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            return set_handler(v, 2, data->onEvent);
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Services the host once and calls the registered handlers for every event that is ready
+//
+// Parameters
+//  timeout    : Milliseconds to wait for the first event (default 0)
+//  max_events : Maximum number of events to dispatch, 0 for no limit (default 0)
+//
+// Returns the number of events dispatched. Events without a handler
+// or an on_event fallback are dropped.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_dispatch(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    enet_uint32 timeout = 0;
+    std::size_t max_events = 0;
+    if (top < 1 || top > 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (top >= 2) {
+        Sqrat::Var<enet_uint32> timeout_ms(v, 2);
+        timeout = timeout_ms.value;
+    }
+    if (top == 3) {
+        Sqrat::Var<std::size_t> limit(v, 3);
+        max_events = limit.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+
+    // Only the first call may touch the socket, the rest drain what it queued
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    EnetScriptEvent event;
+    std::size_t count = 0;
+    begin_service(data);
+    int out = next_event(left.value, data, event, timeout, true);
+    record_time(data->serviceTime, start);
+    ++data->dispatching;
+    while (out > 0) {
+        if (SQ_FAILED(dispatch_event(v, data, event))) {
+            --data->dispatching;
+            return SQ_ERROR;
+        }
+        if (++count == max_events) break;
+        out = next_event(left.value, data, event, 0, false);
+    }
+    --data->dispatching;
+    if (out < 0) return sq_throwerror(v, _SC("Error during network servicing"));
+    sq_pushinteger(v, (SQInteger) count);
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Enables an adaptive order-2 PPM range coder for the transmitted data of all peers
+////////////////////////////////////////////////////////////
+static bool enetHost_compress_with_range_coder(ENetHost* left)
+{
+    EnetHostLock lock(left);
+    if (enet_host_compress_with_range_coder(left) == 0) {
+        return true;
+    }
+    return false;
+}
+
+
+////////////////////////////////////////////////////////////
+// Selects how the datagrams of all peers are compressed; both ends must agree
+//
+// Parameters
+//  name       : "lz" for the bundled LZ77 codec, "range_coder" for ENet's PPM coder, or "none"
+//  level      : LZ search effort from 1 (fastest) to 9 (default 1)
+//  dictionary : String of typical packet content to prime the LZ codec with (optional)
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_compress_with(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top < 2 || top > 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<std::string> name(v, 2);
+    int level = 1;
+    if (top >= 3) {
+        Sqrat::Var<int> lzLevel(v, 3);
+        level = lzLevel.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (name.value == "none") {
+        EnetHostLock lock(left.value);
+        enet_host_compress(left.value, NULL);
+        return 0;
+    }
+    if (name.value == "range_coder") {
+        EnetHostLock lock(left.value);
+        if (enet_host_compress_with_range_coder(left.value) != 0) return sq_throwerror(v, _SC("Failed to create range coder"));
+        return 0;
+    }
+    if (name.value != "lz") return sq_throwerror(v, _SC("Unknown compressor"));
+    if (level < 1 || level > LZ_MAX_LEVEL) return sq_throwerror(v, _SC("Compression level must be between 1 and 9"));
+    const enet_uint8* dictionary = NULL;
+    std::size_t dictionarySize = 0;
+    if (top == 4) {
+        if (sq_gettype(v, 4) != OT_STRING) return sq_throwerror(v, _SC("Expected a dictionary string"));
+        const SQChar* string;
+        sq_getstring(v, 4, &string);
+        dictionary = (const enet_uint8*) string;
+        dictionarySize = sq_getsize(v, 4) * sizeof(SQChar);
+    }
+    ENetCompressor compressor;
+    compressor.context = new EnetLzCompressor(level, dictionary, dictionarySize, &data->compression);
+    compressor.compress = &lz_compress_callback;
+    compressor.decompress = &lz_decompress_callback;
+    compressor.destroy = &lz_destroy_callback;
+    EnetHostLock lock(left.value);
+    enet_host_compress(left.value, &compressor);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the LZ compressor's counters for the host
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_compression_stats(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            EnetCompressionStats stats;
+            {
+                EnetHostLock lock(left.value);
+                stats = data->compression;
+            }
+            sq_newtable(v);
+            push_stat(v, _SC("packets"), (SQInteger) stats.packets);
+            push_stat(v, _SC("skipped"), (SQInteger) stats.skipped);
+            push_stat(v, _SC("raw_bytes"), (SQInteger) stats.rawBytes);
+            push_stat(v, _SC("compressed_bytes"), (SQInteger) stats.compressedBytes);
+            push_stat(v, _SC("compress_time_us"), (SQInteger) (stats.compressTime / 1000));
+            push_stat(v, _SC("decompressed_packets"), (SQInteger) stats.decompressedPackets);
+            push_stat(v, _SC("decompressed_bytes"), (SQInteger) stats.decompressedBytes);
+            push_stat(v, _SC("decompress_time_us"), (SQInteger) (stats.decompressTime / 1000));
+            push_stat(v, _SC("failures"), (SQInteger) stats.failures);
+            sq_pushstring(v, _SC("ratio"), -1);
+            sq_pushfloat(v, stats.rawBytes > 0 ? (SQFloat) stats.compressedBytes / stats.rawBytes : (SQFloat) 1);
+            sq_newslot(v, -3, false);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Batches small Peer.send messages into one packet per peer and channel until the next service or flush
+//
+// Parameters
+//  max_bytes : Largest packet to build, 0 to stop coalescing (kept under the MTU to avoid fragments)
+//
+// Every packet the host sends is then framed as messages, and every
+// packet it receives is split back into them, so both ends must agree.
+// Received packets that aren't valid framing are dropped and counted
+// as coalesce_malformed in Host.stats and Peer.stats.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_coalesce(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<std::size_t> limit(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (limit.value != 0 && limit.value < 64) return sq_throwerror(v, _SC("Coalesced packets must allow at least 64 bytes"));
+            flush_staged(data);
+            data->coalesceLimit = limit.value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Limits how fast each peer may send on a channel, checked before packets reach scripts
+//
+// Parameters
+//  channel         : Channel to limit
+//  packets_per_sec : Packets each peer may send per second, 0 for no packet limit
+//  packet_burst    : Packets a peer may send at once after being quiet
+//  bytes_per_sec   : Bytes each peer may send per second, 0 for no byte limit (default 0)
+//  byte_burst      : Bytes a peer may send at once; larger packets never pass
+//  drop            : Drop over-limit packets, or only count them (default true)
+//
+// Passing 0 for both rates removes the channel's limit. Counts
+// show up as rate_dropped in Host.stats and Peer.stats.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_rate_limit(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 4 && top != 6 && top != 7) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
     }
-    if (port_str == "*") {
-        address.port = ENET_PORT_ANY;
-    } else {
-        address.port = std::atoi(port_str.c_str());
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<std::size_t> channel(v, 2);
+    Sqrat::Var<SQFloat> packetRate(v, 3);
+    Sqrat::Var<SQFloat> packetBurst(v, 4);
+    EnetRateLimit limit;
+    limit.packetRate = packetRate.value;
+    limit.packetBurst = packetBurst.value;
+    if (top >= 6) {
+        Sqrat::Var<SQFloat> byteRate(v, 5);
+        Sqrat::Var<SQFloat> byteBurst(v, 6);
+        limit.byteRate = byteRate.value;
+        limit.byteBurst = byteBurst.value;
+    }
+    if (top == 7) {
+        Sqrat::Var<bool> drop(v, 7);
+        limit.drop = drop.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (channel.value >= left.value->channelLimit) return sq_throwerror(v, _SC("Channel out of range"));
+    if (!(limit.packetRate >= 0 && limit.packetBurst >= 0 && limit.byteRate >= 0 && limit.byteBurst >= 0)) {
+        return sq_throwerror(v, _SC("Rates and bursts must not be negative"));
+    }
+    if ((limit.packetRate > 0 && limit.packetBurst < 1) || (limit.byteRate > 0 && limit.byteBurst <= 0)) {
+        return sq_throwerror(v, _SC("A limited rate needs a burst that lets at least one packet through"));
+    }
+    if (data->rateLimits.empty()) data->rateLimits.resize(left.value->channelLimit);
+    data->rateLimits[channel.value] = limit;
+    for (std::size_t i = 0; i < data->peers.size(); i++) {
+        if (channel.value < data->peers[i].buckets.size()) data->peers[i].buckets[channel.value] = EnetTokenBucket();
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Disconnects peers whose packets go over the rate limits too often
+//
+// Parameters
+//  drops_per_sec : Over-limit packets a peer may send in one second before it is disconnected, 0 for never
+//
+// The peer is dropped with enet_peer_disconnect_now and scripts
+// get an ordinary disconnect event whose data is
+// ENET_DISCONNECT_FLOOD.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_flood_limit(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<std::size_t> limit(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            data->floodLimit = limit.value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Chooses the channel that carries snapshots and their acks, or -1 for none
+//
+// Parameters
+//  channel : Channel for Peer.send_snapshot and Host.broadcast_snapshot, -1 to turn snapshots off
+//  history : Snapshots kept per peer while acks are in flight, up to 1024 (default 16)
+//
+// Both ends must choose the same channel, and nothing else may be
+// sent on it. Changing it forgets every peer's baselines. The
+// history must outlast the round trip in snapshots sent, e.g. 40
+// for 2 seconds at 20 a second; past that every snapshot goes out
+// whole, which Host.stats counts as snapshot_late_acks.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_snapshot_channel(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 2 && top != 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQInteger> channel(v, 2);
+    SQInteger history = SNAPSHOT_HISTORY;
+    if (top == 3) {
+        Sqrat::Var<SQInteger> historyArg(v, 3);
+        history = historyArg.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (channel.value < -1 || channel.value >= (SQInteger) left.value->channelLimit) {
+        return sq_throwerror(v, _SC("Channel out of range"));
+    }
+    if (history < 1 || history > (SQInteger) SNAPSHOT_MAX_HISTORY) {
+        return sq_throwerror(v, _SC("History must be from 1 to 1024"));
+    }
+    data->snapshotChannel = (int) channel.value;
+    data->snapshotHistory = (std::size_t) history;
+    for (std::size_t i = 0; i < data->peers.size(); i++) {
+        clear_snapshots(&data->peers[i]);
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sends the current state to every connected peer, each as a delta against its own acknowledged baseline
+//
+// Returns the number of peers the snapshot was queued for.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_broadcast_snapshot(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            std::shared_ptr<const std::vector<enet_uint8> > snapshot;
+            SQInteger result = read_snapshot_value(v, 2, data, snapshot);
+            if (SQ_FAILED(result)) {
+                return result;
+            }
+            SQInteger sent = 0;
+            for (std::size_t i = 0; i < left.value->peerCount; i++) {
+                if (send_snapshot(&left.value->peers[i], data, snapshot)) sent++;
+            }
+            sq_pushinteger(v, sent);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Limits what incoming streams may hold the host to
+//
+// Parameters
+//  bytes   : Most bytes all incoming streams together may reserve (default 256 MiB)
+//  timeout : Milliseconds an incoming stream may go without a chunk before it is refused (default 30000)
+//
+// A stream reserves its declared size, in memory or on disk, as
+// soon as it begins, so a begin that would take the host past
+// its budget is refused straight away. Timed out streams fail
+// like refused ones and are counted in streams_timed_out.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_stream_budget(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 2 && top != 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQInteger> bytes(v, 2);
+    SQInteger timeout = STREAM_TIMEOUT;
+    if (top == 3) {
+        Sqrat::Var<SQInteger> timeoutArg(v, 3);
+        timeout = timeoutArg.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (bytes.value < 0) return sq_throwerror(v, _SC("Budget must not be negative"));
+    if (timeout <= 0) return sq_throwerror(v, _SC("Timeout must be positive"));
+    data->streamBudget = (std::size_t) bytes.value;
+    data->streamTimeout = std::chrono::milliseconds(timeout);
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Chooses the channel that carries streams, or -1 for none
+//
+// Parameters
+//  channel  : Channel for Peer.send_stream and Peer.send_file, -1 to turn streaming off
+//  window   : Outgoing bytes a peer may have queued or in flight before more chunks wait (default 256 KiB)
+//  max_size : Largest incoming stream accepted, bigger ones are refused (default 64 MiB)
+//
+// Both ends must choose the same channel, and nothing else may be
+// sent on it. Chunks are topped up as each service begins, so the
+// window should cover what the link carries between services.
+// Changing the channel abandons every stream in progress.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_stream_channel(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top < 2 || top > 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQInteger> channel(v, 2);
+    SQInteger window = STREAM_WINDOW;
+    SQInteger maxSize = STREAM_MAX_SIZE;
+    if (top >= 3) {
+        Sqrat::Var<SQInteger> windowArg(v, 3);
+        window = windowArg.value;
+    }
+    if (top == 4) {
+        Sqrat::Var<SQInteger> maxSizeArg(v, 4);
+        maxSize = maxSizeArg.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (channel.value < -1 || channel.value >= (SQInteger) left.value->channelLimit) {
+        return sq_throwerror(v, _SC("Channel out of range"));
+    }
+    if (window <= 0) return sq_throwerror(v, _SC("Window must be positive"));
+    if (maxSize < 0) return sq_throwerror(v, _SC("Size must not be negative"));
+    if (channel.value != data->streamChannel) {
+        for (std::size_t i = 0; i < data->peers.size(); i++) {
+            clear_streams(&data->peers[i]);
+        }
+    }
+    data->streamChannel = (int) channel.value;
+    data->streamWindow = (std::size_t) window;
+    data->streamMaxSize = (std::size_t) maxSize;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Writes incoming streams to files in a directory instead of memory, or back to memory with null
+//
+// Each stream is preallocated as "<peer id>-<stream id>.part" and
+// renamed without the suffix once whole; its complete event then
+// carries the file's path instead of the data. Unfinished files
+// are deleted when their stream fails.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_stream_directory(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (sq_gettype(v, 2) == OT_NULL) {
+                data->streamDirectory.clear();
+                return 0;
+            }
+            Sqrat::Var<const std::string&> path(v, 2);
+            if (Sqrat::Error::Occurred(v)) {
+                return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+            }
+            if (path.value.empty()) return sq_throwerror(v, _SC("Directory must not be empty"));
+            data->streamDirectory = path.value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Turns on the outgoing scheduler, giving each peer a byte budget, or turns it off with 0
+//
+// Parameters
+//  bytes_per_second : Budget each peer is refilled at, 0 to send everything at once again
+//  burst            : Most budget a peer can save up while idle, at least the host's MTU (default a tenth of a second's worth)
+//
+// While it is on, packets sent to peers wait in the binding and
+// are released as each service begins and on every flush, most
+// urgent channel first, only as fast as each peer's budget
+// allows. Set the budget a little under what the link carries so
+// the queues build up here, where they can be reordered, rather
+// than inside ENet.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_send_budget(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 2 && top != 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQFloat> rate(v, 2);
+    SQFloat burst = rate.value / 10;
+    if (top == 3) {
+        Sqrat::Var<SQFloat> burstArg(v, 3);
+        burst = burstArg.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (!(rate.value >= 0) || !(burst >= 0)) return sq_throwerror(v, _SC("Budget must not be negative"));
+    data->sendBudget = rate.value;
+    data->sendBurst = std::max((double) burst, (double) left.value->mtu);
+    if (data->sendBudget == 0 && !data->scheduled.empty()) {
+        // Let everything waiting go ahead of packets that will now skip the queues
+        run_scheduler(data);
+    }
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets how urgently the scheduler sends a channel's packets
+//
+// Parameters
+//  channel  : Channel to set
+//  priority : Lower goes first; a channel waits while any more urgent one has packets (default 0)
+//  weight   : Share of the budget among channels of the same priority, 1 to 1000 (default 1)
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_channel_priority(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 3 && top != 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQInteger> channel(v, 2);
+    Sqrat::Var<SQInteger> priority(v, 3);
+    SQInteger weight = 1;
+    if (top == 4) {
+        Sqrat::Var<SQInteger> weightArg(v, 4);
+        weight = weightArg.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (channel.value < 0 || channel.value >= (SQInteger) data->schedule.size()) {
+        return sq_throwerror(v, _SC("Channel out of range"));
+    }
+    if (weight < 1 || weight > 1000) return sq_throwerror(v, _SC("Weight must be from 1 to 1000"));
+    data->schedule[channel.value].priority = (int) priority.value;
+    data->schedule[channel.value].weight = (unsigned) weight;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Lets a new unreliable packet on the channel replace the unreliable packets still waiting in the scheduler
+//
+// Meant for channels carrying whole state, where only the newest
+// packet matters. Reliable packets on the channel always go.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_supersede(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 3) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<SQInteger> channel(v, 2);
+        Sqrat::Var<bool> enabled(v, 3);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (channel.value < 0 || channel.value >= (SQInteger) data->schedule.size()) {
+                return sq_throwerror(v, _SC("Channel out of range"));
+            }
+            data->schedule[channel.value].supersede = enabled.value;
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Simulates a poor link, in real time, on the datagrams the host receives
+//
+// Parameters
+//  latency   : Milliseconds each datagram is held back
+//  jitter    : Milliseconds the latency varies by either way
+//  loss      : Chance of dropping each datagram, from 0 to 1
+//  bandwidth : Bytes per second the link carries (default 0, unlimited)
+//  seed      : Seeds the loss and jitter rolls (default 0)
+//
+// Called without parameters it turns the impairment off and
+// delivers anything still held. Impair both ends of a
+// connection to model a two-way link. Held datagrams are
+// delivered by sending them back to the host over loopback,
+// so the host must be bound to any address or to 127.0.0.1.
+//
+// Runs are not reproducible. The seed fixes the sequence of
+// rolls, but which datagram meets which roll depends on when
+// ENet sends and retransmits, which follows the wall clock.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_impair(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 1 && (top < 4 || top > 6)) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (top == 1) {
+        EnetHostLock lock(left.value);
+        release_held(left.value, data, true);
+        data->impairment.active = false;
+        return 0;
+    }
+    Sqrat::Var<SQFloat> latency(v, 2);
+    Sqrat::Var<SQFloat> jitter(v, 3);
+    Sqrat::Var<SQFloat> loss(v, 4);
+    enet_uint32 bandwidth = 0;
+    unsigned long long seed = 0;
+    if (top >= 5) {
+        Sqrat::Var<enet_uint32> limit(v, 5);
+        bandwidth = limit.value;
+    }
+    if (top == 6) {
+        Sqrat::Var<SQInteger> rollSeed(v, 6);
+        seed = (unsigned long long) rollSeed.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    if (!(latency.value >= 0) || !(jitter.value >= 0)) return sq_throwerror(v, _SC("Latency and jitter must not be negative"));
+    if (!(loss.value >= 0 && loss.value <= 1)) return sq_throwerror(v, _SC("Loss must be between 0 and 1"));
+    EnetHostLock lock(left.value);
+    EnetImpairment& impairment = data->impairment;
+    if (impairment.token == 0) {
+        std::random_device entropy;
+        while (impairment.token == 0) {
+            impairment.token = ((unsigned long long) entropy() << 32) ^ entropy();
+        }
+        impairment.port = left.value->address.port;
+    }
+    impairment.latency = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(latency.value));
+    impairment.jitter = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(jitter.value));
+    impairment.loss = loss.value;
+    impairment.bandwidth = bandwidth;
+    impairment.random.seed(seed);
+    impairment.active = true;
+    left.value->intercept = &impair_intercept;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the address the host is bound to as "ip:port", or null if it isn't bound yet
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_address(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            ENetAddress address;
+            if (enet_socket_get_address(left.value->socket, &address) != 0 || address.port == 0) {
+                sq_pushnull(v);
+                return 1;
+            }
+            char ip[64];
+            if (enet_address_get_host_ip(&address, ip, sizeof(ip)) != 0) {
+                return sq_throwerror(v, _SC("Failed to format address"));
+            }
+            char text[80];
+            std::snprintf(text, sizeof(text), "%s:%u", ip, (unsigned) address.port);
+            sq_pushstring(v, text, -1);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Starts logging the host's traffic to a file, or stops when called without one
+//
+// Parameters
+//  path : Log to write, replacing any file already there
+//
+// Every event the host hands to scripts and every packet sent
+// through Peer.send, Host.broadcast or Host.send_to is recorded
+// with its time, peer slot, channel, flags and payload. Stopping
+// returns the size of the finished log, or null if the host
+// wasn't capturing.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_capture(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top != 1 && top != 2) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (top == 1 || sq_gettype(v, 2) == OT_NULL) {
+        if (data->capture == NULL) {
+            sq_pushnull(v);
+            return 1;
+        }
+        std::size_t size = data->capture->close();
+        delete data->capture;
+        data->capture = NULL;
+        sq_pushinteger(v, (SQInteger) size);
+        return 1;
+    }
+    Sqrat::Var<const std::string&> path(v, 2);
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetCaptureWriter* capture = new EnetCaptureWriter();
+    if (!capture->open(path.value)) {
+        delete capture;
+        return sq_throwerror(v, _SC("Failed to create capture log"));
+    }
+    enet_uint8 header[CAPTURE_FILE_HEADER];
+    std::memcpy(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    capture_put(header + 8, CAPTURE_VERSION, 4);
+    capture_put(header + 12, left.value->peerCount, 4);
+    if (!capture->append(header, sizeof(header), NULL, 0)) {
+        delete capture;
+        return sq_throwerror(v, _SC("Failed to write capture log"));
+    }
+    delete data->capture;
+    data->capture = capture;
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////
+// Feeds a log written by Host.capture back to scripts as the host's events, or stops when called without one
+//
+// Parameters
+//  path  : Log to replay
+//  speed : Multiple of the recorded pace, 0 for as fast as possible (default 1)
+//
+// Recorded connects, disconnects and receives come out of the
+// host's usual event calls on the recorded peer slots, ahead of
+// anything from the network, and an ENET_EVENT_TYPE_REPLAY_DONE
+// event carrying the number of replayed events follows the
+// last. Records are released as each service begins, so pace is
+// only as fine as the script's service calls. Stopping returns
+// the number of events replayed, or null if nothing was.
+//
+// The host must have no connections when replay starts, since
+// the recorded slots would otherwise land on live peers.
+// Replayed events leave peer state and traffic stats alone and
+// are handed out as recorded, without coalesced packets being
+// split again.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_replay(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    if (top < 1 || top > 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (top == 1) {
+        if (data->replay == NULL) {
+            sq_pushnull(v);
+            return 1;
+        }
+        sq_pushinteger(v, (SQInteger) data->replay->replayed);
+        delete data->replay;
+        data->replay = NULL;
+        return 1;
+    }
+    Sqrat::Var<const std::string&> path(v, 2);
+    SQFloat speed = 1;
+    if (top == 3) {
+        Sqrat::Var<SQFloat> pace(v, 3);
+        speed = pace.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    if (!(speed >= 0)) return sq_throwerror(v, _SC("Speed must not be negative"));
+    for (std::size_t i = 0; i < left.value->peerCount; i++) {
+        if (left.value->peers[i].state != ENET_PEER_STATE_DISCONNECTED) {
+            return sq_throwerror(v, _SC("Host has peers; replay onto a host with no connections"));
+        }
+    }
+    EnetReplay* replay = new EnetReplay();
+    const SQChar* error = replay->open(path.value);
+    if (error != NULL) {
+        delete replay;
+        return sq_throwerror(v, error);
     }
+    replay->speed = speed;
+    replay->start = std::chrono::steady_clock::now();
+    delete data->replay;
+    data->replay = replay;
     return 0;
 }
 
 
 ////////////////////////////////////////////////////////////
-static void push_event(HSQUIRRELVM v, const ENetEvent& event)
+// Sends staged messages and queued packets to the wire without waiting for the next service
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_flush(HSQUIRRELVM v)
 {
-    sq_newtable(v);
-    if (event.peer) {
-        Sqrat::PushVar(v, "peer");
-        Sqrat::PushVar(v, event.peer);
-        sq_newslot(v, -3, false);
-    }
-    switch (event.type) {
-    case ENET_EVENT_TYPE_CONNECT :
-        Sqrat::PushVar(v, "data");
-        Sqrat::PushVar(v, event.data);
-        sq_newslot(v, -3, false);
-        Sqrat::PushVar(v, "type");
-        Sqrat::PushVar(v, ENET_EVENT_TYPE_CONNECT);
-        break;
-    case ENET_EVENT_TYPE_DISCONNECT :
-        Sqrat::PushVar(v, "data");
-        Sqrat::PushVar(v, event.data);
-        sq_newslot(v, -3, false);
-        Sqrat::PushVar(v, "type");
-        Sqrat::PushVar(v, ENET_EVENT_TYPE_DISCONNECT);
-        break;
-    case ENET_EVENT_TYPE_RECEIVE :
-        Sqrat::PushVar(v, "data");
-        Sqrat::PushVar(v, std::string((const char*) event.packet->data, event.packet->dataLength));
-        sq_newslot(v, -3, false);
-        Sqrat::PushVar(v, "channel");
-        Sqrat::PushVar(v, event.channelID);
-        sq_newslot(v, -3, false);
-        Sqrat::PushVar(v, "type");
-        Sqrat::PushVar(v, ENET_EVENT_TYPE_RECEIVE);
-        enet_packet_destroy(event.packet);
-        break;
-    case ENET_EVENT_TYPE_NONE :
-        Sqrat::PushVar(v, "type");
-        Sqrat::PushVar(v, ENET_EVENT_TYPE_NONE);
-        break;
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            flush_host(left.value, get_host_data(left.value));
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
     }
-    sq_newslot(v, -3, false);
+    return sq_throwerror(v, _SC("wrong number of parameters"));
 }
 
 
 ////////////////////////////////////////////////////////////
-static SQInteger read_packet(HSQUIRRELVM v, ENetPacket*& packet, const std::string& data, enet_uint32 flag)
+// Drives the host at a fixed tick rate until the tick function returns false
+//
+// Parameters
+//  tick_hz  : Ticks per second
+//  tick_fn  : Called with the tick number once per tick; return false to stop
+//  event_fn : Called with each event table as it arrives between ticks
+//             (optional; without it events go to the handlers, as with Host.dispatch)
+//
+// Between ticks the socket is serviced with a timeout that ends at
+// the next deadline. Each tick is followed by a single flush. A tick
+// that finishes after the next one was due counts as an overrun, and
+// deadlines missed entirely are skipped rather than run back to back.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_run(HSQUIRRELVM v)
 {
-    if (flag != ENET_PACKET_FLAG_RELIABLE && flag != ENET_PACKET_FLAG_UNSEQUENCED && flag != 0) {
-        return sq_throwerror(v, _SC("Unknown packet flag"));
+    typedef std::chrono::steady_clock clock;
+    SQInteger top = sq_gettop(v);
+    if (top != 3 && top != 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
     }
-    packet = enet_packet_create(data.c_str(), data.size(), flag);
-    if (packet == NULL) {
-        return sq_throwerror(v, _SC("Failed to create packet"));
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<SQFloat> tickHz(v, 2);
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    if (sq_gettype(v, 3) != OT_CLOSURE && sq_gettype(v, 3) != OT_NATIVECLOSURE) return sq_throwerror(v, _SC("Expected a tick function"));
+    if (top == 4 && sq_gettype(v, 4) != OT_CLOSURE && sq_gettype(v, 4) != OT_NATIVECLOSURE) return sq_throwerror(v, _SC("Expected an event function"));
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+    if (!(tickHz.value > 0) || tickHz.value > 1000) return sq_throwerror(v, _SC("Tick rate must be above 0 and at most 1000 Hz"));
+    if (data->running) return sq_throwerror(v, _SC("Host is already running"));
+
+    clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / tickHz.value));
+    clock::time_point deadline = clock::now() + period;
+    SQInteger tick = 0;
+    data->running = true;
+    for (;;) {
+        // Dispatch events until the tick is due, always taking at least one look at the socket
+        bool serviced = false;
+        for (;;) {
+            begin_service(data);
+            clock::time_point now = clock::now();
+            if (serviced && now >= deadline) break;
+            enet_uint32 timeout = now < deadline ? (enet_uint32) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() : 0;
+            EnetScriptEvent event;
+            int out = next_event(left.value, data, event, timeout, true);
+            record_time(data->serviceTime, now);
+            serviced = true;
+            if (out < 0) {
+                data->running = false;
+                return sq_throwerror(v, _SC("Error during network servicing"));
+            }
+            if (out == 0) {
+                // ENet waits in whole milliseconds, so sleep off the remainder
+                if (timeout == 0) std::this_thread::sleep_until(deadline);
+                continue;
+            }
+            SQRESULT result;
+            if (top == 4) {
+                sq_push(v, 4);
+                sq_pushroottable(v);
+                profile_event(data, event);
+                push_event(v, data, event);
+                result = sq_call(v, 2, SQFalse, SQTrue);
+                sq_poptop(v);
+                if (data->profiler != NULL) profile_settle(data->profiler);
+            } else {
+                result = dispatch_event(v, data, event);
+            }
+            if (SQ_FAILED(result)) {
+                data->running = false;
+                return SQ_ERROR;
+            }
+        }
+
+        clock::time_point start = clock::now();
+        sq_push(v, 3);
+        sq_pushroottable(v);
+        sq_pushinteger(v, tick++);
+        if (SQ_FAILED(sq_call(v, 2, SQTrue, SQTrue))) {
+            data->running = false;
+            return SQ_ERROR;
+        }
+        SQBool keepRunning = SQTrue;
+        if (sq_gettype(v, -1) == OT_BOOL) sq_getbool(v, -1, &keepRunning);
+        sq_pop(v, 2);
+        flush_host(left.value, data);
+        clock::time_point end = clock::now();
+        record_time(data->tickTime, start);
+        ++data->ticks;
+        deadline += period;
+        if (end > deadline) {
+            ++data->tickOverruns;
+            clock::duration::rep missed = (end - deadline) / period;
+            data->ticksSkipped += missed;
+            deadline += missed * period;
+        }
+        if (!keepRunning) break;
     }
+    data->running = false;
     return 0;
 }
 
 
 ////////////////////////////////////////////////////////////
-// Constructor
+// Returns the peer with the given stable ID, or null if that connection is gone
 ////////////////////////////////////////////////////////////
-static SQInteger enetPeer_constructor(HSQUIRRELVM v)
+static SQInteger enetHost_peer_by_id(HSQUIRRELVM v)
 {
-    return sq_throwerror(v, _SC("constructor is protected"));
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<SQInteger> id(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not created by host_create"));
+            std::size_t slot = (std::size_t) (id.value & 0xFFFF);
+            if (id.value >= 0 && slot < left.value->peerCount) {
+                ENetPeer* peer = &left.value->peers[slot];
+                if (peer_id(peer, &data->peers[slot]) == id.value && peer->state != ENET_PEER_STATE_DISCONNECTED) {
+                    push_peer(v, peer);
+                    return 1;
+                }
+            }
+            sq_pushnull(v);
+            return 1;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
 }
 
 
 ////////////////////////////////////////////////////////////
-// Requests a disconnection from a peer
+// Selects how received payloads are handed to scripts (ENET_RECEIVE_STRING, _PACKET or _DECODED)
 ////////////////////////////////////////////////////////////
-static SQInteger enetPeer_disconnect(HSQUIRRELVM v)
+static SQInteger enetHost_receive_mode(HSQUIRRELVM v)
 {
-    if (sq_gettop(v) == 1) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<int> mode(v, 2);
         if (!Sqrat::Error::Occurred(v)) {
-            enet_peer_disconnect(left.value, 0);
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not created by host_create"));
+            if (mode.value != ENET_RECEIVE_STRING && mode.value != ENET_RECEIVE_PACKET && mode.value != ENET_RECEIVE_DECODED) {
+                return sq_throwerror(v, _SC("Unknown receive mode"));
+            }
+            data->receiveMode = mode.value;
             return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 2) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
-        Sqrat::Var<enet_uint32> data(v, 2);
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Registers table keys the serializer may send as indices; both ends must register the same array
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_serializer_keys(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
         if (!Sqrat::Error::Occurred(v)) {
-            enet_peer_disconnect(left.value, data.value);
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not created by host_create"));
+            if (sq_gettype(v, 2) != OT_ARRAY) return sq_throwerror(v, _SC("Expected an array of strings"));
+            SQInteger count = sq_getsize(v, 2);
+            for (SQInteger i = 0; i < count; i++) {
+                sq_pushinteger(v, i);
+                sq_get(v, 2);
+                SQObjectType type = sq_gettype(v, -1);
+                sq_poptop(v);
+                if (type != OT_STRING) return sq_throwerror(v, _SC("Expected an array of strings"));
+            }
+            for (std::size_t i = 0; i < data->presetKeys.size(); i++) {
+                sq_release(v, &data->presetKeys[i]);
+            }
+            data->presetKeys.clear();
+            data->presetIndex.clear();
+            for (SQInteger i = 0; i < count; i++) {
+                HSQOBJECT key;
+                const SQChar* string;
+                sq_pushinteger(v, i);
+                sq_get(v, 2);
+                sq_getstackobj(v, -1, &key);
+                sq_getstring(v, -1, &string);
+                sq_addref(v, &key);
+                sq_poptop(v);
+                data->presetIndex.insert(std::make_pair(string, data->presetKeys.size()));
+                data->presetKeys.push_back(key);
+            }
             return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
@@ -146,22 +7141,137 @@ static SQInteger enetPeer_disconnect(HSQUIRRELVM v)
 
 
 ////////////////////////////////////////////////////////////
-// Requests a disconnection from a peer, but only after all queued outgoing packets are sent
+// Returns host totals, traffic by channel and service/dispatch timings in one table
 ////////////////////////////////////////////////////////////
-static SQInteger enetPeer_disconnect_later(HSQUIRRELVM v)
+static SQInteger enetHost_stats(HSQUIRRELVM v)
 {
     if (sq_gettop(v) == 1) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
+        Sqrat::Var<ENetHost*> left(v, 1);
         if (!Sqrat::Error::Occurred(v)) {
-            enet_peer_disconnect_later(left.value, 0);
-            return 0;
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            EnetHostLock lock(left.value);
+            sq_newtable(v);
+            push_stat(v, _SC("total_sent_data"), left.value->totalSentData);
+            push_stat(v, _SC("total_sent_packets"), left.value->totalSentPackets);
+            push_stat(v, _SC("total_received_data"), left.value->totalReceivedData);
+            push_stat(v, _SC("total_received_packets"), left.value->totalReceivedPackets);
+            push_stat(v, _SC("connected_peers"), (SQInteger) left.value->connectedPeers);
+            sq_pushstring(v, _SC("channels"), -1);
+            sq_newarray(v, 0);
+            for (std::size_t i = 0; i < data->channels.size(); i++) {
+                sq_newtable(v);
+                push_traffic(v, data->channels[i]);
+                sq_arrayappend(v, -2);
+            }
+            sq_newslot(v, -3, false);
+            push_histogram(v, _SC("service_time"), data->serviceTime);
+            push_histogram(v, _SC("dispatch_time"), data->dispatchTime);
+            push_histogram(v, _SC("tick_time"), data->tickTime);
+            push_stat(v, _SC("ticks"), (SQInteger) data->ticks);
+            push_stat(v, _SC("tick_overruns"), (SQInteger) data->tickOverruns);
+            push_stat(v, _SC("ticks_skipped"), (SQInteger) data->ticksSkipped);
+            push_stat(v, _SC("impair_dropped"), (SQInteger) data->impairment.dropped);
+            push_stat(v, _SC("impair_delayed"), (SQInteger) data->impairment.delayed);
+            push_stat(v, _SC("snapshot_keyframes"), (SQInteger) data->snapshots.keyframes);
+            push_stat(v, _SC("snapshot_deltas"), (SQInteger) data->snapshots.deltas);
+            push_stat(v, _SC("snapshot_raw_bytes"), (SQInteger) data->snapshots.rawBytes);
+            push_stat(v, _SC("snapshot_sent_bytes"), (SQInteger) data->snapshots.sentBytes);
+            push_stat(v, _SC("snapshot_undecodable"), (SQInteger) data->snapshots.undecodable);
+            push_stat(v, _SC("snapshot_late_acks"), (SQInteger) data->snapshots.lateAcks);
+            push_stat(v, _SC("rate_dropped"), (SQInteger) data->rateDropped);
+            push_stat(v, _SC("flood_disconnects"), (SQInteger) data->floodDisconnects);
+            push_stat(v, _SC("coalesce_malformed"), (SQInteger) data->coalesceMalformed);
+            push_stat(v, _SC("stream_sent_bytes"), (SQInteger) data->streams.sentBytes);
+            push_stat(v, _SC("stream_received_bytes"), (SQInteger) data->streams.receivedBytes);
+            push_stat(v, _SC("streams_sent"), (SQInteger) data->streams.sent);
+            push_stat(v, _SC("streams_completed"), (SQInteger) data->streams.completed);
+            push_stat(v, _SC("streams_failed"), (SQInteger) data->streams.failed);
+            push_stat(v, _SC("streams_timed_out"), (SQInteger) data->streams.timedOut);
+            push_stat(v, _SC("stream_reserved_bytes"), (SQInteger) data->streamReserved);
+            push_stat(v, _SC("scheduled_bytes"), (SQInteger) data->scheduledBytes);
+            push_stat(v, _SC("scheduled_packets"), (SQInteger) data->scheduledPackets);
+            push_stat(v, _SC("superseded"), (SQInteger) data->superseded);
+            return 1;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 2) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
-        Sqrat::Var<enet_uint32> data(v, 2);
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+static void write_histogram(FILE* file, const char* name, const char* labels, const EnetHistogram& histogram)
+{
+    std::fprintf(file, "# TYPE %s histogram\n", name);
+    unsigned long long cumulative = 0;
+    for (std::size_t i = 0; i < STATS_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += histogram.buckets[i];
+        std::fprintf(file, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, (double) (1ULL << i) / 1000000.0, cumulative);
+    }
+    std::fprintf(file, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, histogram.count);
+    std::fprintf(file, "%s_sum{%s} %g\n", name, labels, histogram.sum / 1000000.0);
+    std::fprintf(file, "%s_count{%s} %llu\n", name, labels, histogram.count);
+}
+
+
+////////////////////////////////////////////////////////////
+// Writes the host's stats to a file in Prometheus text exposition format
+//
+// Parameters
+//  path : File to replace; written beside it first and renamed so scrapers never see half a file
+//
+// Samples carry a port label with the host's port so several hosts can share a scrape directory.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_write_stats(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<std::string> path(v, 2);
         if (!Sqrat::Error::Occurred(v)) {
-            enet_peer_disconnect_later(left.value, data.value);
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            std::string temp = path.value + ".tmp";
+            FILE* file = std::fopen(temp.c_str(), "w");
+            if (file == NULL) return sq_throwerror(v, _SC("Failed to open stats file"));
+            char labels[32];
+            std::sprintf(labels, "port=\"%u\"", (unsigned) left.value->address.port);
+            {
+                EnetHostLock lock(left.value);
+                std::fprintf(file, "# TYPE enet_host_sent_bytes_total counter\nenet_host_sent_bytes_total{%s} %u\n", labels, left.value->totalSentData);
+                std::fprintf(file, "# TYPE enet_host_sent_packets_total counter\nenet_host_sent_packets_total{%s} %u\n", labels, left.value->totalSentPackets);
+                std::fprintf(file, "# TYPE enet_host_received_bytes_total counter\nenet_host_received_bytes_total{%s} %u\n", labels, left.value->totalReceivedData);
+                std::fprintf(file, "# TYPE enet_host_received_packets_total counter\nenet_host_received_packets_total{%s} %u\n", labels, left.value->totalReceivedPackets);
+                std::fprintf(file, "# TYPE enet_host_connected_peers gauge\nenet_host_connected_peers{%s} %u\n", labels, (unsigned) left.value->connectedPeers);
+            }
+            const char* names[] = { "enet_channel_sent_bytes_total", "enet_channel_sent_packets_total", "enet_channel_received_bytes_total", "enet_channel_received_packets_total" };
+            for (std::size_t n = 0; n < 4; n++) {
+                std::fprintf(file, "# TYPE %s counter\n", names[n]);
+                for (std::size_t i = 0; i < data->channels.size(); i++) {
+                    const EnetTrafficStats& traffic = data->channels[i];
+                    unsigned long long values[] = { traffic.sentBytes, traffic.sentPackets, traffic.receivedBytes, traffic.receivedPackets };
+                    std::fprintf(file, "%s{%s,channel=\"%u\"} %llu\n", names[n], labels, (unsigned) i, values[n]);
+                }
+            }
+            write_histogram(file, "enet_service_seconds", labels, data->serviceTime);
+            write_histogram(file, "enet_dispatch_seconds", labels, data->dispatchTime);
+            write_histogram(file, "enet_tick_seconds", labels, data->tickTime);
+            std::fprintf(file, "# TYPE enet_ticks_total counter\nenet_ticks_total{%s} %llu\n", labels, data->ticks);
+            std::fprintf(file, "# TYPE enet_tick_overruns_total counter\nenet_tick_overruns_total{%s} %llu\n", labels, data->tickOverruns);
+            std::fprintf(file, "# TYPE enet_ticks_skipped_total counter\nenet_ticks_skipped_total{%s} %llu\n", labels, data->ticksSkipped);
+            bool failed = std::ferror(file) != 0;
+            if (std::fclose(file) != 0 || failed) {
+                std::remove(temp.c_str());
+                return sq_throwerror(v, _SC("Failed to write stats file"));
+            }
+#ifdef _WIN32
+            std::remove(path.value.c_str());
+#endif
+            if (std::rename(temp.c_str(), path.value.c_str()) != 0) {
+                std::remove(temp.c_str());
+                return sq_throwerror(v, _SC("Failed to replace stats file"));
+            }
             return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
@@ -171,22 +7281,91 @@ static SQInteger enetPeer_disconnect_later(HSQUIRRELVM v)
 
 
 ////////////////////////////////////////////////////////////
-// Force an immediate disconnection from a peer
+// Name of an event type for folded profile stacks
 ////////////////////////////////////////////////////////////
-static SQInteger enetPeer_disconnect_now(HSQUIRRELVM v)
+static const char* event_type_name(int type)
 {
-    if (sq_gettop(v) == 1) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
+    switch (type) {
+    case ENET_EVENT_TYPE_CONNECT : return "connect";
+    case ENET_EVENT_TYPE_DISCONNECT : return "disconnect";
+    case ENET_EVENT_TYPE_RECEIVE : return "receive";
+    case ENET_EVENT_TYPE_SHARD_MESSAGE : return "shard_message";
+    case ENET_EVENT_TYPE_WRITABLE : return "writable";
+    case ENET_EVENT_TYPE_CONNECT_READY : return "connect_ready";
+    case ENET_EVENT_TYPE_CONNECT_FAILED : return "connect_failed";
+    case ENET_EVENT_TYPE_REPLAY_DONE : return "replay_done";
+    case ENET_EVENT_TYPE_STREAM_PROGRESS : return "stream_progress";
+    case ENET_EVENT_TYPE_STREAM_COMPLETE : return "stream_complete";
+    case ENET_EVENT_TYPE_STREAM_FAILED : return "stream_failed";
+    case ENET_EVENT_TYPE_STREAM_SENT : return "stream_sent";
+    case ENET_EVENT_TYPE_STREAM_CANCELLED : return "stream_cancelled";
+    default : return "event";
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Orders profile categories by total script time, most first
+////////////////////////////////////////////////////////////
+static bool profile_heavier(const std::pair<unsigned long long, EnetProfileEntry>& left, const std::pair<unsigned long long, EnetProfileEntry>& right)
+{
+    if (left.second.nanoseconds != right.second.nanoseconds) return left.second.nanoseconds > right.second.nanoseconds;
+    return left.first < right.first;
+}
+
+
+////////////////////////////////////////////////////////////
+// Starts or stops timing the script's handling of each event
+//
+// Parameters
+//  enabled : True clears any earlier results and starts profiling, false stops and keeps them for profile_report
+//
+// Time is charged per event type, channel and first payload byte,
+// the usual message opcode. Handlers called by dispatch and run
+// are timed as they return. Events taken with service,
+// check_events or service_batch are only counted unless the
+// script calls profile_done once it has handled them.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_profile(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<bool> enabled(v, 2);
         if (!Sqrat::Error::Occurred(v)) {
-            enet_peer_disconnect_now(left.value, 0);
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (enabled.value) {
+                if (profileCounting == data->profiler) profileCounting = NULL;
+                delete data->profiler;
+                data->profiler = new EnetProfiler();
+            } else if (data->profiler != NULL) {
+                profile_drop(data->profiler);
+                data->profiler->active = false;
+            }
             return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 2) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
-        Sqrat::Var<enet_uint32> data(v, 2);
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Charges the events taken since the last poll with the time and allocations since they were handed over
+//
+// Call after handling what service, check_events or
+// service_batch returned, before doing unrelated work.
+//
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_profile_done(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetHost*> left(v, 1);
         if (!Sqrat::Error::Occurred(v)) {
-            enet_peer_disconnect_now(left.value, data.value);
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (data->profiler != NULL) profile_settle(data->profiler);
             return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
@@ -196,21 +7375,69 @@ static SQInteger enetPeer_disconnect_now(HSQUIRRELVM v)
 
 
 ////////////////////////////////////////////////////////////
-// Returns the index of the peer
+// Returns the most expensive profile categories, or null if the host was never profiled
+//
+// Parameters
+//  count : Number of categories to return, 20 by default and 0 for all of them
+//
+// Each entry has type, channel, opcode, count, timed, seconds,
+// max_seconds, bytes, allocations and allocated_bytes. Timed is
+// how many of the events the seconds and allocations cover. Channel
+// and opcode are null for events that don't carry them.
+//
 ////////////////////////////////////////////////////////////
-static SQInteger enetPeer_index(HSQUIRRELVM v)
+static SQInteger enetHost_profile_report(HSQUIRRELVM v)
 {
-    if (sq_gettop(v) == 1) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
+    SQInteger top = sq_gettop(v);
+    if (top == 1 || top == 2) {
+        Sqrat::Var<ENetHost*> left(v, 1);
         if (!Sqrat::Error::Occurred(v)) {
-            std::size_t peer_index;
-            for (peer_index = 0; peer_index < left.value->host->peerCount; peer_index++) {
-                if (left.value == &(left.value->host->peers[peer_index])) {
-                    Sqrat::PushVar(v, peer_index + 1);
-                    return 1;
-                }
+            SQInteger count = 20;
+            if (top == 2) {
+                Sqrat::Var<SQInteger> limit(v, 2);
+                if (Sqrat::Error::Occurred(v)) return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+                if (limit.value < 0) return sq_throwerror(v, _SC("count must not be negative"));
+                count = limit.value;
             }
-            return sq_throwerror(v, _SC("Could not find peer index"));
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (data->profiler == NULL) {
+                sq_pushnull(v);
+                return 1;
+            }
+            std::vector<std::pair<unsigned long long, EnetProfileEntry> > entries(data->profiler->entries.begin(), data->profiler->entries.end());
+            std::size_t shown = entries.size();
+            if (count > 0 && (std::size_t) count < shown) shown = (std::size_t) count;
+            std::partial_sort(entries.begin(), entries.begin() + shown, entries.end(), profile_heavier);
+            sq_newarray(v, 0);
+            for (std::size_t i = 0; i < shown; i++) {
+                const EnetProfileEntry& entry = entries[i].second;
+                int type = (int) (entries[i].first >> 17);
+                unsigned opcode = (unsigned) (entries[i].first & 0x1FF);
+                sq_newtable(v);
+                push_stat(v, _SC("type"), type);
+                sq_pushstring(v, _SC("channel"), -1);
+                if (profile_has_channel(type)) sq_pushinteger(v, (SQInteger) ((entries[i].first >> 9) & 0xFF));
+                else sq_pushnull(v);
+                sq_newslot(v, -3, false);
+                sq_pushstring(v, _SC("opcode"), -1);
+                if (opcode != PROFILE_NO_OPCODE) sq_pushinteger(v, opcode);
+                else sq_pushnull(v);
+                sq_newslot(v, -3, false);
+                push_stat(v, _SC("count"), (SQInteger) entry.count);
+                push_stat(v, _SC("timed"), (SQInteger) entry.timed);
+                sq_pushstring(v, _SC("seconds"), -1);
+                sq_pushfloat(v, (SQFloat) (entry.nanoseconds / 1e9));
+                sq_newslot(v, -3, false);
+                sq_pushstring(v, _SC("max_seconds"), -1);
+                sq_pushfloat(v, (SQFloat) (entry.maxNanoseconds / 1e9));
+                sq_newslot(v, -3, false);
+                push_stat(v, _SC("bytes"), (SQInteger) entry.bytes);
+                push_stat(v, _SC("allocations"), (SQInteger) entry.allocations);
+                push_stat(v, _SC("allocated_bytes"), (SQInteger) entry.allocatedBytes);
+                sq_arrayappend(v, -2);
+            }
+            return 1;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
     }
@@ -219,47 +7446,47 @@ static SQInteger enetPeer_index(HSQUIRRELVM v)
 
 
 ////////////////////////////////////////////////////////////
-// Queues a packet to be sent
+// Writes the profile as folded stacks for flamegraph.pl and similar tools
+//
+// Parameters
+//  path : File to replace; written beside it first and renamed like write_stats
+//
+// Each line is "type;channel_N;opcode_0xNN microseconds", leaving
+// out the frames an event type doesn't have.
+//
 ////////////////////////////////////////////////////////////
-static SQInteger enetPeer_send(HSQUIRRELVM v)
+static SQInteger enetHost_write_profile(HSQUIRRELVM v)
 {
-    ENetPacket* packet;
     if (sq_gettop(v) == 2) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
-        Sqrat::Var<const std::string&> data(v, 2);
+        Sqrat::Var<ENetHost*> left(v, 1);
+        Sqrat::Var<std::string> path(v, 2);
         if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = read_packet(v, packet, data.value, ENET_PACKET_FLAG_RELIABLE);
-            if (SQ_FAILED(result)) {
-                return result;
+            EnetHostData* data = get_host_data(left.value);
+            if (data == NULL) return sq_throwerror(v, _SC("Host was not made by host_create"));
+            if (data->profiler == NULL) return sq_throwerror(v, _SC("Host has not been profiled"));
+            std::string temp = path.value + ".tmp";
+            FILE* file = std::fopen(temp.c_str(), "w");
+            if (file == NULL) return sq_throwerror(v, _SC("Failed to open profile file"));
+            for (std::unordered_map<unsigned long long, EnetProfileEntry>::const_iterator it = data->profiler->entries.begin(); it != data->profiler->entries.end(); ++it) {
+                int type = (int) (it->first >> 17);
+                unsigned opcode = (unsigned) (it->first & 0x1FF);
+                std::fputs(event_type_name(type), file);
+                if (profile_has_channel(type)) std::fprintf(file, ";channel_%u", (unsigned) ((it->first >> 9) & 0xFF));
+                if (opcode != PROFILE_NO_OPCODE) std::fprintf(file, ";opcode_0x%02x", opcode);
+                std::fprintf(file, " %llu\n", it->second.nanoseconds / 1000);
             }
-            enet_peer_send(left.value, 0, packet);
-            return 0;
-        }
-        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 3) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
-        Sqrat::Var<const std::string&> data(v, 2);
-        Sqrat::Var<enet_uint8> channel_id(v, 3);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = read_packet(v, packet, data.value, ENET_PACKET_FLAG_RELIABLE);
-            if (SQ_FAILED(result)) {
-                return result;
+            bool failed = std::ferror(file) != 0;
+            if (std::fclose(file) != 0 || failed) {
+                std::remove(temp.c_str());
+                return sq_throwerror(v, _SC("Failed to write profile file"));
             }
-            enet_peer_send(left.value, channel_id.value, packet);
-            return 0;
-        }
-        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 4) {
-        Sqrat::Var<ENetPeer*> left(v, 1);
-        Sqrat::Var<const std::string&> data(v, 2);
-        Sqrat::Var<enet_uint8> channel_id(v, 3);
-        Sqrat::Var<enet_uint32> flag(v, 4);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = read_packet(v, packet, data.value, flag.value);
-            if (SQ_FAILED(result)) {
-                return result;
+#ifdef _WIN32
+            std::remove(path.value.c_str());
+#endif
+            if (std::rename(temp.c_str(), path.value.c_str()) != 0) {
+                std::remove(temp.c_str());
+                return sq_throwerror(v, _SC("Failed to replace profile file"));
             }
-            enet_peer_send(left.value, channel_id.value, packet);
             return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
@@ -269,180 +7496,276 @@ static SQInteger enetPeer_send(HSQUIRRELVM v)
 
 
 ////////////////////////////////////////////////////////////
-// Returns the downstream bandwidth of the client in bytes/second
+// Adjusts the bandwidth limits of a host in bytes/second
 ////////////////////////////////////////////////////////////
-static enet_uint32 enetPeer_incoming_bandwidth(ENetPeer* left)
+static void enetHost_bandwidth_limit(ENetHost* left, enet_uint32 incomingBandwidth, enet_uint32 outgoingBandwidth)
 {
-    return left->incomingBandwidth;
+    EnetHostLock lock(left);
+    enet_host_bandwidth_limit(left, incomingBandwidth, outgoingBandwidth);
 }
 
 
 ////////////////////////////////////////////////////////////
-// Returns the upstream bandwidth of the client in bytes/second
+// Moves servicing of the host onto a dedicated network thread
+//
+// Parameters
+//  interval : Longest time in milliseconds the thread waits on the socket (default 1)
+//  capacity : Size of the event and send queues (default 4096)
+//
 ////////////////////////////////////////////////////////////
-static enet_uint32 enetPeer_outgoing_bandwidth(ENetPeer* left)
+static SQInteger enetHost_start_thread(HSQUIRRELVM v)
 {
-    return left->outgoingBandwidth;
+    SQInteger top = sq_gettop(v);
+    enet_uint32 interval = 1;
+    std::size_t capacity = 4096;
+    if (top < 1 || top > 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (top >= 2) {
+        Sqrat::Var<enet_uint32> interval_ms(v, 2);
+        interval = interval_ms.value;
+    }
+    if (top == 3) {
+        Sqrat::Var<std::size_t> size(v, 3);
+        capacity = size.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    EnetHostData* data = get_host_data(left.value);
+    if (data == NULL) return sq_throwerror(v, _SC("Host was not created by host_create"));
+    if (data->thread != NULL) return sq_throwerror(v, _SC("Host is already serviced by a network thread"));
+    if (capacity == 0) return sq_throwerror(v, _SC("Queue capacity must be positive"));
+    data->thread = new EnetHostThread(left.value, capacity, interval);
+    data->thread->thread = std::thread(host_thread_main, data->thread);
+    return 0;
 }
 
 
 ////////////////////////////////////////////////////////////
-// Returns the mean packet loss of reliable packets as a percentage
+// Returns servicing of the host to the VM thread
+////////////////////////////////////////////////////////////
+static SQInteger enetHost_stop_thread(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        Sqrat::Var<ENetHost*> left(v, 1);
+        if (!Sqrat::Error::Occurred(v)) {
+            EnetHostData* data = get_host_data(left.value);
+            if (data != NULL && data->thread != NULL && data->thread->shards != NULL) {
+                return sq_throwerror(v, _SC("Shard hosts always run on their network thread"));
+            }
+            if (data != NULL) stop_host_thread(data);
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+static void destroy_host(ENetHost* host)
+{
+    EnetHostData* data = get_host_data(host);
+    if (data != NULL) {
+        stop_host_thread(data);
+        for (std::size_t i = 0; i < data->backlog.size(); i++) {
+            ENetPacket* packet = data->backlog[i].packet;
+            if (packet == NULL) continue;
+            if (data->backlog[i].shared) --packet->referenceCount;
+            if (packet->referenceCount == 0) enet_packet_destroy(packet);
+        }
+        delete data;
+    }
+    enet_host_destroy(host);
+}
+
+
 ////////////////////////////////////////////////////////////
-static enet_uint32 enetPeer_packet_loss(ENetPeer* left)
+// Returns the shard group of a host, or NULL if it is not a shard
+////////////////////////////////////////////////////////////
+static EnetHostThread* get_shard_thread(ENetHost* host)
 {
-    return left->packetLoss / (float) ENET_PEER_PACKET_LOSS_SCALE;
+    EnetHostData* data = get_host_data(host);
+    if (data == NULL || data->thread == NULL || data->thread->shards == NULL) return NULL;
+    return data->thread;
 }
 
 
 ////////////////////////////////////////////////////////////
-// Returns the current round trip time (i.e. ping)
+// Posts a message, with its packet reference already counted, to another shard
 ////////////////////////////////////////////////////////////
-static enet_uint32 enetPeer_round_trip_time(ENetPeer* left)
+static void shard_send(EnetHostThread* from, std::size_t to, const EnetShardMessage& message)
 {
-    return left->roundTripTime;
+    EnetShardGroup* group = from->shards;
+    if (!group->mailboxes[from->shardIndex * group->hosts.size() + to]->push(message)) {
+        // The target is behind, so deliver under its lock after whatever is already waiting
+        EnetHostThread* target = get_host_data(group->hosts[to])->thread;
+        std::lock_guard<std::mutex> guard(target->lock);
+        drain_shard_mail(target);
+        run_shard_message(target, message);
+    }
 }
 
 
 ////////////////////////////////////////////////////////////
-// Constructor
+// Reads the payload argument of a shard call into a packet the target shard can own
 ////////////////////////////////////////////////////////////
-static SQInteger enetHost_constructor(HSQUIRRELVM v)
+static SQInteger read_shard_packet(HSQUIRRELVM v, SQInteger idx, ENetHost* host, ENetPacket*& packet, enet_uint32 flag, bool forPeers)
 {
-    return sq_throwerror(v, _SC("constructor is protected"));
+    SQInteger result = forPeers ? read_send_packet(v, idx, get_host_data(host), packet, flag) : read_packet(v, idx, get_host_data(host), packet, flag);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    packet = private_packet(packet);
+    if (packet == NULL) {
+        return sq_throwerror(v, _SC("Failed to create packet"));
+    }
+    return 0;
 }
 
 
 ////////////////////////////////////////////////////////////
-// Queues a packet to be sent to all peers associated with the host
+// Queues a packet for a peer owned by any shard of the group
+//
+// Parameters
+//  shard   : Index of the shard owning the peer
+//  peer_id : Stable ID of the peer (Peer.id on that shard)
+//  data    : String, table, array or enet.Packet to send
+//  channel : Channel to send on (default 0)
+//  flag    : Packet flag (default reliable)
+//
 ////////////////////////////////////////////////////////////
-static SQInteger enetHost_broadcast(HSQUIRRELVM v)
+static SQInteger enetHost_forward(HSQUIRRELVM v)
 {
-    ENetPacket* packet;
-    if (sq_gettop(v) == 2) {
-        Sqrat::Var<ENetHost*> left(v, 1);
-        Sqrat::Var<const std::string&> data(v, 2);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = read_packet(v, packet, data.value, ENET_PACKET_FLAG_RELIABLE);
-            if (SQ_FAILED(result)) {
-                return result;
-            }
-            enet_host_broadcast(left.value, 0, packet);
-            return 0;
-        }
-        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 3) {
-        Sqrat::Var<ENetHost*> left(v, 1);
-        Sqrat::Var<const std::string&> data(v, 2);
-        Sqrat::Var<enet_uint8> channel_id(v, 3);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = read_packet(v, packet, data.value, ENET_PACKET_FLAG_RELIABLE);
-            if (SQ_FAILED(result)) {
-                return result;
-            }
-            enet_host_broadcast(left.value, channel_id.value, packet);
-            return 0;
-        }
-        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 4) {
-        Sqrat::Var<ENetHost*> left(v, 1);
-        Sqrat::Var<const std::string&> data(v, 2);
-        Sqrat::Var<enet_uint8> channel_id(v, 3);
-        Sqrat::Var<enet_uint32> flag(v, 4);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = read_packet(v, packet, data.value, flag.value);
-            if (SQ_FAILED(result)) {
-                return result;
-            }
-            enet_host_broadcast(left.value, channel_id.value, packet);
-            return 0;
-        }
+    SQInteger top = sq_gettop(v);
+    enet_uint8 channel_id = 0;
+    enet_uint32 flag = PACKET_FLAG_DEFAULT;
+    if (top < 4 || top > 6) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    Sqrat::Var<std::size_t> shard(v, 2);
+    Sqrat::Var<SQInteger> peer_id(v, 3);
+    if (top >= 5) {
+        Sqrat::Var<enet_uint8> channel(v, 5);
+        channel_id = channel.value;
+    }
+    if (top == 6) {
+        Sqrat::Var<enet_uint32> flags(v, 6);
+        flag = flags.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
     }
-    return sq_throwerror(v, _SC("wrong number of parameters"));
+    EnetHostThread* thread = get_shard_thread(left.value);
+    if (thread == NULL) return sq_throwerror(v, _SC("Host is not a shard"));
+    if (shard.value >= thread->shards->hosts.size()) return sq_throwerror(v, _SC("Shard index out of range"));
+    ENetPacket* packet;
+    SQInteger result = read_shard_packet(v, 4, left.value, packet, flag, true);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+    EnetShardMessage message;
+    message.type = SHARD_FORWARD;
+    message.from = thread->shardIndex;
+    message.peerID = peer_id.value;
+    message.channelID = channel_id;
+    message.packet = packet;
+    ++packet->referenceCount;
+    if (shard.value == thread->shardIndex) {
+        std::lock_guard<std::mutex> guard(thread->lock);
+        run_shard_message(thread, message);
+    } else {
+        shard_send(thread, shard.value, message);
+    }
+    return 0;
 }
 
 
 ////////////////////////////////////////////////////////////
-// Checks for any queued events on the host and dispatches one if available
+// Queues a packet for every peer of every shard of the group
 ////////////////////////////////////////////////////////////
-static SQInteger enetHost_check_events(HSQUIRRELVM v)
+static SQInteger enetHost_broadcast_shards(HSQUIRRELVM v)
 {
-    if (sq_gettop(v) == 1) {
-        Sqrat::Var<ENetHost*> left(v, 1);
-        if (!Sqrat::Error::Occurred(v)) {
-            ENetEvent event;
-            int out = enet_host_check_events(left.value, &event);
-            if (out == 0) {
-                sq_pushnull(v);
-                return 1;
-            }
-            if (out < 0) return sq_throwerror(v, _SC("Error checking network event"));
-            push_event(v, event);
-            return 1;
-        }
+    SQInteger top = sq_gettop(v);
+    enet_uint8 channel_id = 0;
+    enet_uint32 flag = PACKET_FLAG_DEFAULT;
+    if (top < 2 || top > 4) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    Sqrat::Var<ENetHost*> left(v, 1);
+    if (top >= 3) {
+        Sqrat::Var<enet_uint8> channel(v, 3);
+        channel_id = channel.value;
+    }
+    if (top == 4) {
+        Sqrat::Var<enet_uint32> flags(v, 4);
+        flag = flags.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
     }
-    return sq_throwerror(v, _SC("wrong number of parameters"));
+    EnetHostThread* thread = get_shard_thread(left.value);
+    if (thread == NULL) return sq_throwerror(v, _SC("Host is not a shard"));
+    ENetPacket* packet;
+    SQInteger result = read_shard_packet(v, 2, left.value, packet, flag, true);
+    if (SQ_FAILED(result)) {
+        return result;
+    }
+
+    // Count every shard's reference before the first one can be released
+    std::size_t count = thread->shards->hosts.size();
+    packet->referenceCount += count;
+    EnetShardMessage message;
+    message.type = SHARD_BROADCAST;
+    message.from = thread->shardIndex;
+    message.peerID = 0;
+    message.channelID = channel_id;
+    message.packet = packet;
+    for (std::size_t to = 0; to < count; to++) {
+        if (to == thread->shardIndex) {
+            queue_send(thread, NULL, channel_id, packet);
+        } else {
+            shard_send(thread, to, message);
+        }
+    }
+    return 0;
 }
 
 
 ////////////////////////////////////////////////////////////
-// Initiates a connection to a foreign host
+// Delivers data to the scripts of another shard as an ENET_EVENT_TYPE_SHARD_MESSAGE event
 ////////////////////////////////////////////////////////////
-static SQInteger enetHost_connect(HSQUIRRELVM v)
+static SQInteger enetHost_post(HSQUIRRELVM v)
 {
-    ENetAddress address;
-    ENetPeer* peer;
-    if (sq_gettop(v) == 2) {
-        Sqrat::Var<ENetHost*> left(v, 1);
-        Sqrat::Var<const std::string&> addr_str(v, 2);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = parse_address(v, addr_str.value, address);
-            if (SQ_FAILED(result)) {
-                return result;
-            }
-            peer = enet_host_connect(left.value, &address, 1, 0);
-            if (peer == NULL) {
-                return sq_throwerror(v, _SC("Failed to create peer"));
-            }
-            Sqrat::PushVar(v, peer);
-            return 1;
-        }
-        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 3) {
+    if (sq_gettop(v) == 3) {
         Sqrat::Var<ENetHost*> left(v, 1);
-        Sqrat::Var<const std::string&> addr_str(v, 2);
-        Sqrat::Var<size_t> channelCount(v, 3);
-        if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = parse_address(v, addr_str.value, address);
-            if (SQ_FAILED(result)) {
-                return result;
-            }
-            peer = enet_host_connect(left.value, &address, channelCount.value, 0);
-            if (peer == NULL) {
-                return sq_throwerror(v, _SC("Failed to create peer"));
-            }
-            Sqrat::PushVar(v, peer);
-            return 1;
-        }
-        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
-    } else if (sq_gettop(v) == 4) {
-        Sqrat::Var<ENetHost*> left(v, 1);
-        Sqrat::Var<const std::string&> addr_str(v, 2);
-        Sqrat::Var<size_t> channelCount(v, 3);
-        Sqrat::Var<enet_uint32> data(v, 4);
+        Sqrat::Var<std::size_t> shard(v, 2);
         if (!Sqrat::Error::Occurred(v)) {
-            SQInteger result = parse_address(v, addr_str.value, address);
+            EnetHostThread* thread = get_shard_thread(left.value);
+            if (thread == NULL) return sq_throwerror(v, _SC("Host is not a shard"));
+            if (shard.value >= thread->shards->hosts.size()) return sq_throwerror(v, _SC("Shard index out of range"));
+            ENetPacket* packet;
+            SQInteger result = read_shard_packet(v, 3, left.value, packet, PACKET_FLAG_DEFAULT, false);
             if (SQ_FAILED(result)) {
                 return result;
             }
-            peer = enet_host_connect(left.value, &address, channelCount.value, data.value);
-            if (peer == NULL) {
-                return sq_throwerror(v, _SC("Failed to create peer"));
+            EnetShardMessage message;
+            message.type = SHARD_POST;
+            message.from = thread->shardIndex;
+            message.peerID = 0;
+            message.channelID = 0;
+            message.packet = packet;
+            ++packet->referenceCount;
+            if (shard.value == thread->shardIndex) {
+                std::lock_guard<std::mutex> guard(thread->lock);
+                run_shard_message(thread, message);
+            } else {
+                shard_send(thread, shard.value, message);
             }
-            Sqrat::PushVar(v, peer);
-            return 1;
+            return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
     }
@@ -451,22 +7774,25 @@ static SQInteger enetHost_connect(HSQUIRRELVM v)
 
 
 ////////////////////////////////////////////////////////////
-// Waits for events on the host specified and shuttles packets between the host and its peers
+// Destroys the host and releases its binding state
 ////////////////////////////////////////////////////////////
-static SQInteger enetHost_service(HSQUIRRELVM v)
+static SQInteger enetHost_destroy(HSQUIRRELVM v)
 {
     if (sq_gettop(v) == 1) {
         Sqrat::Var<ENetHost*> left(v, 1);
         if (!Sqrat::Error::Occurred(v)) {
-            ENetEvent event;
-            int out = enet_host_service(left.value, &event, 0);
-            if (out == 0) {
-                sq_pushnull(v);
-                return 1;
+            EnetHostData* data = get_host_data(left.value);
+            if (data != NULL && data->thread != NULL && data->thread->shards != NULL) {
+                return sq_throwerror(v, _SC("Shard hosts are destroyed with their group"));
             }
-            if (out < 0) return sq_throwerror(v, _SC("Error during network servicing"));
-            push_event(v, event);
-            return 1;
+            if (data != NULL && data->running) {
+                return sq_throwerror(v, _SC("Host is running; return false from the tick function first"));
+            }
+            if (data != NULL && data->dispatching > 0) {
+                return sq_throwerror(v, _SC("Host is dispatching events; destroy it after dispatch returns"));
+            }
+            destroy_host(left.value);
+            return 0;
         }
         return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
     }
@@ -474,18 +7800,6 @@ static SQInteger enetHost_service(HSQUIRRELVM v)
 }
 
 
-////////////////////////////////////////////////////////////
-// Enables an adaptive order-2 PPM range coder for the transmitted data of all peers
-////////////////////////////////////////////////////////////
-static bool enetHost_compress_with_range_coder(ENetHost* left)
-{
-    if (enet_host_compress_with_range_coder(left) == 0) {
-        return true;
-    }
-    return false;
-}
-
-
 ////////////////////////////////////////////////////////////
 // Returns a new host for communicating to peers
 ////////////////////////////////////////////////////////////
@@ -508,6 +7822,7 @@ static SQInteger host_create(HSQUIRRELVM v)
                 sq_pushnull(v);
                 return 1;
             }
+            attach_host_data(v, host);
             Sqrat::PushVar(v, host);
             return 1;
         }
@@ -528,6 +7843,7 @@ static SQInteger host_create(HSQUIRRELVM v)
                 sq_pushnull(v);
                 return 1;
             }
+            attach_host_data(v, host);
             Sqrat::PushVar(v, host);
             return 1;
         }
@@ -549,6 +7865,7 @@ static SQInteger host_create(HSQUIRRELVM v)
                 sq_pushnull(v);
                 return 1;
             }
+            attach_host_data(v, host);
             Sqrat::PushVar(v, host);
             return 1;
         }
@@ -571,6 +7888,7 @@ static SQInteger host_create(HSQUIRRELVM v)
                 sq_pushnull(v);
                 return 1;
             }
+            attach_host_data(v, host);
             Sqrat::PushVar(v, host);
             return 1;
         }
@@ -594,6 +7912,7 @@ static SQInteger host_create(HSQUIRRELVM v)
                 sq_pushnull(v);
                 return 1;
             }
+            attach_host_data(v, host);
             Sqrat::PushVar(v, host);
             return 1;
         }
@@ -603,6 +7922,220 @@ static SQInteger host_create(HSQUIRRELVM v)
 }
 
 
+////////////////////////////////////////////////////////////
+// Creates a host bound to 127.0.0.1 on a free port, for tests and benchmarks
+//
+// Parameters
+//  peer_count    : Maximum number of peers (default 64)
+//  channel_limit : Maximum number of channels per peer (default 1)
+//
+// Returns null on failure. Connect to it with the string
+// from Host.address; clients created by host_create(null)
+// or loopback_create both work, and Host.impair adds
+// latency, jitter, loss and bandwidth limits.
+//
+// Traffic still crosses a real UDP socket and runs on the
+// wall clock. ENet 1.3 sends through enet_socket_send with no
+// hook to replace it, and enet_time_set only rebases the one
+// clock every host in the process shares.
+//
+////////////////////////////////////////////////////////////
+static SQInteger loopback_create(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    std::size_t peer_count = 64;
+    std::size_t channel_limit = 1;
+    if (top > 3) {
+        return sq_throwerror(v, _SC("wrong number of parameters"));
+    }
+    if (top >= 2) {
+        Sqrat::Var<std::size_t> peerCount(v, 2);
+        peer_count = peerCount.value;
+    }
+    if (top == 3) {
+        Sqrat::Var<std::size_t> channelLimit(v, 3);
+        channel_limit = channelLimit.value;
+    }
+    if (Sqrat::Error::Occurred(v)) {
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    ENetAddress address;
+    address.host = ENET_HOST_TO_NET_32(0x7F000001);
+    address.port = ENET_PORT_ANY;
+    ENetHost* host = enet_host_create(&address, peer_count, channel_limit, 0, 0);
+    if (host == NULL) {
+        wr::Print(v, "Failed to create loopback host\n");
+        sq_pushnull(v);
+        return 1;
+    }
+    attach_host_data(v, host);
+    Sqrat::PushVar(v, host);
+    return 1;
+}
+
+
+////////////////////////////////////////////////////////////
+// Pooled allocator handed to ENet by InitializeEnetLib
+////////////////////////////////////////////////////////////
+static const std::size_t POOL_CLASSES = 8;     // 32 bytes up to 4 KiB, doubling each class
+static const std::size_t POOL_MIN_BLOCK = 32;
+static const std::size_t POOL_MAX_FREE = 1024; // Blocks kept per class; the rest go back to the system
+static const std::size_t POOL_HEADER = 16;     // Holds the class index and keeps payloads as aligned as malloc's
+
+
+////////////////////////////////////////////////////////////
+// Free list and counters for one block size
+////////////////////////////////////////////////////////////
+struct EnetPoolClass
+{
+    EnetPoolClass() : free(NULL), freeCount(0), hits(0), misses(0), inUse(0), highWater(0) {}
+
+    std::mutex lock;
+    void* free;                 // Linked through the first word of each block
+    std::size_t freeCount;
+    unsigned long long hits;    // Served from the free list
+    unsigned long long misses;  // Had to go to the system
+    std::size_t inUse;
+    std::size_t highWater;      // Most blocks in use at once
+};
+
+static EnetPoolClass poolClasses[POOL_CLASSES];
+static std::atomic<unsigned long long> poolOversize(0);
+static bool poolInstalled = false;
+
+
+////////////////////////////////////////////////////////////
+static void* ENET_CALLBACK pool_malloc(size_t size)
+{
+    std::size_t index = 0;
+    std::size_t block = POOL_MIN_BLOCK;
+    while (index < POOL_CLASSES && block < size) {
+        index++;
+        block <<= 1;
+    }
+    unsigned char* memory = NULL;
+    if (index == POOL_CLASSES) {
+        // Too big to be worth keeping; ENet only does this for large packets
+        memory = static_cast<unsigned char*>(std::malloc(size + POOL_HEADER));
+        if (memory == NULL) return NULL;
+        poolOversize++;
+    } else {
+        EnetPoolClass& pool = poolClasses[index];
+        {
+            std::lock_guard<std::mutex> guard(pool.lock);
+            if (pool.free != NULL) {
+                memory = static_cast<unsigned char*>(pool.free);
+                pool.free = *reinterpret_cast<void**>(memory);
+                pool.freeCount--;
+                pool.hits++;
+            } else {
+                pool.misses++;
+            }
+            pool.inUse++;
+            if (pool.inUse > pool.highWater) pool.highWater = pool.inUse;
+        }
+        if (memory == NULL) {
+            memory = static_cast<unsigned char*>(std::malloc(block + POOL_HEADER));
+            if (memory == NULL) {
+                std::lock_guard<std::mutex> guard(pool.lock);
+                pool.inUse--;
+                return NULL;
+            }
+        }
+    }
+    *reinterpret_cast<std::size_t*>(memory) = index;
+    return memory + POOL_HEADER;
+}
+
+
+////////////////////////////////////////////////////////////
+static void ENET_CALLBACK pool_free(void* pointer)
+{
+    if (pointer == NULL) return;
+    unsigned char* memory = static_cast<unsigned char*>(pointer) - POOL_HEADER;
+    std::size_t index = *reinterpret_cast<std::size_t*>(memory);
+    if (index < POOL_CLASSES) {
+        EnetPoolClass& pool = poolClasses[index];
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.inUse--;
+        if (pool.freeCount < POOL_MAX_FREE) {
+            *reinterpret_cast<void**>(memory) = pool.free;
+            pool.free = memory;
+            pool.freeCount++;
+            return;
+        }
+    }
+    std::free(memory);
+}
+
+
+////////////////////////////////////////////////////////////
+// Returns the allocator's counters, or null if InitializeEnetLib didn't install it
+//
+// The table holds "oversize", the number of allocations too
+// big for any class, and "classes", an array with one table
+// per block size: size, hits, misses, in_use, high_water, free.
+//
+////////////////////////////////////////////////////////////
+static SQInteger allocator_stats(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 1) {
+        if (!poolInstalled) {
+            sq_pushnull(v);
+            return 1;
+        }
+        sq_newtable(v);
+        push_stat(v, _SC("oversize"), (SQInteger) poolOversize.load());
+        sq_pushstring(v, _SC("classes"), -1);
+        sq_newarray(v, 0);
+        for (std::size_t i = 0; i < POOL_CLASSES; i++) {
+            EnetPoolClass& pool = poolClasses[i];
+            unsigned long long hits, misses;
+            std::size_t inUse, highWater, freeCount;
+            {
+                std::lock_guard<std::mutex> guard(pool.lock);
+                hits = pool.hits;
+                misses = pool.misses;
+                inUse = pool.inUse;
+                highWater = pool.highWater;
+                freeCount = pool.freeCount;
+            }
+            sq_newtable(v);
+            push_stat(v, _SC("size"), (SQInteger) (POOL_MIN_BLOCK << i));
+            push_stat(v, _SC("hits"), (SQInteger) hits);
+            push_stat(v, _SC("misses"), (SQInteger) misses);
+            push_stat(v, _SC("in_use"), (SQInteger) inUse);
+            push_stat(v, _SC("high_water"), (SQInteger) highWater);
+            push_stat(v, _SC("free"), (SQInteger) freeCount);
+            sq_arrayappend(v, -2);
+        }
+        sq_newslot(v, -3, false);
+        return 1;
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
+////////////////////////////////////////////////////////////
+// Sets how many seconds resolved host names are remembered, 0 to stop caching
+////////////////////////////////////////////////////////////
+static SQInteger resolve_ttl(HSQUIRRELVM v)
+{
+    if (sq_gettop(v) == 2) {
+        Sqrat::Var<SQFloat> seconds(v, 2);
+        if (!Sqrat::Error::Occurred(v)) {
+            if (!(seconds.value >= 0)) return sq_throwerror(v, _SC("TTL must not be negative"));
+            std::lock_guard<std::mutex> guard(addressCache.lock);
+            addressCache.ttl = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds.value));
+            addressCache.entries.clear();
+            return 0;
+        }
+        return sq_throwerror(v, Sqrat::Error::Message(v).c_str());
+    }
+    return sq_throwerror(v, _SC("wrong number of parameters"));
+}
+
+
 ////////////////////////////////////////////////////////////
 // Initializes and registers the ENet library in the given VM
 ////////////////////////////////////////////////////////////
@@ -613,37 +8146,244 @@ void RegisterEnetLib(HSQUIRRELVM v, Sqrat::Table& namespaceTable)
     constTable.Const(_SC("ENET_EVENT_TYPE_DISCONNECT"), static_cast<int>(ENET_EVENT_TYPE_DISCONNECT));
     constTable.Const(_SC("ENET_EVENT_TYPE_RECEIVE"), static_cast<int>(ENET_EVENT_TYPE_RECEIVE));
     constTable.Const(_SC("ENET_EVENT_TYPE_NONE"), static_cast<int>(ENET_EVENT_TYPE_NONE));
+    constTable.Const(_SC("ENET_EVENT_TYPE_SHARD_MESSAGE"), static_cast<int>(ENET_EVENT_TYPE_SHARD_MESSAGE));
+    constTable.Const(_SC("ENET_EVENT_TYPE_WRITABLE"), static_cast<int>(ENET_EVENT_TYPE_WRITABLE));
+    constTable.Const(_SC("ENET_EVENT_TYPE_CONNECT_READY"), static_cast<int>(ENET_EVENT_TYPE_CONNECT_READY));
+    constTable.Const(_SC("ENET_EVENT_TYPE_CONNECT_FAILED"), static_cast<int>(ENET_EVENT_TYPE_CONNECT_FAILED));
+    constTable.Const(_SC("ENET_EVENT_TYPE_REPLAY_DONE"), static_cast<int>(ENET_EVENT_TYPE_REPLAY_DONE));
+    constTable.Const(_SC("ENET_EVENT_TYPE_STREAM_PROGRESS"), static_cast<int>(ENET_EVENT_TYPE_STREAM_PROGRESS));
+    constTable.Const(_SC("ENET_EVENT_TYPE_STREAM_COMPLETE"), static_cast<int>(ENET_EVENT_TYPE_STREAM_COMPLETE));
+    constTable.Const(_SC("ENET_EVENT_TYPE_STREAM_FAILED"), static_cast<int>(ENET_EVENT_TYPE_STREAM_FAILED));
+    constTable.Const(_SC("ENET_EVENT_TYPE_STREAM_SENT"), static_cast<int>(ENET_EVENT_TYPE_STREAM_SENT));
+    constTable.Const(_SC("ENET_EVENT_TYPE_STREAM_CANCELLED"), static_cast<int>(ENET_EVENT_TYPE_STREAM_CANCELLED));
+    constTable.Const(_SC("ENET_DISCONNECT_FLOOD"), static_cast<int>(ENET_DISCONNECT_FLOOD));
     constTable.Const(_SC("ENET_PACKET_FLAG_RELIABLE"), static_cast<int>(ENET_PACKET_FLAG_RELIABLE));
     constTable.Const(_SC("ENET_PACKET_FLAG_UNSEQUENCED"), static_cast<int>(ENET_PACKET_FLAG_UNSEQUENCED));
     constTable.Const(_SC("ENET_PACKET_FLAG_UNRELIABLE"), 0);
+    constTable.Const(_SC("ENET_RECEIVE_STRING"), static_cast<int>(ENET_RECEIVE_STRING));
+    constTable.Const(_SC("ENET_RECEIVE_PACKET"), static_cast<int>(ENET_RECEIVE_PACKET));
+    constTable.Const(_SC("ENET_RECEIVE_DECODED"), static_cast<int>(ENET_RECEIVE_DECODED));
+
+    Sqrat::Class<EnetPacketBuffer> enetPacket(v, _SC("enet.Packet"));
+    enetPacket.Ctor();
+    enetPacket.Ctor<std::size_t>();
+    enetPacket.Ctor<std::size_t, enet_uint32>();
+    enetPacket.SquirrelFunc(_SC("read_f32"), &enetPacket_read_f32);
+    enetPacket.SquirrelFunc(_SC("read_string"), &enetPacket_read_string);
+    enetPacket.SquirrelFunc(_SC("read_u16"), &enetPacket_read_u16);
+    enetPacket.SquirrelFunc(_SC("read_u32"), &enetPacket_read_u32);
+    enetPacket.SquirrelFunc(_SC("read_u8"), &enetPacket_read_u8);
+    enetPacket.SquirrelFunc(_SC("read_value"), &enetPacket_read_value);
+    enetPacket.SquirrelFunc(_SC("read_varint"), &enetPacket_read_varint);
+    enetPacket.SquirrelFunc(_SC("seek"), &enetPacket_seek);
+    enetPacket.SquirrelFunc(_SC("write_f32"), &enetPacket_write_f32);
+    enetPacket.SquirrelFunc(_SC("write_string"), &enetPacket_write_string);
+    enetPacket.SquirrelFunc(_SC("write_u16"), &enetPacket_write_u16);
+    enetPacket.SquirrelFunc(_SC("write_u32"), &enetPacket_write_u32);
+    enetPacket.SquirrelFunc(_SC("write_u8"), &enetPacket_write_u8);
+    enetPacket.SquirrelFunc(_SC("write_value"), &enetPacket_write_value);
+    enetPacket.SquirrelFunc(_SC("write_varint"), &enetPacket_write_varint);
+    enetPacket.GlobalFunc(_SC("len"), &enetPacket_len);
+    enetPacket.GlobalFunc(_SC("remaining"), &enetPacket_remaining);
+    enetPacket.GlobalFunc(_SC("tell"), &enetPacket_tell);
 
     Sqrat::Class<ENetPeer, Sqrat::NoConstructor<ENetPeer> > enetPeer(v, _SC("enet.Peer"));
     enetPeer.SquirrelFunc(_SC("constructor"), &enetPeer_constructor);
+    enetPeer.SquirrelFunc(_SC("cancel_stream"), &enetPeer_cancel_stream);
+    enetPeer.SquirrelFunc(_SC("clear_position"), &enetPeer_clear_position);
     enetPeer.SquirrelFunc(_SC("disconnect"), &enetPeer_disconnect);
     enetPeer.SquirrelFunc(_SC("disconnect_later"), &enetPeer_disconnect_later);
     enetPeer.SquirrelFunc(_SC("disconnect_now"), &enetPeer_disconnect_now);
-    enetPeer.SquirrelFunc(_SC("index"), &enetPeer_index);
+    enetPeer.SquirrelFunc(_SC("id"), &enetPeer_id);
     enetPeer.SquirrelFunc(_SC("send"), &enetPeer_send);
+    enetPeer.SquirrelFunc(_SC("send_file"), &enetPeer_send_file);
+    enetPeer.SquirrelFunc(_SC("send_snapshot"), &enetPeer_send_snapshot);
+    enetPeer.SquirrelFunc(_SC("send_stream"), &enetPeer_send_stream);
+    enetPeer.SquirrelFunc(_SC("set_position"), &enetPeer_set_position);
+    enetPeer.SquirrelFunc(_SC("set_send_limit"), &enetPeer_set_send_limit);
+    enetPeer.SquirrelFunc(_SC("set_userdata"), &enetPeer_set_userdata);
+    enetPeer.SquirrelFunc(_SC("stats"), &enetPeer_stats);
+    enetPeer.SquirrelFunc(_SC("userdata"), &enetPeer_userdata);
     enetPeer.GlobalFunc(_SC("destroy"), &enet_host_destroy);
     enetPeer.GlobalFunc(_SC("incoming_bandwidth"), &enetPeer_incoming_bandwidth);
+    enetPeer.GlobalFunc(_SC("index"), &enetPeer_index);
     enetPeer.GlobalFunc(_SC("outgoing_bandwidth"), &enetPeer_outgoing_bandwidth);
     enetPeer.GlobalFunc(_SC("packet_loss"), &enetPeer_packet_loss);
-    enetPeer.GlobalFunc(_SC("ping"), &enet_peer_ping);
-    enetPeer.GlobalFunc(_SC("ping_interval"), &enet_peer_ping_interval);
-    enetPeer.GlobalFunc(_SC("reset"), &enet_peer_reset);
+    enetPeer.GlobalFunc(_SC("ping"), &enetPeer_ping);
+    enetPeer.GlobalFunc(_SC("ping_interval"), &enetPeer_ping_interval);
+    enetPeer.GlobalFunc(_SC("queued_bytes"), &enetPeer_queued_bytes);
+    enetPeer.GlobalFunc(_SC("reliable_data_in_transit"), &enetPeer_reliable_data_in_transit);
+    enetPeer.GlobalFunc(_SC("reset"), &enetPeer_reset);
     enetPeer.GlobalFunc(_SC("round_trip_time"), &enetPeer_round_trip_time);
-    enetPeer.GlobalFunc(_SC("throttle_configure"), &enet_peer_throttle_configure);
-    enetPeer.GlobalFunc(_SC("timeout"), &enet_peer_timeout);
+    enetPeer.GlobalFunc(_SC("throttle_configure"), &enetPeer_throttle_configure);
+    enetPeer.GlobalFunc(_SC("timeout"), &enetPeer_timeout);
+    enetPeer.GlobalFunc(_SC("window_size"), &enetPeer_window_size);
 
     Sqrat::Class<ENetHost, Sqrat::NoConstructor<ENetHost> > enetHost(v, _SC("enet.Host"));
     enetHost.SquirrelFunc(_SC("constructor"), &enetHost_constructor);
+    enetHost.SquirrelFunc(_SC("address"), &enetHost_address);
     enetHost.SquirrelFunc(_SC("broadcast"), &enetHost_broadcast);
+    enetHost.SquirrelFunc(_SC("broadcast_near"), &enetHost_broadcast_near);
+    enetHost.SquirrelFunc(_SC("broadcast_shards"), &enetHost_broadcast_shards);
+    enetHost.SquirrelFunc(_SC("broadcast_snapshot"), &enetHost_broadcast_snapshot);
+    enetHost.SquirrelFunc(_SC("capture"), &enetHost_capture);
+    enetHost.SquirrelFunc(_SC("channel_priority"), &enetHost_channel_priority);
     enetHost.SquirrelFunc(_SC("check_events"), &enetHost_check_events);
+    enetHost.SquirrelFunc(_SC("coalesce"), &enetHost_coalesce);
+    enetHost.SquirrelFunc(_SC("compress_with"), &enetHost_compress_with);
+    enetHost.SquirrelFunc(_SC("compression_stats"), &enetHost_compression_stats);
     enetHost.SquirrelFunc(_SC("connect"), &enetHost_connect);
+    enetHost.SquirrelFunc(_SC("connect_async"), &enetHost_connect_async);
+    enetHost.SquirrelFunc(_SC("destroy"), &enetHost_destroy);
+    enetHost.SquirrelFunc(_SC("dispatch"), &enetHost_dispatch);
+    enetHost.SquirrelFunc(_SC("flood_limit"), &enetHost_flood_limit);
+    enetHost.SquirrelFunc(_SC("flush"), &enetHost_flush);
+    enetHost.SquirrelFunc(_SC("forward"), &enetHost_forward);
+    enetHost.SquirrelFunc(_SC("impair"), &enetHost_impair);
+    enetHost.SquirrelFunc(_SC("interest_grid"), &enetHost_interest_grid);
+    enetHost.SquirrelFunc(_SC("on_connect"), &enetHost_on_connect);
+    enetHost.SquirrelFunc(_SC("on_disconnect"), &enetHost_on_disconnect);
+    enetHost.SquirrelFunc(_SC("on_event"), &enetHost_on_event);
+    enetHost.SquirrelFunc(_SC("on_receive"), &enetHost_on_receive);
+    enetHost.SquirrelFunc(_SC("peer_by_id"), &enetHost_peer_by_id);
+    enetHost.SquirrelFunc(_SC("post"), &enetHost_post);
+    enetHost.SquirrelFunc(_SC("profile"), &enetHost_profile);
+    enetHost.SquirrelFunc(_SC("profile_done"), &enetHost_profile_done);
+    enetHost.SquirrelFunc(_SC("profile_report"), &enetHost_profile_report);
+    enetHost.SquirrelFunc(_SC("rate_limit"), &enetHost_rate_limit);
+    enetHost.SquirrelFunc(_SC("receive_mode"), &enetHost_receive_mode);
+    enetHost.SquirrelFunc(_SC("replay"), &enetHost_replay);
+    enetHost.SquirrelFunc(_SC("run"), &enetHost_run);
+    enetHost.SquirrelFunc(_SC("send_budget"), &enetHost_send_budget);
+    enetHost.SquirrelFunc(_SC("send_to"), &enetHost_send_to);
+    enetHost.SquirrelFunc(_SC("serializer_keys"), &enetHost_serializer_keys);
     enetHost.SquirrelFunc(_SC("service"), &enetHost_service);
-    enetHost.GlobalFunc(_SC("bandwidth_limit"), &enet_host_bandwidth_limit);
+    enetHost.SquirrelFunc(_SC("service_batch"), &enetHost_service_batch);
+    enetHost.SquirrelFunc(_SC("snapshot_channel"), &enetHost_snapshot_channel);
+    enetHost.SquirrelFunc(_SC("start_thread"), &enetHost_start_thread);
+    enetHost.SquirrelFunc(_SC("stats"), &enetHost_stats);
+    enetHost.SquirrelFunc(_SC("stop_thread"), &enetHost_stop_thread);
+    enetHost.SquirrelFunc(_SC("stream_budget"), &enetHost_stream_budget);
+    enetHost.SquirrelFunc(_SC("stream_channel"), &enetHost_stream_channel);
+    enetHost.SquirrelFunc(_SC("stream_directory"), &enetHost_stream_directory);
+    enetHost.SquirrelFunc(_SC("supersede"), &enetHost_supersede);
+    enetHost.SquirrelFunc(_SC("write_profile"), &enetHost_write_profile);
+    enetHost.SquirrelFunc(_SC("write_stats"), &enetHost_write_stats);
+    enetHost.GlobalFunc(_SC("bandwidth_limit"), &enetHost_bandwidth_limit);
     enetHost.GlobalFunc(_SC("compress_with_range_coder"), &enetHost_compress_with_range_coder);
 
     namespaceTable.Bind(_SC("Host"), enetHost);
+    namespaceTable.Bind(_SC("Packet"), enetPacket);
+    namespaceTable.SquirrelFunc(_SC("allocator_stats"), &allocator_stats);
     namespaceTable.SquirrelFunc(_SC("host_create"), &host_create);
+    namespaceTable.SquirrelFunc(_SC("loopback_create"), &loopback_create);
+    namespaceTable.SquirrelFunc(_SC("resolve_ttl"), &resolve_ttl);
+}
+
+
+////////////////////////////////////////////////////////////
+// Initializes ENet with the pooled allocator
+////////////////////////////////////////////////////////////
+int InitializeEnetLib()
+{
+    ENetCallbacks callbacks;
+    callbacks.malloc = &pool_malloc;
+    callbacks.free = &pool_free;
+    callbacks.no_memory = NULL;
+    int result = enet_initialize_with_callbacks(ENET_VERSION, &callbacks);
+    if (result == 0) poolInstalled = true;
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////
+// Creates a group of hosts sharing one address, each serviced on its own network thread
+////////////////////////////////////////////////////////////
+EnetShardGroup* CreateEnetShardGroup(const char* address, std::size_t shardCount, std::size_t peerCount, std::size_t channelLimit)
+{
+    ENetAddress bind_address;
+    if (shardCount == 0 || parse_address(address, bind_address) != NULL) {
+        return NULL;
+    }
+    EnetShardGroup* group = new EnetShardGroup();
+    bool sharing = true;
+    for (std::size_t i = 0; i < shardCount; i++) {
+        // Create unbound so the socket can opt into port sharing before it binds
+        ENetHost* host = enet_host_create(NULL, peerCount, channelLimit, 0, 0);
+        if (host == NULL) {
+            DestroyEnetShardGroup(group);
+            return NULL;
+        }
+        group->hosts.push_back(host);
+        ENetAddress shard_address = bind_address;
+#if defined(SO_REUSEPORT)
+        int enable = 1;
+        if (sharing && setsockopt(host->socket, SOL_SOCKET, SO_REUSEPORT, (const char*) &enable, sizeof(enable)) < 0) {
+            // Refused at run time, e.g. by an older kernel, so this and later shards take their own ports
+            sharing = false;
+        }
+#else
+        sharing = false;
+#endif
+        // Without port sharing each shard listens on the next port up
+        if (!sharing && shard_address.port != ENET_PORT_ANY) shard_address.port += i;
+        if (enet_socket_bind(host->socket, &shard_address) < 0) {
+            DestroyEnetShardGroup(group);
+            return NULL;
+        }
+        if (enet_socket_get_address(host->socket, &host->address) < 0) {
+            host->address = shard_address;
+        }
+        attach_host_data(NULL, host);
+    }
+    for (std::size_t from = 0; from < shardCount; from++) {
+        for (std::size_t to = 0; to < shardCount; to++) {
+            group->mailboxes.push_back(from == to ? NULL : new EnetSpscQueue<EnetShardMessage>(4096));
+        }
+    }
+    for (std::size_t i = 0; i < shardCount; i++) {
+        EnetHostData* data = get_host_data(group->hosts[i]);
+        data->thread = new EnetHostThread(group->hosts[i], 4096, 1);
+        data->thread->shards = group;
+        data->thread->shardIndex = i;
+        data->thread->thread = std::thread(host_thread_main, data->thread);
+    }
+    return group;
+}
+
+
+////////////////////////////////////////////////////////////
+// Stops every shard's network thread and destroys the group and its hosts
+////////////////////////////////////////////////////////////
+void DestroyEnetShardGroup(EnetShardGroup* group)
+{
+    for (std::size_t i = 0; i < group->hosts.size(); i++) {
+        EnetHostData* data = get_host_data(group->hosts[i]);
+        if (data != NULL) stop_host_thread(data);
+    }
+    EnetShardMessage message;
+    for (std::size_t i = 0; i < group->mailboxes.size(); i++) {
+        if (group->mailboxes[i] == NULL) continue;
+        while (group->mailboxes[i]->pop(message)) {
+            if (--message.packet->referenceCount == 0) enet_packet_destroy(message.packet);
+        }
+        delete group->mailboxes[i];
+    }
+    for (std::size_t i = 0; i < group->hosts.size(); i++) {
+        destroy_host(group->hosts[i]);
+    }
+    delete group;
+}
+
+
+////////////////////////////////////////////////////////////
+// Registers one shard of a group in the given VM
+////////////////////////////////////////////////////////////
+void RegisterEnetShard(HSQUIRRELVM v, Sqrat::Table& namespaceTable, EnetShardGroup* group, std::size_t shardIndex)
+{
+    ENetHost* host = group->hosts[shardIndex];
+    get_host_data(host)->vm = v;
+    namespaceTable.SetInstance(_SC("shard"), host);
+    namespaceTable.SetValue(_SC("shard_index"), static_cast<SQInteger>(shardIndex));
+    namespaceTable.SetValue(_SC("shard_count"), static_cast<SQInteger>(group->hosts.size()));
 }
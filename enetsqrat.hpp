@@ -31,6 +31,31 @@
 #include <enet/enet.h>
 
 
+////////////////////////////////////////////////////////////
+// Initializes ENet with the binding's pooled allocator
+//
+// Use in place of enet_initialize, once per process. Packets
+// and ENet's internal commands are then served from per-size
+// free lists instead of malloc; enet.allocator_stats reports
+// how well that is working. Returns 0 on success.
+//
+////////////////////////////////////////////////////////////
+int InitializeEnetLib();
+
+
+////////////////////////////////////////////////////////////
+// Counts a script allocation against the event being profiled
+//
+// Call from the VM's sq_vm_malloc and sq_vm_realloc so
+// Host.profile_report can show allocations per event. They go
+// to the host whose events the calling thread's script is
+// handling. When no host is profiling it costs one thread-local
+// check.
+//
+////////////////////////////////////////////////////////////
+void CountEnetScriptAllocation(std::size_t size);
+
+
 ////////////////////////////////////////////////////////////
 // Initializes and registers the ENet library in the given VM
 //
@@ -42,4 +67,56 @@
 void RegisterEnetLib(HSQUIRRELVM v, Sqrat::Table& namespaceTable);
 
 
+////////////////////////////////////////////////////////////
+// Hosts sharing one address, each serviced on its own network thread
+////////////////////////////////////////////////////////////
+struct EnetShardGroup;
+
+
+////////////////////////////////////////////////////////////
+// Creates a group of hosts sharing one address, each serviced on its own network thread
+//
+// Parameters
+//  address      : Address to listen on, as accepted by enet.host_create
+//  shardCount   : Number of hosts (normally one per core)
+//  peerCount    : Maximum number of peers per host
+//  channelLimit : Maximum number of channels per peer
+//
+// Returns NULL on failure. Where the platform supports
+// SO_REUSEPORT every host binds the same port and the kernel
+// spreads clients between them; elsewhere shard i binds port + i.
+// If the socket option is refused at run time, that shard and
+// the ones after it fall back to port + i.
+//
+////////////////////////////////////////////////////////////
+EnetShardGroup* CreateEnetShardGroup(const char* address, std::size_t shardCount, std::size_t peerCount, std::size_t channelLimit);
+
+
+////////////////////////////////////////////////////////////
+// Stops every shard's network thread and destroys the group
+//
+// Parameters
+//  group : Group made by CreateEnetShardGroup; no VM may use its hosts afterwards
+//
+////////////////////////////////////////////////////////////
+void DestroyEnetShardGroup(EnetShardGroup* group);
+
+
+////////////////////////////////////////////////////////////
+// Registers one shard of a group in the given VM
+//
+// Binds the shard's host as enet.shard along with
+// enet.shard_index and enet.shard_count. Call after
+// RegisterEnetLib, from the thread that will run the VM.
+//
+// Parameters
+//  v              : The target VM
+//  namespaceTable : Table the library was bound to
+//  group          : Group made by CreateEnetShardGroup
+//  shardIndex     : Which shard this VM drives
+//
+////////////////////////////////////////////////////////////
+void RegisterEnetShard(HSQUIRRELVM v, Sqrat::Table& namespaceTable, EnetShardGroup* group, std::size_t shardIndex);
+
+
 #endif // ENETSQRAT_HPP
@@ -0,0 +1,435 @@
+////////////////////////////////////////////////////////////
+//
+// Correctness tests for the ENet Squirrel binding's wire formats
+//
+// Built as one translation unit with enetsqrat.cpp so the codecs'
+// internal functions can be called directly. Each test checks
+// round trips and that truncated or malformed input is refused
+// without reading past its end.
+//
+// Usage: enettests [test...]    (all tests when none are named)
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+// Headers
+////////////////////////////////////////////////////////////
+#include "enetsqrat.cpp"
+
+
+////////////////////////////////////////////////////////////
+static bool failed = false;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failed = true; \
+        } \
+    } while (0)
+
+
+////////////////////////////////////////////////////////////
+// Bytes that compress well, then a stretch that doesn't, from a fixed seed
+////////////////////////////////////////////////////////////
+static std::vector<enet_uint8> sample_bytes(std::size_t size, unsigned seed)
+{
+    static const char text[] = "position velocity rotation health ammo ";
+    std::vector<enet_uint8> bytes(size);
+    for (std::size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        bytes[i] = i < size / 2 ? (enet_uint8) text[i % (sizeof(text) - 1)] : (enet_uint8) (seed >> 16);
+    }
+    return bytes;
+}
+
+
+////////////////////////////////////////////////////////////
+// Packet holding a copy of the bytes, handed to the binding like a received one
+////////////////////////////////////////////////////////////
+static EnetScriptEvent receive_event(ENetHost* host, enet_uint8 channel_id, const enet_uint8* bytes, std::size_t length)
+{
+    EnetScriptEvent event;
+    event.type = ENET_EVENT_TYPE_RECEIVE;
+    event.peer = &host->peers[0];
+    event.channelID = channel_id;
+    event.packet = enet_packet_create(bytes, length, ENET_PACKET_FLAG_RELIABLE);
+    event.length = length;
+    return event;
+}
+
+
+////////////////////////////////////////////////////////////
+static void test_varint(HSQUIRRELVM)
+{
+    const SQUnsignedInteger values[] = { 0, 1, 127, 128, 300, 16383, 16384, 0xFFFFFFFF, ~(SQUnsignedInteger) 0 };
+    for (std::size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        EnetPacketBuffer out(16, 0);
+        CHECK(serial_write_varint(out, values[i]));
+        const enet_uint8* cursor = out.packet->data;
+        const enet_uint8* end = cursor + out.size();
+        SQUnsignedInteger value;
+        CHECK(serial_read_varint(cursor, end, value) && value == values[i] && cursor == end);
+
+        // Every strict prefix stops inside the varint
+        for (std::size_t length = 0; length < out.size(); length++) {
+            cursor = out.packet->data;
+            CHECK(!serial_read_varint(cursor, out.packet->data + length, value));
+        }
+    }
+
+    // More continuation bytes than the integer has bits must not shift past its width
+    enet_uint8 overlong[16];
+    std::memset(overlong, 0x80, sizeof(overlong));
+    overlong[sizeof(overlong) - 1] = 0x01;
+    const enet_uint8* cursor = overlong;
+    SQUnsignedInteger value;
+    CHECK(!serial_read_varint(cursor, overlong + sizeof(overlong), value));
+}
+
+
+////////////////////////////////////////////////////////////
+// Compiles and runs a script, leaving what it returns on the stack
+////////////////////////////////////////////////////////////
+static bool run_script(HSQUIRRELVM v, const SQChar* source)
+{
+    if (SQ_FAILED(sq_compilebuffer(v, source, (SQInteger) scstrlen(source), _SC("enettests"), SQTrue))) return false;
+    sq_pushroottable(v);
+    bool ok = SQ_SUCCEEDED(sq_call(v, 1, SQTrue, SQTrue));
+    sq_remove(v, ok ? -2 : -1);
+    return ok;
+}
+
+
+////////////////////////////////////////////////////////////
+static void test_serializer(HSQUIRRELVM v)
+{
+    SQInteger top = sq_gettop(v);
+    CHECK(run_script(v, _SC(
+        "::same <- function(a, b) {"
+        "    if (typeof a != typeof b) return false;"
+        "    if (typeof a == \"table\" || typeof a == \"array\") {"
+        "        if (a.len() != b.len()) return false;"
+        "        foreach (k, x in a) if (!(k in b) || !same(x, b[k])) return false;"
+        "        return true;"
+        "    }"
+        "    return a == b;"
+        "}")));
+    sq_settop(v, top);
+
+    // Repeated keys go out as references to the first copy
+    CHECK(run_script(v, _SC(
+        "return { n = null, t = true, f = false, i = -123456789, big = 0x7FFFFFFF, x = 0.5, s = \"hello\", e = \"\","
+        "         a = [1, [2, [3]], { t = \"v\" }], nested = { n = 1, t = false, i = [] } }")));
+    EnetPacketBuffer out(64, 0);
+    EnetSerializerState writer(NULL);
+    CHECK(SQ_SUCCEEDED(serialize_value(v, -1, out, writer, false, 0)));
+
+    EnetSerializerState reader(NULL);
+    const enet_uint8* cursor = out.packet->data;
+    const enet_uint8* end = cursor + out.size();
+    CHECK(deserialize_value(v, cursor, end, reader, false, 0) && cursor == end);
+    CHECK(sq_gettop(v) == top + 2);
+    sq_pushroottable(v);
+    sq_pushstring(v, _SC("same"), -1);
+    CHECK(SQ_SUCCEEDED(sq_get(v, -2)));
+    sq_pushroottable(v);
+    sq_push(v, top + 1);
+    sq_push(v, top + 2);
+    SQBool same = SQFalse;
+    CHECK(SQ_SUCCEEDED(sq_call(v, 3, SQTrue, SQTrue)) && SQ_SUCCEEDED(sq_getbool(v, -1, &same)) && same);
+    sq_settop(v, top);
+
+    // Every strict prefix is refused and leaves the stack as it was
+    for (std::size_t length = 0; length < out.size(); length++) {
+        EnetSerializerState state(NULL);
+        cursor = out.packet->data;
+        CHECK(!deserialize_value(v, cursor, out.packet->data + length, state, false, 0));
+        CHECK(sq_gettop(v) == top);
+    }
+
+    // Nesting past SERIAL_MAX_DEPTH
+    std::vector<enet_uint8> deep;
+    for (int i = 0; i <= SERIAL_MAX_DEPTH + 1; i++) {
+        deep.push_back(SERIAL_ARRAY);
+        deep.push_back(1);
+    }
+    deep.push_back(SERIAL_NULL);
+
+    // A key reference with no keys seen, a preset key with no host, a null key, an unknown tag and a string past the end
+    const enet_uint8 keyRef[] = { SERIAL_TABLE, 1, SERIAL_KEY_REF, 0, SERIAL_NULL };
+    const enet_uint8 presetRef[] = { SERIAL_TABLE, 1, SERIAL_PRESET_KEY_REF, 0, SERIAL_NULL };
+    const enet_uint8 nullKey[] = { SERIAL_TABLE, 1, SERIAL_NULL, SERIAL_TRUE };
+    const enet_uint8 unknown[] = { 0xEE };
+    const enet_uint8 longString[] = { SERIAL_STRING, 0x7F, 'a' };
+    const std::pair<const enet_uint8*, std::size_t> malformed[] = {
+        std::make_pair(&deep[0], deep.size()),
+        std::make_pair(keyRef, sizeof(keyRef)),
+        std::make_pair(presetRef, sizeof(presetRef)),
+        std::make_pair(nullKey, sizeof(nullKey)),
+        std::make_pair(unknown, sizeof(unknown)),
+        std::make_pair(longString, sizeof(longString))
+    };
+    for (std::size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        EnetSerializerState state(NULL);
+        cursor = malformed[i].first;
+        CHECK(!deserialize_value(v, cursor, malformed[i].first + malformed[i].second, state, false, 0));
+        CHECK(sq_gettop(v) == top);
+    }
+}
+
+
+////////////////////////////////////////////////////////////
+// Compresses the bytes, split over two buffers as ENet hands them over, and checks they come back
+////////////////////////////////////////////////////////////
+static std::vector<enet_uint8> lz_round_trip(int level, const std::vector<enet_uint8>& dictionary, const std::vector<enet_uint8>& bytes)
+{
+    EnetCompressionStats stats;
+    EnetLzCompressor compressor(level, dictionary.empty() ? NULL : &dictionary[0], dictionary.size(), &stats);
+    EnetLzCompressor decompressor(level, dictionary.empty() ? NULL : &dictionary[0], dictionary.size(), &stats);
+    ENetBuffer buffers[2];
+    buffers[0].data = (void*) &bytes[0];
+    buffers[0].dataLength = bytes.size() / 3;
+    buffers[1].data = (void*) &bytes[bytes.size() / 3];
+    buffers[1].dataLength = bytes.size() - bytes.size() / 3;
+    std::vector<enet_uint8> compressed(bytes.size());
+    std::size_t size = lz_compress(&compressor, buffers, 2, bytes.size(), &compressed[0], compressed.size());
+    CHECK(size > 0 && size < bytes.size());
+    compressed.resize(size);
+    std::vector<enet_uint8> restored(bytes.size());
+    CHECK(lz_decompress(&decompressor, &compressed[0], compressed.size(), &restored[0], restored.size()) == bytes.size());
+    CHECK(restored == bytes);
+
+    // One byte short of room is refused
+    CHECK(lz_decompress(&decompressor, &compressed[0], compressed.size(), &restored[0], restored.size() - 1) == 0);
+    return compressed;
+}
+
+
+////////////////////////////////////////////////////////////
+static void test_lz(HSQUIRRELVM)
+{
+    std::vector<enet_uint8> none;
+    std::vector<enet_uint8> bytes = sample_bytes(1400, 1);
+    for (int level = 1; level <= LZ_MAX_LEVEL; level += LZ_MAX_LEVEL - 1) {
+        lz_round_trip(level, none, bytes);
+    }
+
+    // Runs long enough to need extra length bytes for both literals and matches
+    std::vector<enet_uint8> runs(4000, 0);
+    std::vector<enet_uint8> noise = sample_bytes(1200, 2);
+    std::copy(noise.begin() + 600, noise.end(), runs.begin() + 1000);
+    std::vector<enet_uint8> compressed = lz_round_trip(1, none, runs);
+
+    // A truncated stream may stop between sequences, but never yields more than a prefix
+    EnetCompressionStats stats;
+    EnetLzCompressor plain(1, NULL, 0, &stats);
+    std::vector<enet_uint8> restored(runs.size());
+    for (std::size_t length = 0; length < compressed.size(); length++) {
+        std::size_t size = lz_decompress(&plain, &compressed[0], length, &restored[0], restored.size());
+        CHECK(size <= runs.size() && std::equal(restored.begin(), restored.begin() + size, runs.begin()));
+    }
+
+    // Matches may reach back into the dictionary, which the other end must share
+    std::vector<enet_uint8> dictionary = sample_bytes(300, 3);
+    std::vector<enet_uint8> message(dictionary.begin() + 150, dictionary.end());
+    message.insert(message.end(), dictionary.begin() + 150, dictionary.end());
+    compressed = lz_round_trip(1, dictionary, message);
+    CHECK(lz_decompress(&plain, &compressed[0], compressed.size(), &restored[0], message.size()) == 0);
+
+    // Back-references to before the start of the output, or with no offset at all
+    const enet_uint8 beforeStart[] = { 0x10, 'a', 0x02, 0x00 };
+    const enet_uint8 zeroOffset[] = { 0x10, 'a', 0x00, 0x00 };
+    const enet_uint8 noOffset[] = { 0x10, 'a', 0x01 };
+    const enet_uint8 longLiterals[] = { 0xF0, 0xFF };
+    CHECK(lz_decompress(&plain, beforeStart, sizeof(beforeStart), &restored[0], restored.size()) == 0);
+    CHECK(lz_decompress(&plain, zeroOffset, sizeof(zeroOffset), &restored[0], restored.size()) == 0);
+    CHECK(lz_decompress(&plain, noOffset, sizeof(noOffset), &restored[0], restored.size()) == 0);
+    CHECK(lz_decompress(&plain, longLiterals, sizeof(longLiterals), &restored[0], restored.size()) == 0);
+}
+
+
+////////////////////////////////////////////////////////////
+// Feeds a snapshot channel message to the host, returning whether a snapshot came out and what it was
+////////////////////////////////////////////////////////////
+static bool feed_snapshot(ENetHost* host, const EnetPacketBuffer& message, std::vector<enet_uint8>& snapshot)
+{
+    EnetHostData* data = get_host_data(host);
+    EnetScriptEvent event = receive_event(host, (enet_uint8) data->snapshotChannel, message.packet->data, message.size());
+    if (!read_snapshot(data, event)) return false;
+    snapshot.assign(event.packet->data, event.packet->data + event.length);
+    release_event_packet(event);
+    return true;
+}
+
+
+////////////////////////////////////////////////////////////
+static EnetPacketBuffer snapshot_message(enet_uint8 kind, enet_uint32 sequence, const std::vector<enet_uint8>& bytes, enet_uint32 baseSequence, const std::vector<enet_uint8>* base)
+{
+    EnetPacketBuffer out(bytes.size() + 16, 0);
+    *out.append(1) = kind;
+    serial_write_varint(out, sequence);
+    if (kind == SNAPSHOT_KEYFRAME) {
+        std::memcpy(out.append(bytes.size()), &bytes[0], bytes.size());
+    } else {
+        serial_write_varint(out, bytes.size());
+        serial_write_varint(out, baseSequence);
+        snapshot_delta(out, &bytes[0], bytes.size(), *base);
+    }
+    return out;
+}
+
+
+////////////////////////////////////////////////////////////
+static void test_snapshot(HSQUIRRELVM v)
+{
+    ENetHost* host = enet_host_create(NULL, 1, 2, 0, 0);
+    CHECK(host != NULL);
+    if (host == NULL) return;
+    attach_host_data(v, host);
+    EnetHostData* data = get_host_data(host);
+    data->snapshotChannel = 1;
+
+    std::vector<enet_uint8> first = sample_bytes(300, 4);
+    std::vector<enet_uint8> snapshot;
+    CHECK(feed_snapshot(host, snapshot_message(SNAPSHOT_KEYFRAME, 1, first, 0, NULL), snapshot) && snapshot == first);
+
+    // Grown with a few changes, then shrunk again
+    std::vector<enet_uint8> second = first;
+    second[10] ^= 1;
+    second[200] ^= 0xFF;
+    second.resize(340, 7);
+    EnetPacketBuffer delta = snapshot_message(SNAPSHOT_DELTA, 2, second, 1, &first);
+    CHECK(delta.size() < second.size());
+    CHECK(feed_snapshot(host, delta, snapshot) && snapshot == second);
+    std::vector<enet_uint8> third(second.begin(), second.begin() + 250);
+    third[249] ^= 0x55;
+    CHECK(feed_snapshot(host, snapshot_message(SNAPSHOT_DELTA, 3, third, 2, &second), snapshot) && snapshot == third);
+
+    // A delta whose baseline is gone is counted and asks for a keyframe
+    CHECK(!feed_snapshot(host, snapshot_message(SNAPSHOT_DELTA, 10, third, 7, &second), snapshot));
+    CHECK(data->snapshots.undecodable == 1);
+
+    // With a single run of changes, any cut after the header leaves it unfinished
+    std::vector<enet_uint8> fourth = third;
+    for (std::size_t i = 100; i < 110; i++) fourth[i] ^= 0x5A;
+    delta = snapshot_message(SNAPSHOT_DELTA, 20, fourth, 3, &third);
+    std::size_t header = snapshot_message(SNAPSHOT_DELTA, 20, third, 3, &third).size();
+    for (std::size_t length = header + 1; length < delta.size(); length++) {
+        EnetPacketBuffer cut(length, 0);
+        std::memcpy(cut.append(length), delta.packet->data, length);
+        CHECK(!feed_snapshot(host, cut, snapshot));
+    }
+
+    // Runs reaching past the snapshot's length
+    EnetPacketBuffer past(32, 0);
+    *past.append(1) = SNAPSHOT_DELTA;
+    serial_write_varint(past, 30);
+    serial_write_varint(past, 4);
+    serial_write_varint(past, 3);
+    serial_write_varint(past, 2);
+    serial_write_varint(past, 3);
+    std::memset(past.append(3), 1, 3);
+    CHECK(!feed_snapshot(host, past, snapshot));
+
+    CHECK(feed_snapshot(host, delta, snapshot) && snapshot == fourth);
+    destroy_host(host);
+}
+
+
+////////////////////////////////////////////////////////////
+static void test_coalesce(HSQUIRRELVM v)
+{
+    ENetHost* host = enet_host_create(NULL, 1, 2, 0, 0);
+    CHECK(host != NULL);
+    if (host == NULL) return;
+    attach_host_data(v, host);
+    EnetHostData* data = get_host_data(host);
+
+    // A short message, one needing a two byte length and an empty one
+    std::vector<enet_uint8> messages[3] = { std::vector<enet_uint8>(1, 'a'), sample_bytes(200, 5), std::vector<enet_uint8>() };
+    EnetPacketBuffer framed(256, 0);
+    for (std::size_t i = 0; i < 3; i++) {
+        serial_write_varint(framed, messages[i].size());
+        if (!messages[i].empty()) std::memcpy(framed.append(messages[i].size()), &messages[i][0], messages[i].size());
+    }
+    EnetScriptEvent event = receive_event(host, 0, framed.packet->data, framed.size());
+    CHECK(split_coalesced(data, event));
+    CHECK(data->backlog.size() == 2 && event.packet->referenceCount == 3);
+    data->backlog.push_front(event);
+    for (std::size_t i = 0; i < 3 && !data->backlog.empty(); i++) {
+        EnetScriptEvent message = data->backlog.front();
+        data->backlog.pop_front();
+        CHECK(message.shared && message.length == messages[i].size());
+        CHECK(std::equal(messages[i].begin(), messages[i].end(), message.packet->data + message.offset));
+        release_event_packet(message);
+    }
+
+    // What frame_message makes comes back out whole
+    ENetPacket* single = frame_message(&messages[1][0], messages[1].size(), ENET_PACKET_FLAG_RELIABLE);
+    event = receive_event(host, 0, single->data, single->dataLength);
+    enet_packet_destroy(single);
+    CHECK(split_coalesced(data, event) && data->backlog.empty());
+    CHECK(event.length == messages[1].size() && std::equal(messages[1].begin(), messages[1].end(), event.packet->data + event.offset));
+    release_event_packet(event);
+
+    // A length past the end, a length cut short and an empty packet are dropped whole
+    const enet_uint8 tooLong[] = { 1, 'a', 5, 'b' };
+    const enet_uint8 cutLength[] = { 1, 'a', 0x80 };
+    event = receive_event(host, 0, tooLong, sizeof(tooLong));
+    CHECK(!split_coalesced(data, event));
+    event = receive_event(host, 0, cutLength, sizeof(cutLength));
+    CHECK(!split_coalesced(data, event));
+    event = receive_event(host, 0, NULL, 0);
+    CHECK(!split_coalesced(data, event));
+    CHECK(data->backlog.empty());
+    destroy_host(host);
+}
+
+
+////////////////////////////////////////////////////////////
+struct EnetTest
+{
+    const char* name;
+    void (*run)(HSQUIRRELVM v);
+};
+
+static const EnetTest tests[] = {
+    { "varint", &test_varint },
+    { "serializer", &test_serializer },
+    { "lz", &test_lz },
+    { "snapshot", &test_snapshot },
+    { "coalesce", &test_coalesce }
+};
+
+
+////////////////////////////////////////////////////////////
+int main(int argc, char** argv)
+{
+    if (enet_initialize() != 0) {
+        std::fprintf(stderr, "Failed to initialize ENet\n");
+        return 1;
+    }
+    HSQUIRRELVM v = sq_open(1024);
+    int matched = 0;
+    for (std::size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool wanted = argc == 1;
+        for (int arg = 1; arg < argc; arg++) {
+            if (std::strcmp(argv[arg], tests[i].name) == 0) wanted = true;
+        }
+        if (!wanted) continue;
+        matched++;
+        bool before = failed;
+        failed = false;
+        tests[i].run(v);
+        std::printf("%s: %s\n", tests[i].name, failed ? "FAILED" : "ok");
+        failed = failed || before;
+    }
+    sq_close(v);
+    enet_deinitialize();
+    if (matched == 0) {
+        std::fprintf(stderr, "Usage: %s [test...]\n", argv[0]);
+        return 1;
+    }
+    return failed ? 1 : 0;
+}